@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ChaCha20-Poly1305 authenticated encryption (RFC 8439): a 256-bit key, a 96-bit nonce that must
+// never repeat under one key, and a 128-bit tag over the additional data and the ciphertext.
+#define AEAD_KEY_SIZE   32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE   16
+
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[AEAD_KEY_SIZE],
+    const uint8_t nonce[AEAD_NONCE_SIZE], uint32_t counter);
+
+void poly1305(uint8_t tag[AEAD_TAG_SIZE], const uint8_t *msg, size_t len, const uint8_t key[32]);
+
+void aead_seal(uint8_t *out, uint8_t tag[AEAD_TAG_SIZE], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aad_len, const uint8_t key[AEAD_KEY_SIZE],
+    const uint8_t nonce[AEAD_NONCE_SIZE]);
+
+bool aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t tag[AEAD_TAG_SIZE],
+    const uint8_t *aad, size_t aad_len, const uint8_t key[AEAD_KEY_SIZE],
+    const uint8_t nonce[AEAD_NONCE_SIZE]);
+
+bool aead_self_test(void);
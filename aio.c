@@ -0,0 +1,336 @@
+#include "aio.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// One request: a buffer being transferred, and its outcome once it has completed.
+typedef struct {
+    struct iovec iov; // the buffer, as io_uring's readv and writev take it
+    uint64_t offset; // file offset, for positional requests
+    bool pending; // submitted and not yet completed
+    bool done; // completed and not yet waited for
+    ssize_t result; // bytes transferred, or -errno
+} aio_slot_t;
+
+// The shared rings of an io_uring instance, mapped into the process.
+typedef struct {
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} aio_ring_t;
+
+struct aio {
+    FILE *file;
+    bool writing;
+    bool uring; // requests go to the file descriptor through io_uring, at explicit offsets
+    uint64_t offset; // offset of the next positional request
+    uint32_t depth;
+    aio_slot_t slots[AIO_DEPTH_MAX];
+    aio_ring_t ring;
+    // thread backend: a helper transfers queued slots through the stdio stream, in order
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // signalled when a slot is queued or the helper should stop
+    pthread_cond_t finished; // signalled when the helper completes a slot
+    uint32_t queue[AIO_DEPTH_MAX];
+    uint32_t head, count;
+    bool stop;
+};
+
+// Sets up an io_uring instance of entries entries. Returns false if the kernel does not provide
+// io_uring or refuses it, e.g. under a seccomp filter.
+static bool aio_ring_init(aio_ring_t *ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(aio_ring_t));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        ring->sq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_map != MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_size);
+        }
+        if (!single && ring->cq_map != MAP_FAILED) {
+            munmap(ring->cq_map, ring->cq_size);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return false;
+    }
+    uint8_t *sq = (uint8_t *) ring->sq_map, *cq = (uint8_t *) ring->cq_map;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+// Unmaps and closes an io_uring instance.
+static void aio_ring_clear(aio_ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_size);
+    }
+    munmap(ring->sq_map, ring->sq_size);
+    close(ring->fd);
+}
+
+// Completes the request of a slot with error, so that aio_wait() returns -1 for it.
+static void aio_slot_fail(aio_slot_t *slot, int error) {
+    slot->result = -error;
+    slot->pending = false;
+    slot->done = true;
+}
+
+// Queues a readv or writev of the slot's buffer at its offset and submits it. If the kernel does
+// not take it, the entry is withdrawn and the request fails with the error.
+static void aio_ring_submit(aio_t *aio, uint32_t index) {
+    aio_ring_t *ring = &aio->ring;
+    aio_slot_t *slot = &aio->slots[index];
+    unsigned tail = *ring->sq_tail; // only this thread produces submissions
+    unsigned entry = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[entry];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = aio->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fileno(aio->file);
+    sqe->addr = (uint64_t) (uintptr_t) &slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    ring->sq_array[entry] = entry;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    long got;
+    do {
+        got = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got < 1) {
+        // the kernel only reads entries while entering, so taking this one back is safe
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        aio_slot_fail(slot, got < 0 ? errno : EAGAIN);
+    }
+}
+
+// Marks the completions posted so far, waiting for at least one if none are. If waiting fails,
+// every request in flight fails with the error, since none of their completions can be collected.
+static void aio_ring_reap(aio_t *aio) {
+    aio_ring_t *ring = &aio->ring;
+    unsigned head = *ring->cq_head; // only this thread consumes completions
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        long got = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (got < 0 && errno != EINTR) {
+            int error = errno;
+            for (uint32_t i = 0; i < aio->depth; i++) {
+                if (aio->slots[i].pending) {
+                    aio_slot_fail(&aio->slots[i], error);
+                }
+            }
+            return;
+        }
+    }
+    for (; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        aio_slot_t *slot = &aio->slots[cqe->user_data];
+        slot->result = cqe->res;
+        slot->pending = false;
+        slot->done = true;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Body of the helper thread: transfers queued slots through the stream, in order.
+static void *aio_main(void *data) {
+    aio_t *aio = (aio_t *) data;
+    pthread_mutex_lock(&aio->lock);
+    while (true) {
+        while (!aio->stop && aio->count == 0) {
+            pthread_cond_wait(&aio->queued, &aio->lock);
+        }
+        if (aio->count == 0) {
+            break;
+        }
+        aio_slot_t *slot = &aio->slots[aio->queue[aio->head]];
+        pthread_mutex_unlock(&aio->lock);
+        size_t len = slot->iov.iov_len;
+        ssize_t result;
+        if (aio->writing) {
+            size_t written = fwrite(slot->iov.iov_base, sizeof(uint8_t), len, aio->file);
+            result = written == len ? (ssize_t) len : -EIO;
+        } else {
+            result = (ssize_t) fread(slot->iov.iov_base, sizeof(uint8_t), len, aio->file);
+            result = result == 0 && ferror(aio->file) ? -EIO : result;
+        }
+        pthread_mutex_lock(&aio->lock);
+        slot->result = result;
+        slot->pending = false;
+        slot->done = true;
+        aio->head = (aio->head + 1) % AIO_DEPTH_MAX;
+        aio->count -= 1;
+        pthread_cond_broadcast(&aio->finished);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+// Opens asynchronous reads (or writes, if writing is set) of file, continuing from its current
+// position, with up to depth requests at a time. Regular files are transferred through io_uring at
+// explicit offsets, bypassing the stream, which is flushed first when writing. Other files, and
+// every file if io_uring is unavailable or the environment variable RSA_AIO is set to thread,
+// are transferred through the stream by a helper thread. The stream must not be used until
+// aio_close(); its position is then unspecified for positional transfers.
+aio_t *aio_open(FILE *file, bool writing, uint32_t depth) {
+    aio_t *aio = (aio_t *) calloc(1, sizeof(aio_t));
+    aio->file = file;
+    aio->writing = writing;
+    aio->depth = depth < 1 ? 1 : depth > AIO_DEPTH_MAX ? AIO_DEPTH_MAX : depth;
+    if (writing) {
+        fflush(file);
+    }
+    struct stat st;
+    long offset = ftell(file);
+    const char *backend = getenv("RSA_AIO");
+    bool thread = backend != NULL && strcmp(backend, "thread") == 0;
+    if (!thread && offset >= 0 && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)
+        && aio_ring_init(&aio->ring, aio->depth)) {
+        aio->uring = true;
+        aio->offset = (uint64_t) offset;
+        return aio;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->queued, NULL);
+    pthread_cond_init(&aio->finished, NULL);
+    pthread_create(&aio->thread, NULL, aio_main, aio);
+    return aio;
+}
+
+// Returns true if transfers go to explicit file offsets rather than through the stream.
+bool aio_positional(const aio_t *aio) {
+    return aio->uring;
+}
+
+// Returns the name of the mechanism transferring the buffers.
+const char *aio_backend(const aio_t *aio) {
+    return aio->uring ? "io_uring" : "thread";
+}
+
+// Starts transferring the len bytes at buf, which must stay untouched until the slot has been
+// waited for. The slot must not hold a request that has not been waited for.
+void aio_submit(aio_t *aio, uint32_t slot, uint8_t *buf, size_t len) {
+    aio_slot_t *s = &aio->slots[slot];
+    s->iov.iov_base = buf;
+    s->iov.iov_len = len;
+    s->pending = true;
+    s->done = false;
+    s->result = 0;
+    if (aio->uring) {
+        s->offset = aio->offset;
+        aio->offset += len;
+        aio_ring_submit(aio, slot);
+        return;
+    }
+    pthread_mutex_lock(&aio->lock);
+    aio->queue[(aio->head + aio->count) % AIO_DEPTH_MAX] = slot;
+    aio->count += 1;
+    pthread_cond_signal(&aio->queued);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+// Waits for the request of a slot and returns the number of bytes it transferred: all of them,
+// unless a read reached the end of the file. Returns -1 with errno set if the transfer failed,
+// and 0 if the slot holds no request.
+ssize_t aio_wait(aio_t *aio, uint32_t slot) {
+    aio_slot_t *s = &aio->slots[slot];
+    if (aio->uring) {
+        while (s->pending) {
+            aio_ring_reap(aio);
+        }
+        // finish a short transfer, e.g. one interrupted by a signal, synchronously
+        uint8_t *buf = (uint8_t *) s->iov.iov_base;
+        while (s->done && s->result >= 0 && (size_t) s->result < s->iov.iov_len) {
+            size_t left = s->iov.iov_len - s->result;
+            off_t at = (off_t) (s->offset + s->result);
+            ssize_t more = aio->writing ? pwrite(fileno(aio->file), buf + s->result, left, at)
+                                        : pread(fileno(aio->file), buf + s->result, left, at);
+            if (more <= 0) {
+                s->result = more < 0 ? -errno : s->result;
+                break;
+            }
+            s->result += more;
+        }
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        while (s->pending) {
+            pthread_cond_wait(&aio->finished, &aio->lock);
+        }
+        pthread_mutex_unlock(&aio->lock);
+    }
+    if (!s->done) {
+        return 0;
+    }
+    s->done = false;
+    if (s->result < 0) {
+        errno = (int) -s->result;
+        return -1;
+    }
+    return s->result;
+}
+
+// Waits for every request still in flight and frees the transfers.
+void aio_close(aio_t **aio) {
+    aio_t *a = *aio;
+    if (a == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < a->depth; i++) {
+        aio_wait(a, i);
+    }
+    if (a->uring) {
+        aio_ring_clear(&a->ring);
+    } else {
+        pthread_mutex_lock(&a->lock);
+        a->stop = true;
+        pthread_cond_signal(&a->queued);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->thread, NULL);
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->queued);
+        pthread_cond_destroy(&a->finished);
+    }
+    free(a);
+    *aio = NULL;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Asynchronous sequential reads or writes of whole buffers on one file, each request occupying one
+// of up to AIO_DEPTH_MAX slots until it is waited for. Requests transfer consecutive parts of the
+// file in the order they were submitted.
+#define AIO_DEPTH_MAX 8
+
+typedef struct aio aio_t;
+
+aio_t *aio_open(FILE *file, bool writing, uint32_t depth);
+
+bool aio_positional(const aio_t *aio);
+
+const char *aio_backend(const aio_t *aio);
+
+void aio_submit(aio_t *aio, uint32_t slot, uint8_t *buf, size_t len);
+
+ssize_t aio_wait(aio_t *aio, uint32_t slot);
+
+void aio_close(aio_t **aio);
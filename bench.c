@@ -0,0 +1,325 @@
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "hvb:r:i:l:s:o:" // Valid inputs
+
+#define BENCH_SEED    2021 // default seed, so that every run benchmarks the same numbers
+#define BENCH_REPS    5 // default timed samples per benchmark
+#define BENCH_ITERS   50 // default Miller-Rabin iterations, as in keygen
+#define BENCH_PAYLOAD (16 * 1024) // default bytes encrypted and decrypted per file sample
+#define BENCH_BATCH   1000 // operations per sample for gcd() and mod_inverse()
+
+// Inputs shared by the benchmarks of one modulus size.
+typedef struct {
+    uint64_t bits; // modulus size
+    uint64_t iters; // Miller-Rabin iterations
+    mpz_t base, exponent, modulus, out; // pow_mod() operands, modulus odd and bits long
+    mpz_t a[BENCH_BATCH], b[BENCH_BATCH]; // gcd() and mod_inverse() operands
+    mpz_t prime; // prime of bits / 2 bits, as found in a key of this size
+    mpz_t p, q, n, e, d; // key used by the file benchmarks
+    rsa_crt_t crt;
+    FILE *plain, *cipher, *sink; // payload, its ciphertext, and a scratch output
+} bench_ctx_t;
+
+typedef void (*bench_op_t)(bench_ctx_t *ctx);
+
+// prints help page
+static void help() {
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Benchmarks the number theory and RSA primitives, printing JSON.\n\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./bench [-hv] [-b bits] [-r reps] [-i iters] [-l bytes] [-s seed] "
+                    "[-o outfile]\n\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Report progress on stderr.\n");
+    fprintf(stderr, "   -b bits         Benchmark only this modulus size (default: 1024, 2048, "
+                    "3072 and 4096).\n");
+    fprintf(stderr, "   -r reps         Timed samples per benchmark (default: %d).\n", BENCH_REPS);
+    fprintf(stderr, "   -i iters        Miller-Rabin iterations for is_prime and make_prime "
+                    "(default: %d).\n",
+        BENCH_ITERS);
+    fprintf(stderr, "   -l bytes        Payload of the file benchmarks (default: %d).\n",
+        BENCH_PAYLOAD);
+    fprintf(stderr, "   -s seed         Random seed (default: %d).\n", BENCH_SEED);
+    fprintf(stderr, "   -o outfile      Output file for the JSON report (default: stdout).\n");
+}
+
+// Returns the current monotonic time in nanoseconds.
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Compares two sample times for qsort().
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the nearest-rank percentile pct of the count sorted samples.
+static uint64_t bench_percentile(const uint64_t *samples, uint32_t count, uint32_t pct) {
+    uint32_t rank = (pct * count + 99) / 100; // ceil(pct / 100 * count)
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Times reps samples of batch calls to op, after one untimed call that warms up caches and
+// allocations, then writes the per-operation statistics as one JSON object to out. bytes is the
+// payload of one call, or 0 for operations without one.
+static void bench_run(FILE *out, bool *first, const char *name, bench_ctx_t *ctx, bench_op_t op,
+    uint32_t reps, uint32_t batch, uint64_t bytes, bool verbose) {
+    uint64_t *samples = (uint64_t *) malloc(reps * sizeof(uint64_t));
+    uint64_t total = 0;
+    if (verbose) {
+        fprintf(stderr, "%s %" PRIu64 "\n", name, ctx->bits);
+    }
+    op(ctx);
+    for (uint32_t i = 0; i < reps; i++) {
+        uint64_t start = bench_now();
+        for (uint32_t j = 0; j < batch; j++) {
+            op(ctx);
+        }
+        samples[i] = (bench_now() - start) / batch;
+        total += samples[i];
+    }
+    qsort(samples, reps, sizeof(uint64_t), bench_cmp);
+    double mean = (double) total / reps;
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"bits\": %" PRIu64 ", \"samples\": %" PRIu32,
+        *first ? "" : ",", name, ctx->bits, reps);
+    fprintf(out, ", \"ops_per_sec\": %.3f", 1e9 / mean);
+    if (bytes > 0) {
+        fprintf(out, ", \"mb_per_sec\": %.3f", bytes / mean * 1e9 / (1024 * 1024));
+    }
+    fprintf(out, ", \"mean_ns\": %.0f, \"min_ns\": %" PRIu64, mean, samples[0]);
+    fprintf(out,
+        ", \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+        ", \"max_ns\": %" PRIu64 "}",
+        bench_percentile(samples, reps, 50), bench_percentile(samples, reps, 90),
+        bench_percentile(samples, reps, 99), samples[reps - 1]);
+    *first = false;
+    free(samples);
+}
+
+static void op_pow_mod(bench_ctx_t *ctx) {
+    pow_mod(ctx->out, ctx->base, ctx->exponent, ctx->modulus);
+}
+
+static void op_mpz_powm(bench_ctx_t *ctx) {
+    mpz_powm(ctx->out, ctx->base, ctx->exponent, ctx->modulus);
+}
+
+static void op_is_prime(bench_ctx_t *ctx) {
+    is_prime(ctx->prime, ctx->iters);
+}
+
+static void op_make_prime(bench_ctx_t *ctx) {
+    make_prime(ctx->out, ctx->bits / 2, ctx->iters);
+}
+
+// Runs one of the BENCH_BATCH operand pairs per call, cycling through them.
+static uint32_t pair_index = 0;
+
+static void op_gcd(bench_ctx_t *ctx) {
+    gcd(ctx->out, ctx->a[pair_index], ctx->b[pair_index]);
+    pair_index = (pair_index + 1) % BENCH_BATCH;
+}
+
+static void op_mpz_gcd(bench_ctx_t *ctx) {
+    mpz_gcd(ctx->out, ctx->a[pair_index], ctx->b[pair_index]);
+    pair_index = (pair_index + 1) % BENCH_BATCH;
+}
+
+static void op_mod_inverse(bench_ctx_t *ctx) {
+    mod_inverse(ctx->out, ctx->a[pair_index], ctx->b[pair_index]);
+    pair_index = (pair_index + 1) % BENCH_BATCH;
+}
+
+static void op_mpz_invert(bench_ctx_t *ctx) {
+    mpz_invert(ctx->out, ctx->a[pair_index], ctx->b[pair_index]);
+    pair_index = (pair_index + 1) % BENCH_BATCH;
+}
+
+static void op_rsa_make_pub(bench_ctx_t *ctx) {
+    mpz_t p, q, n, e;
+    mpz_inits(p, q, n, e, NULL);
+    rsa_make_pub(p, q, n, e, ctx->bits, ctx->iters);
+    mpz_clears(p, q, n, e, NULL);
+}
+
+static void op_rsa_encrypt_file(bench_ctx_t *ctx) {
+    rewind(ctx->plain);
+    rewind(ctx->sink);
+    rsa_encrypt_file(ctx->plain, ctx->sink, ctx->n, ctx->e);
+    fflush(ctx->sink);
+}
+
+static void op_rsa_decrypt_file(bench_ctx_t *ctx) {
+    rewind(ctx->cipher);
+    rewind(ctx->sink);
+    rsa_decrypt_file(ctx->cipher, ctx->sink, ctx->n, ctx->d);
+    fflush(ctx->sink);
+}
+
+static void op_rsa_decrypt_file_crt(bench_ctx_t *ctx) {
+    rewind(ctx->cipher);
+    rewind(ctx->sink);
+    rsa_decrypt_file_crt(ctx->cipher, ctx->sink, ctx->n, ctx->d, &ctx->crt);
+    fflush(ctx->sink);
+}
+
+// Draws the inputs for one modulus size from the global random state. The file benchmarks use
+// a key made the way keygen makes it by default.
+static bool bench_ctx_init(bench_ctx_t *ctx, uint64_t bits, uint64_t iters, uint64_t payload) {
+    ctx->bits = bits;
+    ctx->iters = iters;
+    mpz_inits(ctx->base, ctx->exponent, ctx->modulus, ctx->out, ctx->prime, NULL);
+    mpz_inits(ctx->p, ctx->q, ctx->n, ctx->e, ctx->d, NULL);
+    mpz_urandomb(ctx->modulus, state, bits);
+    mpz_setbit(ctx->modulus, bits - 1); // exactly bits long
+    mpz_setbit(ctx->modulus, 0); // odd, like every RSA modulus
+    mpz_urandomm(ctx->base, state, ctx->modulus);
+    mpz_urandomb(ctx->exponent, state, bits);
+    for (uint32_t i = 0; i < BENCH_BATCH; i++) {
+        mpz_inits(ctx->a[i], ctx->b[i], NULL);
+        mpz_urandomb(ctx->a[i], state, bits);
+        mpz_urandomb(ctx->b[i], state, bits);
+        mpz_setbit(ctx->b[i], 0); // odd, so that mod_inverse() usually succeeds
+    }
+    make_prime(ctx->prime, bits / 2, iters);
+
+    rsa_keygen_opts_t opts = { .threads = 1, .test = PRIME_TEST_BPSW, .e = RSA_DEFAULT_E };
+    rsa_make_pub_opts(ctx->p, ctx->q, ctx->n, ctx->e, bits, iters, &opts);
+    rsa_make_priv(ctx->d, ctx->e, ctx->p, ctx->q);
+    rsa_crt_init(&ctx->crt);
+    rsa_make_crt(&ctx->crt, ctx->d, ctx->p, ctx->q);
+
+    ctx->plain = tmpfile();
+    ctx->cipher = tmpfile();
+    ctx->sink = tmpfile();
+    if (ctx->plain == NULL || ctx->cipher == NULL || ctx->sink == NULL) {
+        return false;
+    }
+    for (uint64_t i = 0; i < payload; i++) {
+        fputc((int) gmp_urandomb_ui(state, 8), ctx->plain);
+    }
+    rewind(ctx->plain);
+    rsa_encrypt_file(ctx->plain, ctx->cipher, ctx->n, ctx->e);
+    fflush(ctx->cipher);
+    return true;
+}
+
+// Clears and frees all memory used by the inputs for one modulus size.
+static void bench_ctx_clear(bench_ctx_t *ctx) {
+    mpz_clears(ctx->base, ctx->exponent, ctx->modulus, ctx->out, ctx->prime, NULL);
+    mpz_clears(ctx->p, ctx->q, ctx->n, ctx->e, ctx->d, NULL);
+    for (uint32_t i = 0; i < BENCH_BATCH; i++) {
+        mpz_clears(ctx->a[i], ctx->b[i], NULL);
+    }
+    rsa_crt_clear(&ctx->crt);
+    if (ctx->plain != NULL) {
+        fclose(ctx->plain);
+    }
+    if (ctx->cipher != NULL) {
+        fclose(ctx->cipher);
+    }
+    if (ctx->sink != NULL) {
+        fclose(ctx->sink);
+    }
+}
+
+// driver code of the program
+int main(int argc, char **argv) {
+    FILE *outfile = stdout;
+    bool verbose = false;
+    uint64_t sizes[] = { 1024, 2048, 3072, 4096 };
+    uint32_t nsizes = 4;
+    uint32_t reps = BENCH_REPS;
+    uint64_t iters = BENCH_ITERS;
+    uint64_t payload = BENCH_PAYLOAD;
+    uint64_t seed = BENCH_SEED;
+    int64_t opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 0;
+        case 'v': verbose = true; break;
+        case 'b':
+            sizes[0] = strtoul(optarg, NULL, 10);
+            nsizes = 1;
+            break;
+        case 'r': reps = strtoul(optarg, NULL, 10); break;
+        case 'i': iters = strtoul(optarg, NULL, 10); break;
+        case 'l': payload = strtoul(optarg, NULL, 10); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'o':
+            outfile = fopen(optarg, "w");
+            if (outfile == NULL) {
+                fprintf(stderr, "Failed to open outfile\n");
+                return 1;
+            }
+            break;
+        default: help(); return 1;
+        }
+    }
+    if (reps == 0 || sizes[0] < 64) {
+        help();
+        return 1;
+    }
+
+    // Initialize the random state.
+    randstate_init(seed);
+
+    fprintf(outfile,
+        "{\n  \"seed\": %" PRIu64 ", \"reps\": %" PRIu32 ", \"iters\": %" PRIu64
+        ", \"payload\": %" PRIu64 ",\n  \"results\": [",
+        seed, reps, iters, payload);
+    bool first = true;
+    for (uint32_t s = 0; s < nsizes; s++) {
+        bench_ctx_t ctx;
+        if (!bench_ctx_init(&ctx, sizes[s], iters, payload)) {
+            fprintf(stderr, "Failed to create temporary files\n");
+            bench_ctx_clear(&ctx);
+            randstate_clear();
+            return 1;
+        }
+        bench_run(outfile, &first, "pow_mod", &ctx, op_pow_mod, reps, 1, 0, verbose);
+        bench_run(outfile, &first, "mpz_powm", &ctx, op_mpz_powm, reps, 1, 0, verbose);
+        bench_run(outfile, &first, "is_prime", &ctx, op_is_prime, reps, 1, 0, verbose);
+        bench_run(outfile, &first, "make_prime", &ctx, op_make_prime, reps, 1, 0, verbose);
+        bench_run(outfile, &first, "gcd", &ctx, op_gcd, reps, BENCH_BATCH, 0, verbose);
+        bench_run(outfile, &first, "mpz_gcd", &ctx, op_mpz_gcd, reps, BENCH_BATCH, 0, verbose);
+        bench_run(
+            outfile, &first, "mod_inverse", &ctx, op_mod_inverse, reps, BENCH_BATCH, 0, verbose);
+        bench_run(
+            outfile, &first, "mpz_invert", &ctx, op_mpz_invert, reps, BENCH_BATCH, 0, verbose);
+        bench_run(outfile, &first, "rsa_make_pub", &ctx, op_rsa_make_pub, reps, 1, 0, verbose);
+        bench_run(outfile, &first, "rsa_encrypt_file", &ctx, op_rsa_encrypt_file, reps, 1, payload,
+            verbose);
+        bench_run(outfile, &first, "rsa_decrypt_file", &ctx, op_rsa_decrypt_file, reps, 1, payload,
+            verbose);
+        bench_run(outfile, &first, "rsa_decrypt_file_crt", &ctx, op_rsa_decrypt_file_crt, reps, 1,
+            payload, verbose);
+        bench_ctx_clear(&ctx);
+    }
+    fprintf(outfile, "\n  ]\n}\n");
+
+    // clear stuff used
+    if (outfile != stdout) {
+        fclose(outfile);
+    }
+    randstate_clear();
+
+    return 0;
+}
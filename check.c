@@ -0,0 +1,570 @@
+#include "randstate.h"
+#include "numtheory.h"
+#include "vpowm.h"
+#include "aead.h"
+#include "sha256.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "hvs:t:" // Valid inputs
+
+#define CHECK_SEED   2021 // default seed, so that every run checks the same numbers
+#define CHECK_ROUNDS 2 // random residues per (exponent, modulus) pair
+
+// Progress and outcome of one test.
+typedef struct {
+    const char *name;
+    bool verbose;
+    uint64_t cases; // comparisons made
+    uint64_t failures; // comparisons that did not match
+} check_ctx_t;
+
+typedef void (*check_fn_t)(check_ctx_t *ctx);
+
+// prints help page
+static void help() {
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Checks the arithmetic primitives against GMP and known answers.\n\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./check [-hv] [-s seed] [-t test]\n\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Report every test case on stderr.\n");
+    fprintf(stderr, "   -s seed         Random seed (default: %d).\n", CHECK_SEED);
+    fprintf(stderr, "   -t test         Run only this test (default: all of them).\n");
+}
+
+// Counts one comparison, printing what was compared (a gmp_printf format) if it failed.
+static void check_expect(check_ctx_t *ctx, bool ok, const char *fmt, ...) {
+    va_list args;
+    ctx->cases += 1;
+    if (ok && !ctx->verbose) {
+        return;
+    }
+    ctx->failures += !ok;
+    fprintf(stderr, "%s: %s: ", ctx->name, ok ? "ok" : "FAILED");
+    va_start(args, fmt);
+    gmp_vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+// Sets n to a random number of exactly bits bits, made odd if odd is set.
+static void check_random_bits(mpz_t n, uint64_t bits, bool odd) {
+    mpz_urandomb(n, state, bits);
+    mpz_setbit(n, bits - 1);
+    if (odd) {
+        mpz_setbit(n, 0);
+    }
+}
+
+// Modulus sizes of the exponentiation tests: one-limb moduli, sizes around limb boundaries, the
+// key sizes and sizes between and above them.
+static const uint64_t check_powm_bits[]
+    = { 2, 3, 17, 63, 64, 65, 127, 128, 129, 512, 640, 768, 1000, 1024, 1536, 2048, 2049, 3072,
+          4096, 4160 };
+
+// Compares powm() with one context against mpz_powm() for bases that stress the reduction: 0, 1,
+// n - 1, a random residue, a base longer than n and a negative one.
+static void check_powm_bases(check_ctx_t *ctx, powm_t *pm, const char *path, mpz_t e, mpz_t n) {
+    mpz_t base, got, want;
+    mpz_inits(base, got, want, NULL);
+    for (uint32_t i = 0; i < 3 + CHECK_ROUNDS; i++) {
+        if (i < 2) {
+            mpz_set_ui(base, i);
+        } else if (i == 2) {
+            mpz_sub_ui(base, n, 1);
+        } else if (i == 3) {
+            mpz_urandomb(base, state, 2 * mpz_sizeinbase(n, 2) + 5);
+        } else if (i == 4) {
+            mpz_urandomm(base, state, n);
+            mpz_neg(base, base);
+        } else {
+            mpz_urandomm(base, state, n);
+        }
+        powm(pm, got, base);
+        mpz_powm(want, base, e, n);
+        check_expect(ctx, mpz_cmp(got, want) == 0, "%s: %Zx^%Zx mod %Zx = %Zx, expected %Zx", path,
+            base, e, n, got, want);
+    }
+    mpz_clears(base, got, want, NULL);
+}
+
+// Montgomery exponentiation: every path of powm() (the sliding window, the one-limb exponent with
+// its R^e correction, contexts built from cached constants and the plain loop for even moduli),
+// pow_mod() and pow_mod_ws(), against mpz_powm(). Cached constants must pass powm_cache_check(),
+// and fail it once changed.
+static void check_powm(check_ctx_t *ctx) {
+    mpz_t n, e, base, got, want;
+    mpz_inits(n, e, base, got, want, NULL);
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    uint32_t sizes = sizeof(check_powm_bits) / sizeof(check_powm_bits[0]);
+    for (uint32_t s = 0; s < 2 * sizes + 1; s++) {
+        uint64_t bits = s < 2 * sizes ? check_powm_bits[s / 2] : 1;
+        if (s % 2 == 1 && bits > 1024) {
+            continue; // even moduli take the slow plain loop; the small ones cover it
+        }
+        check_random_bits(n, bits, s % 2 == 0); // sizes with an odd and an even modulus
+        for (uint32_t k = 0; k < 9; k++) {
+            switch (k) {
+            case 0: mpz_set_ui(e, 0); break;
+            case 1: mpz_set_ui(e, 1); break;
+            case 2: mpz_set_ui(e, 2); break;
+            case 3: mpz_set_ui(e, 65537); break;
+            case 4: mpz_set_ui(e, UINT64_MAX); break; // longest one-limb exponent
+            case 5: check_random_bits(e, 1 + gmp_urandomm_ui(state, 64), false); break;
+            case 6: check_random_bits(e, 65, false); break; // shortest multi-limb exponent
+            case 7: check_random_bits(e, bits + 1, false); break;
+            case 8: // all ones: the longest windows
+                mpz_set_ui(e, 0);
+                mpz_setbit(e, bits + 1);
+                mpz_sub_ui(e, e, 1);
+                break;
+            }
+            if (mpz_cmp_ui(n, 1) == 0 && mpz_sgn(e) == 0) {
+                continue; // x^0 mod 1 is 1 for pow_mod(), as before Montgomery form was added
+            }
+            powm_t pm;
+            powm_init(&pm, e, n);
+            check_powm_bases(ctx, &pm, pm.mont ? "generic" : "plain", e, n);
+            if (pm.mont) { // a context set up from cached constants
+                powm_cache_t pc;
+                powm_cache_init(&pc);
+                powm_cache_save(&pc, &pm);
+                powm_t cached;
+                powm_init_cached(&cached, e, n, &pc);
+                check_powm_bases(ctx, &cached, "cached", e, n);
+                powm_clear(&cached);
+                // the saved constants pass powm_cache_check(), and each one changed fails it
+                check_expect(ctx, powm_cache_check(&pc, n), "cache check: saved for %Zx", n);
+                mpz_ptr constants[3] = { pc.one, pc.r2, pc.correction };
+                for (int i = 0; i < (pc.exp_word != 0 ? 3 : 2); i++) {
+                    mpz_add_ui(constants[i], constants[i], 1);
+                    check_expect(ctx, !powm_cache_check(&pc, n),
+                        "cache check: constant %d + 1 for %Zx", i, n);
+                    mpz_sub_ui(constants[i], constants[i], 1);
+                }
+                powm_cache_clear(&pc);
+            }
+            powm_clear(&pm);
+            mpz_urandomb(base, state, bits + 3);
+            mpz_powm(want, base, e, n);
+            pow_mod(got, base, e, n);
+            check_expect(ctx, mpz_cmp(got, want) == 0, "pow_mod: %Zx^%Zx mod %Zx = %Zx", base, e,
+                n, got);
+            pow_mod_ws(got, base, e, n, &ws);
+            check_expect(ctx, mpz_cmp(got, want) == 0, "pow_mod_ws: %Zx^%Zx mod %Zx = %Zx", base,
+                e, n, got);
+        }
+    }
+    nt_ws_clear(&ws);
+    mpz_clears(n, e, base, got, want, NULL);
+}
+
+// Modulus sizes of the vector exponentiation tests: one and two digits of either radix, partly
+// filled top digits and the key sizes, up to the largest the kernels take.
+static const uint64_t check_vpowm_bits[]
+    = { 2, 29, 52, 58, 62, 104, 255, 521, 1024, 1536, 2048, 3072, 4096, 16384 };
+
+// Vector exponentiation: every kernel the CPU runs against mpz_powm(), for full sets of lanes and
+// fewer bases than lanes, with bases at the edges of the range, above it and negative.
+static void check_vpowm(check_ctx_t *ctx) {
+    static const vpowm_kernel_t kernels[] = { VPOWM_AVX2, VPOWM_IFMA };
+    mpz_t n, e, want, base[VPOWM_LANES_MAX], out[VPOWM_LANES_MAX];
+    mpz_inits(n, e, want, NULL);
+    for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+        mpz_inits(base[i], out[i], NULL);
+    }
+    for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const char *kernel = vpowm_kernel_name(kernels[k]);
+        if (!vpowm_supported(kernels[k])) {
+            if (ctx->verbose) {
+                fprintf(stderr, "%s: %s: not supported here\n", ctx->name, kernel);
+            }
+            continue;
+        }
+        for (uint32_t s = 0; s < sizeof(check_vpowm_bits) / sizeof(check_vpowm_bits[0]); s++) {
+            uint64_t bits = check_vpowm_bits[s];
+            check_random_bits(n, bits, true);
+            for (uint32_t x = 0; x < 6; x++) {
+                if (bits > 4096 && x > 3) {
+                    continue; // a full exponent this long only repeats the shorter sizes, slowly
+                }
+                switch (x) {
+                case 0: mpz_set_ui(e, 0); break;
+                case 1: mpz_set_ui(e, 1); break;
+                case 2: mpz_set_ui(e, 65537); break;
+                case 3: check_random_bits(e, 160, false); break; // a CRT-sized short exponent
+                case 4: check_random_bits(e, bits, false); break;
+                case 5: // all ones: the longest windows
+                    mpz_set_ui(e, 0);
+                    mpz_setbit(e, bits);
+                    mpz_sub_ui(e, e, 1);
+                    break;
+                }
+                powm_t pm;
+                vpowm_t vp;
+                powm_init(&pm, e, n);
+                bool ok = vpowm_init(&vp, &pm, kernels[k]);
+                check_expect(ctx, ok, "%s: init for a %" PRIu64 "-bit modulus", kernel, bits);
+                for (uint32_t round = 0; round < 2 && ok; round++) {
+                    uint32_t count = round == 0 ? vp.lanes : vp.lanes - 1; // one lane idle
+                    for (uint32_t i = 0; i < count; i++) {
+                        switch (i) {
+                        case 0: mpz_sub_ui(base[i], n, 1); break;
+                        case 1: mpz_set_ui(base[i], 0); break;
+                        case 2: mpz_set_ui(base[i], 1); break;
+                        case 3: mpz_urandomb(base[i], state, bits + 7); break;
+                        case 4:
+                            mpz_urandomm(base[i], state, n);
+                            mpz_neg(base[i], base[i]);
+                            break;
+                        default: mpz_urandomm(base[i], state, n); break;
+                        }
+                    }
+                    vpowm(&vp, out, base, count);
+                    for (uint32_t i = 0; i < count; i++) {
+                        mpz_powm(want, base[i], e, n);
+                        check_expect(ctx, mpz_cmp(out[i], want) == 0,
+                            "%s: lane %u of %u: %Zx^%Zx mod %Zx = %Zx, expected %Zx", kernel, i,
+                            count, base[i], e, n, out[i], want);
+                    }
+                }
+                vpowm_clear(&vp);
+                powm_clear(&pm);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+        mpz_clears(base[i], out[i], NULL);
+    }
+    mpz_clears(n, e, want, NULL);
+}
+
+// gcd() as it was before Lehmer's algorithm: Euclid's algorithm with one division per step. It
+// defines the results for negative operands, which GMP normalizes differently.
+static void check_gcd_euclid(mpz_t d, mpz_t a, mpz_t b) {
+    mpz_t t, x, y;
+    mpz_inits(t, x, y, NULL);
+    mpz_set(x, a);
+    mpz_set(y, b);
+    while (mpz_sgn(y) != 0) {
+        mpz_mod(t, x, y);
+        mpz_swap(x, y);
+        mpz_swap(y, t);
+    }
+    mpz_set(d, x);
+    mpz_clears(t, x, y, NULL);
+}
+
+// mod_inverse() as it was before Lehmer's algorithm, the extended Euclidean algorithm.
+static void check_inverse_euclid(mpz_t i, mpz_t a, mpz_t n) {
+    mpz_t r, rp, t, tp, q;
+    mpz_inits(r, rp, t, tp, q, NULL);
+    mpz_set(r, n);
+    mpz_set(rp, a);
+    mpz_set_ui(t, 0);
+    mpz_set_ui(tp, 1);
+    while (mpz_sgn(rp) != 0) {
+        mpz_fdiv_q(q, r, rp);
+        mpz_submul(r, q, rp);
+        mpz_swap(r, rp);
+        mpz_submul(t, q, tp);
+        mpz_swap(t, tp);
+    }
+    if (mpz_cmp_ui(r, 1) > 0) {
+        mpz_set_ui(t, 0);
+    }
+    if (mpz_sgn(t) < 0) {
+        mpz_add(t, t, n);
+    }
+    mpz_set(i, t);
+    mpz_clears(r, rp, t, tp, q, NULL);
+}
+
+// Compares gcd(), gcd_ws(), mod_inverse() and mod_inverse_ws() for one pair of operands against
+// GMP when both are positive and against Euclid's algorithm otherwise.
+static void check_gcd_pair(check_ctx_t *ctx, const char *kind, mpz_t a, mpz_t b, nt_ws_t *ws) {
+    mpz_t got, want;
+    mpz_inits(got, want, NULL);
+    bool positive = mpz_sgn(a) >= 0 && mpz_sgn(b) >= 0;
+    if (positive) {
+        mpz_gcd(want, a, b);
+    } else {
+        check_gcd_euclid(want, a, b);
+    }
+    gcd(got, a, b);
+    check_expect(ctx, mpz_cmp(got, want) == 0, "%s: gcd(%Zx, %Zx) = %Zx, expected %Zx", kind, a,
+        b, got, want);
+    gcd_ws(got, a, b, ws);
+    check_expect(ctx, mpz_cmp(got, want) == 0, "%s: gcd_ws(%Zx, %Zx) = %Zx, expected %Zx", kind,
+        a, b, got, want);
+    if (mpz_sgn(b) != 0) {
+        if (positive && mpz_cmp_ui(b, 1) > 0) {
+            if (mpz_invert(want, a, b) == 0) {
+                mpz_set_ui(want, 0); // mod_inverse() reports no inverse as 0
+            }
+        } else {
+            check_inverse_euclid(want, a, b);
+        }
+        mod_inverse(got, a, b);
+        check_expect(ctx, mpz_cmp(got, want) == 0,
+            "%s: mod_inverse(%Zx, %Zx) = %Zx, expected %Zx", kind, a, b, got, want);
+        mod_inverse_ws(got, a, b, ws);
+        check_expect(ctx, mpz_cmp(got, want) == 0,
+            "%s: mod_inverse_ws(%Zx, %Zx) = %Zx, expected %Zx", kind, a, b, got, want);
+    }
+    mpz_clears(got, want, NULL);
+}
+
+// Lehmer's gcd and inverse: random operands of 1 to 4096 bits in both orders, consecutive
+// Fibonacci numbers (every quotient 1, the longest runs of single-word steps), equal operands,
+// zero, large common factors, inverses of units and negative operands.
+static void check_gcd(check_ctx_t *ctx) {
+    mpz_t a, b, f, fn;
+    mpz_inits(a, b, f, fn, NULL);
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    for (uint32_t i = 0; i < 1000; i++) {
+        check_random_bits(a, 1 + gmp_urandomm_ui(state, 4096), false);
+        check_random_bits(b, 1 + gmp_urandomm_ui(state, 4096), i % 2 == 0);
+        check_gcd_pair(ctx, "random", a, b, &ws);
+        check_gcd_pair(ctx, "random", b, a, &ws);
+        // similar sizes, where Lehmer's matrices do most of the work
+        check_random_bits(b, mpz_sizeinbase(a, 2), i % 2 == 0);
+        check_gcd_pair(ctx, "same size", a, b, &ws);
+        check_random_bits(f, 1 + gmp_urandomm_ui(state, 1024), false); // common factor
+        mpz_mul(a, a, f);
+        mpz_mul(b, b, f);
+        check_gcd_pair(ctx, "common factor", a, b, &ws);
+        mpz_neg(a, a);
+        check_gcd_pair(ctx, "negative", a, b, &ws);
+        check_gcd_pair(ctx, "negative", b, a, &ws);
+        mpz_neg(b, b);
+        check_gcd_pair(ctx, "negative", a, b, &ws);
+    }
+    // consecutive Fibonacci numbers up to F(6000), about 4160 bits
+    mpz_set_ui(f, 1);
+    mpz_set_ui(fn, 1);
+    for (uint32_t i = 2; i < 6000; i++) {
+        mpz_add(f, f, fn);
+        mpz_swap(f, fn);
+        if (i < 200 || i % 97 == 0) {
+            check_gcd_pair(ctx, "fibonacci", fn, f, &ws);
+            check_gcd_pair(ctx, "fibonacci", f, fn, &ws);
+            mpz_mul_ui(a, fn, 6); // F(i + 1) * 6 and F(i) * 6 have gcd 6 and no inverse
+            mpz_mul_ui(b, f, 6);
+            check_gcd_pair(ctx, "fibonacci", a, b, &ws);
+        }
+    }
+    for (uint32_t bits = 1; bits <= 4096; bits *= 2) {
+        check_random_bits(a, bits, true);
+        mpz_set(b, a);
+        check_gcd_pair(ctx, "equal", a, b, &ws);
+        mpz_set_ui(b, 0);
+        check_gcd_pair(ctx, "zero", a, b, &ws);
+        check_gcd_pair(ctx, "zero", b, a, &ws);
+        mpz_set_ui(b, 1);
+        check_gcd_pair(ctx, "one", a, b, &ws);
+        check_gcd_pair(ctx, "one", b, a, &ws);
+        mpz_sub_ui(b, a, 1);
+        check_gcd_pair(ctx, "neighbours", b, a, &ws);
+        check_gcd_pair(ctx, "neighbours", a, b, &ws);
+    }
+    nt_ws_clear(&ws);
+    mpz_clears(a, b, f, fn, NULL);
+}
+
+// Decodes the hexstring hex into out, returning the number of bytes.
+static size_t check_unhex(uint8_t *out, const char *hex) {
+    size_t len = strlen(hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t) byte;
+    }
+    return len;
+}
+
+// Plaintext of the RFC 8439 ChaCha20 and AEAD examples.
+static const char check_sunscreen[] = "Ladies and Gentlemen of the class of '99: If I could offer "
+                                      "you only one tip for the future, sunscreen would be it.";
+
+// ChaCha20-Poly1305 against the examples of RFC 8439: the ChaCha20 encryption of section 2.4.2,
+// the Poly1305 tag of section 2.5.2 and the AEAD encryption of section 2.8.2, which must also
+// open again and be rejected once its tag, ciphertext or additional data is changed. Then
+// ChaCha20 in one call against one call per 64-byte block, for lengths across the vector lanes.
+static void check_aead(check_ctx_t *ctx) {
+    static const char chacha_out[]
+        = "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f59"
+          "3dabcd62b3571639d624e65152ab8f530c359f0861d807ca0dbf500d6a6156a38e088a22b65e52bc514d"
+          "16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d";
+    static const char aead_out[]
+        = "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fa"
+          "fb69da92728b1a71de0a9e060b2905d6a5b67ecd3b3692ddbd7f2d778b8c9803aee328091b58fab324e4"
+          "fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116";
+    static const char forum[] = "Cryptographic Forum Research Group";
+    const uint8_t *plain = (const uint8_t *) check_sunscreen;
+    size_t len = strlen(check_sunscreen);
+    uint8_t key[AEAD_KEY_SIZE], nonce[AEAD_NONCE_SIZE], aad[12], expected[128], out[128];
+    uint8_t tag[AEAD_TAG_SIZE], mac[AEAD_TAG_SIZE];
+
+    // 2.4.2: key 00 01 .. 1f, counter 1
+    for (int i = 0; i < AEAD_KEY_SIZE; i++) {
+        key[i] = (uint8_t) i;
+    }
+    check_unhex(nonce, "000000000000004a00000000");
+    check_unhex(expected, chacha_out);
+    chacha20_xor(out, plain, len, key, nonce, 1);
+    check_expect(ctx, memcmp(out, expected, len) == 0, "RFC 8439 2.4.2 ChaCha20");
+
+    // 2.5.2
+    check_unhex(key, "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b");
+    check_unhex(mac, "a8061dc1305136c6c22b8baf0c0127a9");
+    poly1305(tag, (const uint8_t *) forum, strlen(forum), key);
+    check_expect(ctx, memcmp(tag, mac, AEAD_TAG_SIZE) == 0, "RFC 8439 2.5.2 Poly1305");
+
+    // 2.8.2: key 80 81 .. 9f
+    for (int i = 0; i < AEAD_KEY_SIZE; i++) {
+        key[i] = (uint8_t) (0x80 + i);
+    }
+    check_unhex(nonce, "070000004041424344454647");
+    check_unhex(aad, "50515253c0c1c2c3c4c5c6c7");
+    check_unhex(expected, aead_out);
+    check_unhex(mac, "1ae10b594f09e26a7e902ecbd0600691");
+    aead_seal(out, tag, plain, len, aad, sizeof(aad), key, nonce);
+    check_expect(ctx, memcmp(out, expected, len) == 0, "RFC 8439 2.8.2 AEAD ciphertext");
+    check_expect(ctx, memcmp(tag, mac, AEAD_TAG_SIZE) == 0, "RFC 8439 2.8.2 AEAD tag");
+    check_expect(ctx,
+        aead_open(out, expected, len, mac, aad, sizeof(aad), key, nonce)
+            && memcmp(out, plain, len) == 0,
+        "RFC 8439 2.8.2 AEAD open");
+    mac[0] ^= 1;
+    check_expect(ctx, !aead_open(out, expected, len, mac, aad, sizeof(aad), key, nonce),
+        "RFC 8439 2.8.2 AEAD open with a changed tag");
+    mac[0] ^= 1;
+    expected[len - 1] ^= 0x80;
+    check_expect(ctx, !aead_open(out, expected, len, mac, aad, sizeof(aad), key, nonce),
+        "RFC 8439 2.8.2 AEAD open with a changed ciphertext");
+    expected[len - 1] ^= 0x80;
+    check_expect(ctx, !aead_open(out, expected, len, mac, aad, sizeof(aad) - 1, key, nonce),
+        "RFC 8439 2.8.2 AEAD open with shortened additional data");
+
+    // one call against one call per block, whose counter must carry on where the last stopped
+    uint8_t *in = (uint8_t *) malloc(4096), *whole = (uint8_t *) malloc(4096);
+    uint8_t *blocks = (uint8_t *) malloc(4096);
+    for (size_t i = 0; i < 4096; i++) {
+        in[i] = (uint8_t) gmp_urandomb_ui(state, 8);
+    }
+    for (size_t n = 0; n <= 4096; n += n < 600 ? 1 : 173) {
+        chacha20_xor(whole, in, n, key, nonce, 7);
+        for (size_t at = 0; at < n; at += 64) {
+            chacha20_xor(blocks + at, in + at, n - at < 64 ? n - at : 64, key, nonce, 7 + at / 64);
+        }
+        check_expect(ctx, memcmp(whole, blocks, n) == 0, "ChaCha20 of %zu bytes by blocks", n);
+    }
+    free(in);
+    free(whole);
+    free(blocks);
+}
+
+// Compares the digest of len bytes at data with the hexstring want, hashing it in one call and
+// again in random pieces.
+static void check_sha256_digest(check_ctx_t *ctx, const char *what, const void *data, size_t len,
+    const char *want) {
+    uint8_t expected[SHA256_DIGEST_SIZE], digest[SHA256_DIGEST_SIZE];
+    check_unhex(expected, want);
+    sha256(digest, data, len);
+    check_expect(ctx, memcmp(digest, expected, SHA256_DIGEST_SIZE) == 0, "SHA-256 of %s", what);
+    sha256_t hash;
+    sha256_init(&hash);
+    for (size_t at = 0; at < len;) {
+        size_t piece = 1 + gmp_urandomm_ui(state, 150);
+        piece = piece < len - at ? piece : len - at;
+        sha256_update(&hash, (const uint8_t *) data + at, piece);
+        at += piece;
+    }
+    sha256_final(&hash, digest);
+    check_expect(ctx, memcmp(digest, expected, SHA256_DIGEST_SIZE) == 0,
+        "SHA-256 of %s in pieces", what);
+}
+
+// SHA-256 against the examples of FIPS 180-2: one block, two blocks, a million bytes, and the
+// empty message.
+static void check_sha256(check_ctx_t *ctx) {
+    static const char two_blocks[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    check_sha256_digest(ctx, "\"abc\"", "abc", 3,
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    check_sha256_digest(ctx, "the two-block message", two_blocks, strlen(two_blocks),
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    check_sha256_digest(ctx, "the empty message", "", 0,
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    char *million = (char *) malloc(1000000);
+    memset(million, 'a', 1000000);
+    check_sha256_digest(ctx, "a million a's", million, 1000000,
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    free(million);
+}
+
+static const struct {
+    const char *name;
+    check_fn_t fn;
+} check_tests[] = {
+    { "powm", check_powm },
+    { "vpowm", check_vpowm },
+    { "gcd", check_gcd },
+    { "aead", check_aead },
+    { "sha256", check_sha256 },
+};
+
+// driver code of the program
+int main(int argc, char **argv) {
+    bool verbose = false;
+    uint64_t seed = CHECK_SEED;
+    const char *only = NULL;
+    int64_t opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 0;
+        case 'v': verbose = true; break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 't': only = optarg; break;
+        default: help(); return 1;
+        }
+    }
+
+    // Initialize the random state.
+    randstate_init(seed);
+
+    // Run the tests, reporting each one on stdout
+    uint32_t ran = 0, failed = 0;
+    for (uint32_t i = 0; i < sizeof(check_tests) / sizeof(check_tests[0]); i++) {
+        if (only != NULL && strcmp(only, check_tests[i].name) != 0) {
+            continue;
+        }
+        check_ctx_t ctx = { .name = check_tests[i].name, .verbose = verbose };
+        check_tests[i].fn(&ctx);
+        printf("%-12s %8" PRIu64 " cases  %s\n", ctx.name, ctx.cases,
+            ctx.failures == 0 ? "ok" : "FAILED");
+        ran += 1;
+        failed += ctx.failures != 0;
+    }
+    if (ran == 0) {
+        fprintf(stderr, "Unknown test %s\n", only);
+    }
+
+    // clear stuff used
+    randstate_clear();
+
+    return ran == 0 || failed != 0;
+}
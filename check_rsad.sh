@@ -0,0 +1,55 @@
+#!/bin/sh
+# Load test of the decryption daemon: starts rsad on a socket in a temporary directory, runs a
+# load run of rsac against it and a ciphertext round trip, and stops the daemon. Exits nonzero if
+# any step fails or the daemon does not shut down cleanly. Run from the directory holding the
+# programs, e.g. through make check.
+
+dir=$(mktemp -d) || exit 1
+pid=
+
+cleanup() {
+    if [ -n "$pid" ]; then
+        kill "$pid" 2>/dev/null
+    fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "check_rsad: $1" >&2
+    exit 1
+}
+
+# keygen signs the username, so make sure there is one
+USER=${USER:-check} ./keygen -b 1024 -n "$dir/rsa.pub" -d "$dir/rsa.priv" >/dev/null \
+    || fail "keygen failed"
+
+./rsad -n "$dir/rsa.priv" -s "$dir/rsad.sock" -t 2 &
+pid=$!
+
+# Wait up to 10 seconds for the daemon to listen
+tries=0
+while [ ! -S "$dir/rsad.sock" ]; do
+    kill -0 "$pid" 2>/dev/null || fail "rsad exited before listening"
+    tries=$((tries + 1))
+    [ "$tries" -le 100 ] || fail "rsad did not start listening"
+    sleep 0.1
+done
+
+./rsac -s "$dir/rsad.sock" -l 2000 -c 4 -w 16 -n "$dir/rsa.pub" >"$dir/load.json" \
+    || fail "rsac -l failed"
+
+head -c 10000 /dev/urandom >"$dir/plain"
+./encrypt -b -n "$dir/rsa.pub" -i "$dir/plain" -o "$dir/cipher" 2>/dev/null \
+    || fail "encrypt failed"
+./rsac -s "$dir/rsad.sock" -d -i "$dir/cipher" -o "$dir/decrypted" || fail "rsac -d failed"
+cmp -s "$dir/plain" "$dir/decrypted" || fail "rsac -d returned the wrong plaintext"
+
+kill -TERM "$pid"
+wait "$pid"
+status=$?
+pid=
+[ "$status" -eq 0 ] || fail "rsad exited with status $status"
+[ ! -e "$dir/rsad.sock" ] || fail "rsad left its socket behind"
+
+echo "rsad         $(cat "$dir/load.json")"
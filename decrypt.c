@@ -1,6 +1,7 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -11,7 +12,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define OPTIONS "i:o:n:vh" // Valid inputs
+#define OPTIONS "i:o:n:t:R:bmpHvhS:" // Valid inputs
 
 // prints help page
 static void help() {
@@ -19,22 +20,52 @@ static void help() {
     fprintf(stderr, "   Decrypts data using RSA decryption.\n");
     fprintf(stderr, "   Encrypted data is encrypted by the encrypt program.\n\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n\n");
+    fprintf(stderr, "   ./decrypt [-hvbmpH] [-i infile] [-o outfile] [-t threads] [-S format]\n"
+                    "             [-R offset:length] -n privkey\n\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
     fprintf(stderr, "   -i infile       Input file of data to decrypt (default: stdin).\n");
     fprintf(stderr, "   -o outfile      Output file for decrypted data (default: stdout).\n");
     fprintf(stderr, "   -n pvfile       Private key file (default: rsa.priv).\n");
+    fprintf(stderr, "   -t threads      Worker threads for block exponentiation (default: 1).\n");
+    fprintf(stderr, "   -b              Read the binary ciphertext format (default: hex).\n");
+    fprintf(stderr, "   -m              Write outfile through a preallocated memory map.\n");
+    fprintf(stderr, "   -p              Pipeline I/O: read ahead and write behind asynchronously\n"
+                    "                   (io_uring, or a helper thread) while exponentiating.\n");
+    fprintf(stderr, "   -H              Read the hybrid container written by encrypt -H.\n");
+    fprintf(stderr, "   -R offset:length\n"
+                    "                   Decrypt only length plaintext bytes from offset, reading\n"
+                    "                   only the blocks that hold them. infile must be a binary\n"
+                    "                   ciphertext file written by encrypt -b.\n");
+    fprintf(stderr, "   -S format       Print counters and timings on stderr: table or json.\n");
+}
+
+// Parses a plaintext range given as offset:length into offset and length.
+// Returns false if arg is not of that form.
+static bool parse_range(const char *arg, uint64_t *offset, uint64_t *length) {
+    char *end;
+    *offset = strtoull(arg, &end, 10);
+    if (end == arg || *end != ':' || arg[0] == '-') {
+        return false;
+    }
+    const char *rest = end + 1;
+    *length = strtoull(rest, &end, 10);
+    return end != rest && *end == '\0' && rest[0] != '-';
 }
 
 // driver code of the program
 int main(int argc, char **argv) {
     FILE *infile = stdin;
     FILE *outfile = stdout;
+    char *outpath = NULL;
     FILE *pvfile;
     bool verbose = false;
+    stats_format_t stats_format = STATS_NONE;
     bool use_default_file = true;
+    bool ranged = false;
+    uint64_t offset = 0, length = 0;
+    rsa_file_opts_t opts = { .threads = 1 };
     int32_t opt = 0;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -46,13 +77,9 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Failed to open infile\n");
                 return 1;
             }
+            opts.map_input = true;
             break;
-        case 'o':
-            if ((outfile = fopen(optarg, "w")) == NULL) {
-                fprintf(stderr, "Failed to open outfile\n");
-                return 1;
-            }
-            break;
+        case 'o': outpath = optarg; break;
         case 'n':
             if ((pvfile = fopen(optarg, "r")) == NULL) {
                 printf("Failed to open pvfile\n");
@@ -60,33 +87,119 @@ int main(int argc, char **argv) {
             }
             use_default_file = false;
             break;
+        case 'b': opts.binary = true; break;
+        case 'm': opts.map_output = true; break;
+        case 'p': opts.pipeline = true; break;
+        case 'H': opts.hybrid = true; break;
+        case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+        case 'R':
+            if (!parse_range(optarg, &offset, &length)) {
+                help();
+                return 1;
+            }
+            ranged = true;
+            break;
+        case 'S':
+            if (!stats_parse_format(optarg, &stats_format)) {
+                help();
+                return 1;
+            }
+            break;
         default: help(); return 1;
         }
     }
 
+    // Ranges are served from the block layout of the binary format only.
+    if (ranged && opts.hybrid) {
+        fprintf(stderr, "Error: -R reads binary ciphertexts, not hybrid containers\n");
+        return 1;
+    }
+
+    // Open the output file; mapping it requires read and write access.
+    if (outpath != NULL && (outfile = fopen(outpath, opts.map_output ? "w+" : "w")) == NULL) {
+        fprintf(stderr, "Failed to open outfile\n");
+        return 1;
+    }
+
+    // Give the data streams large buffers so that pipes are read and written in big chunks.
+    setvbuf(infile, NULL, _IOFBF, RSA_STREAM_BUFFER);
+    setvbuf(outfile, NULL, _IOFBF, RSA_STREAM_BUFFER);
+
     // Open the private key file.
     if (use_default_file) {
         pvfile = fopen("rsa.priv", "r");
     }
+    if (pvfile == NULL) {
+        fprintf(stderr, "Error: Failed to open pvfile\n");
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
 
     // Read the private key from the opened private key file.
+    stat_timer_t timer;
+    stats_start(&timer);
     mpz_t n, d;
     mpz_inits(n, d, NULL);
-    rsa_read_priv(n, d, pvfile);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_cache_t cache;
+    rsa_cache_init(&cache);
+    if (!rsa_load_priv(n, d, &crt, &cache, pvfile)) {
+        fprintf(stderr, "Error: Failed to read the private key\n");
+        fclose(infile);
+        fclose(outfile);
+        fclose(pvfile);
+        rsa_cache_clear(&cache);
+        rsa_crt_clear(&crt);
+        mpz_clears(n, d, NULL);
+        return 1;
+    }
+    opts.cache = &cache;
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
 
     // If verbose output is enabled
     if (verbose) {
         gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("d (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        if (crt.valid) {
+            gmp_printf("p (%d bits) = %Zd\n", mpz_sizeinbase(crt.p, 2), crt.p);
+            gmp_printf("q (%d bits) = %Zd\n", mpz_sizeinbase(crt.q, 2), crt.q);
+        }
+    }
+
+    // Decrypt the file, or only the blocks holding the requested range
+    bool ok = ranged ? rsa_decrypt_range(infile, outfile, n, d, &crt, offset, length, &opts)
+                     : rsa_decrypt_file_opts(infile, outfile, n, d, &crt, &opts);
+    if (!ok) {
+        if (ranged) {
+            fprintf(stderr, "Error: Ciphertext is not a seekable binary file for this key, or is "
+                            "truncated\n");
+        } else if (opts.hybrid) {
+            fprintf(stderr, "Error: Ciphertext is corrupt, truncated or not for this key\n");
+        } else {
+            fprintf(stderr, "Error: Ciphertext header does not match the private key, or the "
+                            "ciphertext is truncated or malformed\n");
+        }
+        stats_print(stderr, stats_format);
+        fclose(infile);
+        fclose(outfile);
+        fclose(pvfile);
+        rsa_cache_clear(&cache);
+        rsa_crt_clear(&crt);
+        mpz_clears(n, d, NULL);
+        return 1;
     }
 
-    // Decrypt the file
-    rsa_decrypt_file(infile, outfile, n, d);
+    // Print the counters and phase times if requested
+    stats_print(stderr, stats_format);
 
     // clear stuff used
     fclose(infile);
     fclose(outfile);
     fclose(pvfile);
+    rsa_cache_clear(&cache);
+    rsa_crt_clear(&crt);
     mpz_clears(n, d, NULL);
 
     return 0;
@@ -1,6 +1,8 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
+#include "keyring.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -11,7 +13,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define OPTIONS "i:o:n:vh" // Valid inputs
+#define OPTIONS "i:o:n:r:k:t:bmpHvhS:" // Valid inputs
 
 // prints help page
 static void help() {
@@ -19,22 +21,82 @@ static void help() {
     fprintf(stderr, "   Encrypts data using RSA encryption.\n");
     fprintf(stderr, "   Encrypted data is decrypted by the decrypt program.\n\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n\n");
+    fprintf(stderr, "   ./encrypt [-hvbmpH] [-i infile] [-o outfile] [-t threads] [-S format]\n"
+                    "             [-k keyring] -n pubkey | -r user [-n pubkey | -r user ...]\n\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
     fprintf(stderr, "   -i infile       Input file of data to encrypt (default: stdin).\n");
     fprintf(stderr, "   -o outfile      Output file for encrypted data (default: stdout).\n");
-    fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub).\n");
+    fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub). Given several times\n"
+                    "                   with -H, encrypts for every key into one hybrid\n"
+                    "                   container.\n");
+    fprintf(stderr, "   -r user         Public key of user in the keyring; keys verified before\n"
+                    "                   are not verified again. May be given several times.\n"
+                    "                   The output format follows -b and -H, not the number\n"
+                    "                   of keys; several keys (-n and -r) need -H.\n");
+    fprintf(
+        stderr, "   -k keyring      Keyring directory for -r (default: %s).\n", KEYRING_DEFAULT);
+    fprintf(stderr, "   -t threads      Worker threads for block exponentiation (default: 1).\n");
+    fprintf(stderr, "   -b              Write the binary ciphertext format (default: hex).\n");
+    fprintf(stderr, "   -m              Write outfile through a preallocated memory map.\n");
+    fprintf(stderr, "   -p              Pipeline I/O: read ahead and write behind asynchronously\n"
+                    "                   (io_uring, or a helper thread) while exponentiating.\n");
+    fprintf(stderr, "   -H              Write the hybrid container: RSA wraps a session key and\n"
+                    "                   ChaCha20-Poly1305 encrypts the data.\n");
+    fprintf(stderr, "   -S format       Print counters and timings on stderr: table or json.\n");
+}
+
+// Reads the public key in the file at path into n, e and cache and verifies its signature of the
+// username. Prints the key if verbose is set. Returns false, after printing an error, if the file
+// cannot be read or the signature is not verified.
+static bool load_key(const char *path, mpz_t n, mpz_t e, rsa_cache_t *cache, bool verbose) {
+    FILE *pbfile = fopen(path, "r");
+    if (pbfile == NULL) {
+        fprintf(stderr, "Error: Failed to open pbfile %s\n", path);
+        return false;
+    }
+    mpz_t s, username;
+    mpz_inits(s, username, NULL);
+    char user[RSA_USERNAME_MAX + 1];
+    bool ok = rsa_load_pub(n, e, s, user, cache, pbfile);
+    fclose(pbfile);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to read the public key %s\n", path);
+        mpz_clears(s, username, NULL);
+        return false;
+    }
+
+    // If verbose output is enabled
+    if (verbose) {
+        printf("user = %s\n", user);
+        gmp_printf("s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
+        gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
+        gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
+    }
+
+    // Convert the username that was read in to an mpz_t and verify the signature.
+    mpz_set_str(username, user, 62);
+    ok = rsa_verify_cached(username, s, e, n, cache);
+    if (!ok) {
+        fprintf(stderr, "Error: %s cannot be verified\n", path);
+    }
+    mpz_clears(s, username, NULL);
+    return ok;
 }
 
 // driver code of the program
 int main(int argc, char **argv) {
     FILE *infile = stdin;
     FILE *outfile = stdout;
-    FILE *pbfile;
+    char *outpath = NULL;
+    const char **pbpaths = (const char **) calloc(argc, sizeof(char *));
+    const char **users = (const char **) calloc(argc, sizeof(char *));
+    const char *krdir = KEYRING_DEFAULT;
+    uint32_t paths = 0, keys = 0;
     bool verbose = false;
-    bool use_default_file = true;
+    stats_format_t stats_format = STATS_NONE;
+    rsa_file_opts_t opts = { .threads = 1 };
     int32_t opt = 0;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -46,64 +108,121 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Failed to open infile\n");
                 return 1;
             }
+            opts.map_input = true;
             break;
-        case 'o':
-            if ((outfile = fopen(optarg, "w")) == NULL) {
-                fprintf(stderr, "Failed to open outfile\n");
+        case 'o': outpath = optarg; break;
+        case 'n': pbpaths[paths++] = optarg; break;
+        case 'r': users[keys++] = optarg; break;
+        case 'k': krdir = optarg; break;
+        case 'b': opts.binary = true; break;
+        case 'm': opts.map_output = true; break;
+        case 'p': opts.pipeline = true; break;
+        case 'H': opts.hybrid = true; break;
+        case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+        case 'S':
+            if (!stats_parse_format(optarg, &stats_format)) {
+                help();
                 return 1;
             }
             break;
-        case 'n':
-            if ((pbfile = fopen(optarg, "r")) == NULL) {
-                printf("Failed to open pbfile\n");
-                return 1;
-            }
-            use_default_file = false;
-            break;
         default: help(); return 1;
         }
     }
 
-    // Open the public key file.
-    if (use_default_file) {
-        pbfile = fopen("rsa.pub", "r");
+    // Several recipients share one hybrid container, which has to be asked for: the output format
+    // never changes with the number of keys.
+    if (paths + keys > 1 && !opts.hybrid) {
+        fprintf(stderr, "Error: Encrypting for several keys needs the hybrid container (-H)%s\n",
+            opts.binary ? " instead of -b" : "");
+        free(pbpaths);
+        free(users);
+        return 1;
     }
 
-    // Read the public key from the opened public key file.
-    mpz_t n, e, s, username;
-    mpz_inits(n, e, s, username, NULL);
-    char *user = getenv("USER");
-    rsa_read_pub(n, e, s, user, pbfile);
-
-    // If verbose output is enabled
-    if (verbose) {
-        printf("user = %s\n", user);
-        gmp_printf("s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
-        gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
+    // Open the output file; mapping it requires read and write access.
+    if (outpath != NULL && (outfile = fopen(outpath, opts.map_output ? "w+" : "w")) == NULL) {
+        fprintf(stderr, "Failed to open outfile\n");
+        return 1;
     }
 
-    // Convert the username that was read in to an mpz_t.
-    mpz_set_str(username, user, 62);
+    // Give the data streams large buffers so that pipes are read and written in big chunks.
+    setvbuf(infile, NULL, _IOFBF, RSA_STREAM_BUFFER);
+    setvbuf(outfile, NULL, _IOFBF, RSA_STREAM_BUFFER);
 
-    // Verify the signature.
-    if (!rsa_verify(username, s, e, n)) {
-        fprintf(stderr, "Error: Cannot be verified\n");
-        mpz_clears(n, e, s, username, NULL);
-        fclose(infile);
-        fclose(outfile);
-        fclose(pbfile);
-        return 1;
+    // Every recipient's public key is read and verified once; rsa.pub is the default. Keys named
+    // by username come from the keyring, which skips keys it has verified before.
+    uint32_t named = keys;
+    if (paths + named == 0) {
+        pbpaths[paths++] = "rsa.pub";
+    }
+    keys = paths + named;
+    stat_timer_t timer;
+    stats_start(&timer);
+    mpz_t *n = (mpz_t *) calloc(keys, sizeof(mpz_t));
+    mpz_t *e = (mpz_t *) calloc(keys, sizeof(mpz_t));
+    rsa_cache_t *cache = (rsa_cache_t *) calloc(keys, sizeof(rsa_cache_t));
+    for (uint32_t i = 0; i < keys; i++) {
+        mpz_inits(n[i], e[i], NULL);
+        rsa_cache_init(&cache[i]);
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < paths && ok; i++) {
+        ok = load_key(pbpaths[i], n[i], e[i], &cache[i], verbose);
+    }
+    keyring_t keyring;
+    if (ok && named > 0 && !keyring_open(&keyring, krdir)) {
+        fprintf(stderr, "Error: Failed to open the keyring %s\n", krdir);
+        ok = false;
+    } else if (ok && named > 0) {
+        for (uint32_t i = 0; i < named && ok; i++) {
+            uint32_t k = paths + i;
+            keyring_status_t status = keyring_load(&keyring, users[i], n[k], e[k], &cache[k]);
+            ok = status == KEYRING_OK || status == KEYRING_CACHED;
+            if (!ok) {
+                fprintf(stderr, "Error: Key of %s in %s: %s\n", users[i], krdir,
+                    keyring_status_name(status));
+            } else if (verbose) {
+                printf("user = %s (%s)\n", users[i], keyring_status_name(status));
+                gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n[k], 2), n[k]);
+                gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e[k], 2), e[k]);
+            }
+        }
+        // Remember the keys verified just now; a failure only costs verifying them again.
+        if (!keyring_save(&keyring)) {
+            fprintf(stderr, "Warning: Failed to update the keyring index in %s\n", krdir);
+        }
+        keyring_close(&keyring);
+    }
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+
+    // Encrypt the file, for several recipients at once into one hybrid container
+    if (ok) {
+        opts.cache = &cache[0];
+        if (keys > 1) {
+            ok = rsa_encrypt_file_multi(infile, outfile, keys, n, e, cache, &opts);
+        } else {
+            ok = rsa_encrypt_file_opts(infile, outfile, n[0], e[0], &opts);
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: Failed to write encrypted data\n");
+        }
     }
 
-    // Encrypt the file
-    rsa_encrypt_file(infile, outfile, n, e);
+    // Print the counters and phase times if requested
+    stats_print(stderr, stats_format);
 
     // clear stuff used
     fclose(infile);
     fclose(outfile);
-    fclose(pbfile);
-    mpz_clears(n, e, s, username, NULL);
+    for (uint32_t i = 0; i < keys; i++) {
+        mpz_clears(n[i], e[i], NULL);
+        rsa_cache_clear(&cache[i]);
+    }
+    free(n);
+    free(e);
+    free(cache);
+    free(pbpaths);
+    free(users);
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -1,24 +1,28 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <gmp.h>
 #include <stdbool.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define OPTIONS "hvb:i:n:d:s:" // Valid inputs
+#define OPTIONS "hvb:i:n:d:s:t:m:e:k:S:f:" // Valid inputs
 
 // prints help page
 static void help() {
     fprintf(stderr, "SYNOPSIS\n");
     fprintf(stderr, "   Generates an RSA public/private key pair.\n\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n\n");
+    fprintf(stderr, "   ./keygen [-hv] [-b bits] [-t threads] [-m test] [-e exponent]\n"
+                    "            [-k primes] [-f format] [-S format] -n pbfile -d pvfile\n\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
@@ -28,6 +32,14 @@ static void help() {
     fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub).\n");
     fprintf(stderr, "   -d pvfile       Private key file (default: rsa.priv).\n");
     fprintf(stderr, "   -s seed         Random seed for testing.\n");
+    fprintf(stderr, "   -t threads      Worker threads searching for primes (default: 1).\n");
+    fprintf(stderr, "   -m test         Primality test: bpsw or mr (default: bpsw).\n");
+    fprintf(stderr, "   -e exponent     Public exponent, odd and >= 3, or random (default: %d).\n",
+        RSA_DEFAULT_E);
+    fprintf(stderr, "   -k primes       Number of primes making up n, 2 to %d (default: 2).\n",
+        RSA_MAX_PRIMES);
+    fprintf(stderr, "   -f format       Key file format: text or binary (default: text).\n");
+    fprintf(stderr, "   -S format       Print counters and timings on stderr: table or json.\n");
 }
 
 // driver code of the program
@@ -35,10 +47,14 @@ int main(int argc, char **argv) {
     FILE *pbfile;
     FILE *pvfile;
     bool verbose = false;
+    stats_format_t stats_format = STATS_NONE;
     bool use_default_files = true;
     uint32_t seed = time(NULL); // default seed is time(NULL)
     uint64_t nbits = 256; // default min bits needed for public key is 256
     uint64_t iters = 50; // default Miller-Rabin iterations is 50
+    rsa_keygen_opts_t opts
+        = { .threads = 1, .test = PRIME_TEST_BPSW, .e = RSA_DEFAULT_E, .primes = 2 };
+    rsa_key_format_t key_format = RSA_KEY_TEXT;
     int64_t opt = 0;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -64,6 +80,52 @@ int main(int argc, char **argv) {
             use_default_files = false;
             break;
         case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+        case 'm':
+            if (strcmp(optarg, "bpsw") == 0) {
+                opts.test = PRIME_TEST_BPSW;
+            } else if (strcmp(optarg, "mr") == 0) {
+                opts.test = PRIME_TEST_MR;
+            } else {
+                help();
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "random") == 0) {
+                opts.e = 0;
+            } else {
+                char *end;
+                opts.e = strtoull(optarg, &end, 0);
+                if (*end != '\0' || opts.e < 3 || opts.e % 2 == 0) {
+                    fprintf(stderr, "Public exponent must be an odd number >= 3 or random\n");
+                    return 1;
+                }
+            }
+            break;
+        case 'k':
+            opts.primes = strtoul(optarg, NULL, 10);
+            if (opts.primes < 2 || opts.primes > RSA_MAX_PRIMES) {
+                fprintf(stderr, "Number of primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                key_format = RSA_KEY_TEXT;
+            } else if (strcmp(optarg, "binary") == 0) {
+                key_format = RSA_KEY_BINARY;
+            } else {
+                help();
+                return 1;
+            }
+            break;
+        case 'S':
+            if (!stats_parse_format(optarg, &stats_format)) {
+                help();
+                return 1;
+            }
+            break;
         default: help(); return 1;
         }
     }
@@ -87,44 +149,90 @@ int main(int argc, char **argv) {
     int fd = fileno(pvfile);
     fchmod(fd, 0600);
 
+    // Get the current user’s name as a string.
+    char *user = getenv("USER");
+    if (user == NULL || strlen(user) > RSA_USERNAME_MAX) {
+        fprintf(stderr, "USER must be set to a name of at most %d characters\n", RSA_USERNAME_MAX);
+        return 1;
+    }
+
     // Initialize the random state.
     randstate_init(seed);
 
     // Make the public and private keys.
-    mpz_t p, q, n, e, d, username, s;
-    mpz_inits(p, q, n, e, d, username, s, NULL);
-    rsa_make_pub(p, q, n, e, nbits, iters);
-    rsa_make_priv(d, e, p, q);
-
-    // Get the current user’s name as a string.
-    char *user = getenv("USER");
+    stat_timer_t timer;
+    stats_start(&timer);
+    mpz_t primes[RSA_MAX_PRIMES], n, e, d, username, s;
+    mpz_inits(n, e, d, username, s, NULL);
+    for (uint32_t i = 0; i < opts.primes; i++) {
+        mpz_init(primes[i]);
+    }
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_make_pub_multi(primes, opts.primes, n, e, nbits, iters, &opts);
+    rsa_make_priv_multi(d, e, primes, opts.primes);
+    rsa_make_crt_multi(&crt, d, primes, opts.primes);
+    stats_stop(&timer, STAT_PHASE_KEYGEN);
 
     // Convert the username into an mpz_t, specifying the base as 62.
     mpz_set_str(username, user, 62);
 
     // Compute the signature s of the username.
-    rsa_sign(s, username, d, n);
-
-    // Write the computed public and private key to their respective files.
-    rsa_write_pub(n, e, s, user, pbfile);
-    rsa_write_priv(n, d, pvfile);
+    rsa_sign_crt(s, username, d, n, &crt);
+    stats_stop(&timer, STAT_PHASE_EXP);
+
+    // Write the computed public and private key to their respective files. Binary key files also
+    // store the precomputed exponentiation constants of each key.
+    if (key_format == RSA_KEY_BINARY) {
+        rsa_cache_t cache;
+        rsa_cache_init(&cache);
+        rsa_make_cache(&cache, e, n, NULL);
+        rsa_write_pub_bin(n, e, s, user, &cache, pbfile);
+        rsa_cache_clear(&cache);
+        rsa_cache_init(&cache);
+        rsa_make_cache(&cache, d, n, &crt);
+        rsa_write_priv_bin(n, d, &crt, &cache, pvfile);
+        rsa_cache_clear(&cache);
+    } else {
+        rsa_write_pub(n, e, s, user, pbfile);
+        rsa_write_priv_crt(n, d, &crt, pvfile);
+    }
+    fflush(pbfile);
+    fflush(pvfile);
+    stats_stop(&timer, STAT_PHASE_OUTPUT);
 
     // If verbose output is enabled:
     if (verbose) {
         printf("user = %s\n", user);
         gmp_printf("s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_printf("p (%d bits) = %Zd\n", mpz_sizeinbase(p, 2), p);
-        gmp_printf("q (%d bits) = %Zd\n", mpz_sizeinbase(q, 2), q);
+        gmp_printf("p (%d bits) = %Zd\n", mpz_sizeinbase(primes[0], 2), primes[0]);
+        gmp_printf("q (%d bits) = %Zd\n", mpz_sizeinbase(primes[1], 2), primes[1]);
+        for (uint32_t i = 2; i < opts.primes; i++) {
+            gmp_printf("r%" PRIu32 " (%d bits) = %Zd\n", i - 1, mpz_sizeinbase(primes[i], 2),
+                primes[i]);
+        }
         gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
         gmp_printf("d (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        prime_stats_t stats;
+        prime_stats_get(&stats);
+        printf("prime candidates = %" PRIu64 " (sieve rejected %" PRIu64 ", tested %" PRIu64
+               ", test rejected %" PRIu64 ")\n",
+            stats.candidates, stats.sieved, stats.tested, stats.composite);
     }
 
+    // Print the counters and phase times if requested
+    stats_print(stderr, stats_format);
+
     // clear stuff used
     fclose(pbfile);
     fclose(pvfile);
     randstate_clear();
-    mpz_clears(p, q, n, e, d, username, s, NULL);
+    rsa_crt_clear(&crt);
+    for (uint32_t i = 0; i < opts.primes; i++) {
+        mpz_clear(primes[i]);
+    }
+    mpz_clears(n, e, d, username, s, NULL);
 
     return 0;
 }
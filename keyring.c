@@ -0,0 +1,275 @@
+#include "keyring.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#include "rsa.h"
+#include "sha256.h"
+
+// Orders index entries, or a hash and an entry, by hash; the hash is the first member of an entry.
+static int keyring_compare(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+// Returns the path of name followed by suffix inside the keyring directory; the caller frees it.
+static char *keyring_path(const keyring_t *kr, const char *name, const char *suffix) {
+    size_t len = strlen(kr->dir) + strlen(name) + strlen(suffix) + 2;
+    char *path = (char *) malloc(len);
+    snprintf(path, len, "%s/%s%s", kr->dir, name, suffix);
+    return path;
+}
+
+// Converts a hexstring of exactly 2 * SHA256_DIGEST_SIZE lowercase digits into hash.
+// Returns false if hex is not one.
+static bool keyring_parse_hash(uint8_t hash[SHA256_DIGEST_SIZE], const char *hex) {
+    if (strlen(hex) != 2 * SHA256_DIGEST_SIZE) {
+        return false;
+    }
+    for (int i = 0; i < 2 * SHA256_DIGEST_SIZE; i++) {
+        char ch = hex[i];
+        if (!isdigit((unsigned char) ch) && (ch < 'a' || ch > 'f')) {
+            return false;
+        }
+        uint8_t nibble = ch <= '9' ? ch - '0' : ch - 'a' + 10;
+        hash[i / 2] = i % 2 == 0 ? (uint8_t) (nibble << 4) : (uint8_t) (hash[i / 2] | nibble);
+    }
+    return true;
+}
+
+// Appends an entry without keeping the entries sorted, for filling the index in bulk. Call
+// keyring_sort() before the keyring is searched or saved.
+void keyring_append(keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE], const char *user) {
+    if (kr->count == kr->capacity) {
+        kr->capacity = kr->capacity ? 2 * kr->capacity : 64;
+        kr->entries
+            = (keyring_entry_t *) realloc(kr->entries, kr->capacity * sizeof(keyring_entry_t));
+    }
+    keyring_entry_t *entry = &kr->entries[kr->count++];
+    memcpy(entry->hash, hash, SHA256_DIGEST_SIZE);
+    snprintf(entry->user, sizeof(entry->user), "%s", user);
+}
+
+// Sorts the entries by hash after keyring_append(), keeping one entry per hash.
+void keyring_sort(keyring_t *kr) {
+    qsort(kr->entries, kr->count, sizeof(keyring_entry_t), keyring_compare);
+    size_t kept = 0;
+    for (size_t i = 0; i < kr->count; i++) {
+        if (kept == 0 || keyring_compare(kr->entries[kept - 1].hash, kr->entries[i].hash) != 0) {
+            kr->entries[kept++] = kr->entries[i];
+        }
+    }
+    kr->count = kept;
+}
+
+// Opens the keyring in the directory dir and reads its index. A keyring without an index is
+// empty; an index that cannot be parsed is ignored, and replaced when the keyring is saved.
+// Returns false, leaving nothing to close, if dir is not a directory or the index cannot be
+// opened.
+bool keyring_open(keyring_t *kr, const char *dir) {
+    memset(kr, 0, sizeof(keyring_t));
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    kr->dir = strdup(dir);
+    char *path = keyring_path(kr, KEYRING_INDEX, "");
+    FILE *index = fopen(path, "r");
+    free(path);
+    if (index == NULL && errno != ENOENT) {
+        keyring_close(kr);
+        return false;
+    }
+    if (index == NULL) {
+        return true;
+    }
+    char line[2 * SHA256_DIGEST_SIZE + RSA_USERNAME_MAX + 4];
+    char hex[2 * SHA256_DIGEST_SIZE + 2], user[RSA_USERNAME_MAX + 1];
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    bool ok = fgets(line, sizeof(line), index) != NULL
+              && strncmp(line, KEYRING_MAGIC "\n", sizeof(KEYRING_MAGIC)) == 0;
+    while (ok && fgets(line, sizeof(line), index) != NULL) {
+        ok = sscanf(line, "%65s " RSA_USERNAME_FORMAT, hex, user) == 2
+             && keyring_parse_hash(hash, hex);
+        if (ok) {
+            keyring_append(kr, hash, user);
+        }
+    }
+    fclose(index);
+    if (!ok) {
+        kr->count = 0;
+        kr->dirty = true;
+    }
+    keyring_sort(kr);
+    return true;
+}
+
+// Frees the memory of a keyring without saving it.
+void keyring_close(keyring_t *kr) {
+    free(kr->dir);
+    free(kr->entries);
+    memset(kr, 0, sizeof(keyring_t));
+}
+
+// Returns true if the index lists a verified key file with the given hash.
+bool keyring_find(const keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE]) {
+    return kr->count > 0
+           && bsearch(hash, kr->entries, kr->count, sizeof(keyring_entry_t), keyring_compare)
+                  != NULL;
+}
+
+// Records the key file with the given hash, belonging to user, as verified.
+void keyring_add(keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE], const char *user) {
+    if (keyring_find(kr, hash)) {
+        return;
+    }
+    keyring_append(kr, hash, user);
+    // Move the new entry to its place in hash order
+    size_t i = kr->count - 1;
+    keyring_entry_t entry = kr->entries[i];
+    while (i > 0 && keyring_compare(kr->entries[i - 1].hash, entry.hash) > 0) {
+        kr->entries[i] = kr->entries[i - 1];
+        i -= 1;
+    }
+    kr->entries[i] = entry;
+    kr->dirty = true;
+}
+
+// Forgets every entry of the index, e.g. before rebuilding it.
+void keyring_clear(keyring_t *kr) {
+    kr->count = 0;
+    kr->dirty = true;
+}
+
+// Writes the index back if it changed. The index is written to a temporary file that then
+// replaces it, so readers never see a partial index. Returns false if it could not be written.
+bool keyring_save(keyring_t *kr) {
+    if (!kr->dirty) {
+        return true;
+    }
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld", (long) getpid());
+    char *path = keyring_path(kr, KEYRING_INDEX, "");
+    char *temp = keyring_path(kr, KEYRING_INDEX, suffix);
+    FILE *index = fopen(temp, "w");
+    bool ok = index != NULL;
+    if (ok) {
+        fprintf(index, "%s\n", KEYRING_MAGIC);
+        for (size_t i = 0; i < kr->count; i++) {
+            for (int j = 0; j < SHA256_DIGEST_SIZE; j++) {
+                fprintf(index, "%02x", kr->entries[i].hash[j]);
+            }
+            fprintf(index, " %s\n", kr->entries[i].user);
+        }
+        ok = fclose(index) == 0 && rename(temp, path) == 0;
+        if (!ok) {
+            unlink(temp);
+        }
+    }
+    kr->dirty = kr->dirty && !ok;
+    free(path);
+    free(temp);
+    return ok;
+}
+
+// Returns true if user can name a key file in a keyring: a username of at most RSA_USERNAME_MAX
+// characters without whitespace or slashes that does not start with a dot.
+bool keyring_user_valid(const char *user) {
+    size_t len = strlen(user);
+    if (len == 0 || len > RSA_USERNAME_MAX || user[0] == '.') {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (user[i] == '/' || isspace((unsigned char) user[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns a short description of status.
+const char *keyring_status_name(keyring_status_t status) {
+    switch (status) {
+    case KEYRING_OK: return "verified";
+    case KEYRING_CACHED: return "cached";
+    case KEYRING_MISSING: return "missing";
+    case KEYRING_UNREADABLE: return "unreadable";
+    case KEYRING_WRONG_USER: return "wrong user";
+    case KEYRING_BAD_SIGNATURE: return "bad signature";
+    }
+    return "unknown";
+}
+
+// Reads the public key file at path into n, e and cache and stores the SHA-256 hash of the file
+// in hash. If user is not NULL, the key must belong to user. The signature is verified unless
+// kr is not NULL and its index lists the hash. Only reads kr, so workers may check keys of one
+// keyring in parallel.
+keyring_status_t keyring_check(const keyring_t *kr, const char *path, const char *user, mpz_t n,
+    mpz_t e, rsa_cache_t *cache, uint8_t hash[SHA256_DIGEST_SIZE]) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return KEYRING_MISSING;
+    }
+    // Read the file once, then hash it and parse the key from the same bytes, so that the hash
+    // always belongs to the key that was checked.
+    struct stat st;
+    size_t size = fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size + 1 : 4096;
+    size_t used = 0, got;
+    uint8_t *data = (uint8_t *) malloc(size);
+    while ((got = fread(data + used, sizeof(uint8_t), size - used, file)) > 0) {
+        used += got;
+        if (used == size) {
+            size *= 2;
+            data = (uint8_t *) realloc(data, size);
+        }
+    }
+    fclose(file);
+    sha256(hash, data, used);
+    FILE *pbfile = used > 0 ? fmemopen(data, used, "r") : NULL;
+    mpz_t s, username;
+    mpz_inits(s, username, NULL);
+    char name[RSA_USERNAME_MAX + 1];
+    keyring_status_t status = KEYRING_OK;
+    if (pbfile == NULL || !rsa_load_pub(n, e, s, name, cache, pbfile)) {
+        status = KEYRING_UNREADABLE;
+    } else if (user != NULL && strcmp(name, user) != 0) {
+        status = KEYRING_WRONG_USER;
+    } else if (kr != NULL && keyring_find(kr, hash)) {
+        status = KEYRING_CACHED;
+    } else {
+        // Convert the username to an mpz_t and verify the signature.
+        mpz_set_str(username, name, 62);
+        status = rsa_verify_cached(username, s, e, n, cache) ? KEYRING_OK : KEYRING_BAD_SIGNATURE;
+    }
+    if (pbfile != NULL) {
+        fclose(pbfile);
+    }
+    free(data);
+    mpz_clears(s, username, NULL);
+    return status;
+}
+
+// Reads the key of user from the keyring into n, e and cache, verifying its signature unless the
+// index lists its file, and adding the file to the index once verified. Save the keyring to keep
+// the new entries.
+keyring_status_t keyring_load(
+    keyring_t *kr, const char *user, mpz_t n, mpz_t e, rsa_cache_t *cache) {
+    if (!keyring_user_valid(user)) {
+        return KEYRING_MISSING;
+    }
+    char *path = keyring_path(kr, user, ".pub");
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    keyring_status_t status = keyring_check(kr, path, user, n, e, cache, hash);
+    if (status == KEYRING_OK) {
+        keyring_add(kr, hash, user);
+    }
+    free(path);
+    return status;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "rsa.h"
+#include "sha256.h"
+
+// A keyring is a directory of public key files, one per user and named <username>.pub, in either
+// key format. Its index file lists the SHA-256 hashes of the key files whose signature has been
+// verified, so that a key whose file has not changed since is not verified again.
+#define KEYRING_INDEX   "index"
+#define KEYRING_MAGIC   "rsa-keyring 1" // first line of the index
+#define KEYRING_DEFAULT "keyring" // directory used when none is given
+
+// A verified key file in the index.
+typedef struct {
+    uint8_t hash[SHA256_DIGEST_SIZE]; // SHA-256 of the whole key file
+    char user[RSA_USERNAME_MAX + 1];
+} keyring_entry_t;
+
+// A keyring and its index, held in memory sorted by hash.
+typedef struct {
+    char *dir;
+    keyring_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    bool dirty; // entries were added or removed since the index was read
+} keyring_t;
+
+// Outcome of reading and checking one key file.
+typedef enum {
+    KEYRING_OK, // the signature was verified
+    KEYRING_CACHED, // the file is listed in the index, so verification was skipped
+    KEYRING_MISSING, // there is no key file, or the username cannot name one
+    KEYRING_UNREADABLE, // the file does not hold a public key
+    KEYRING_WRONG_USER, // the key belongs to another user than its file name says
+    KEYRING_BAD_SIGNATURE, // the signature does not verify
+} keyring_status_t;
+
+bool keyring_open(keyring_t *kr, const char *dir);
+
+void keyring_close(keyring_t *kr);
+
+bool keyring_find(const keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE]);
+
+void keyring_add(keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE], const char *user);
+
+void keyring_append(keyring_t *kr, const uint8_t hash[SHA256_DIGEST_SIZE], const char *user);
+
+void keyring_sort(keyring_t *kr);
+
+void keyring_clear(keyring_t *kr);
+
+bool keyring_save(keyring_t *kr);
+
+bool keyring_user_valid(const char *user);
+
+const char *keyring_status_name(keyring_status_t status);
+
+keyring_status_t keyring_check(const keyring_t *kr, const char *path, const char *user, mpz_t n,
+    mpz_t e, rsa_cache_t *cache, uint8_t hash[SHA256_DIGEST_SIZE]);
+
+keyring_status_t keyring_load(
+    keyring_t *kr, const char *user, mpz_t n, mpz_t e, rsa_cache_t *cache);
@@ -0,0 +1,184 @@
+#include "rsa.h"
+#include "keyring.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define OPTIONS "hvfd:t:S:" // Valid inputs
+
+// prints help page
+static void help() {
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Verifies every public key in a keyring and rebuilds its index.\n");
+    fprintf(stderr, "   Keys listed in the index are not verified again unless forced.\n\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./keyverify [-hvf] [-t threads] [-S format] [-d keyring]\n\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display the outcome for every key.\n");
+    fprintf(stderr, "   -f              Verify every key, including those listed in the index.\n");
+    fprintf(stderr, "   -d keyring      Keyring directory (default: " KEYRING_DEFAULT ").\n");
+    fprintf(stderr, "   -t threads      Worker threads verifying keys (default: 1).\n");
+    fprintf(stderr, "   -S format       Print counters and timings on stderr: table or json.\n");
+}
+
+// One key file of the keyring and the outcome of checking it.
+typedef struct {
+    char user[RSA_USERNAME_MAX + 1];
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    keyring_status_t status;
+} key_job_t;
+
+// Keys checked by the workers against an index that stays unchanged while they run.
+typedef struct {
+    const keyring_t *kr; // NULL to verify every key
+    const char *dir;
+    key_job_t *jobs;
+} key_batch_t;
+
+static int compare_jobs(const void *a, const void *b) {
+    return strcmp(((const key_job_t *) a)->user, ((const key_job_t *) b)->user);
+}
+
+// Pool worker: reads and checks the key file of one job.
+static void check_key(void *arg, uint32_t worker, uint64_t index) {
+    (void) worker;
+    key_batch_t *batch = (key_batch_t *) arg;
+    key_job_t *job = &batch->jobs[index];
+    size_t len = strlen(batch->dir) + strlen(job->user) + sizeof(".pub") + 1;
+    char *path = (char *) malloc(len);
+    snprintf(path, len, "%s/%s.pub", batch->dir, job->user);
+    mpz_t n, e;
+    mpz_inits(n, e, NULL);
+    rsa_cache_t cache;
+    rsa_cache_init(&cache);
+    job->status = keyring_check(batch->kr, path, job->user, n, e, &cache, job->hash);
+    rsa_cache_clear(&cache);
+    mpz_clears(n, e, NULL);
+    free(path);
+}
+
+// Lists the <username>.pub files of the directory dir in jobs, sorted by username. Returns the
+// number of files, or -1 if dir cannot be read.
+static int64_t list_keys(const char *dir, key_job_t **jobs) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    size_t count = 0, capacity = 0;
+    *jobs = NULL;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 4 || strcmp(ent->d_name + len - 4, ".pub") != 0) {
+            continue;
+        }
+        char user[RSA_USERNAME_MAX + 1];
+        if (len - 4 > RSA_USERNAME_MAX) {
+            continue;
+        }
+        memcpy(user, ent->d_name, len - 4);
+        user[len - 4] = '\0';
+        if (!keyring_user_valid(user)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            *jobs = (key_job_t *) realloc(*jobs, capacity * sizeof(key_job_t));
+        }
+        memset(&(*jobs)[count], 0, sizeof(key_job_t));
+        memcpy((*jobs)[count].user, user, len - 3);
+        count += 1;
+    }
+    closedir(d);
+    qsort(*jobs, count, sizeof(key_job_t), compare_jobs);
+    return (int64_t) count;
+}
+
+// driver code of the program
+int main(int argc, char **argv) {
+    const char *dir = KEYRING_DEFAULT;
+    uint32_t threads = 1;
+    bool verbose = false;
+    bool force = false;
+    stats_format_t stats_format = STATS_NONE;
+    int32_t opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 1;
+        case 'v': verbose = true; break;
+        case 'f': force = true; break;
+        case 'd': dir = optarg; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'S':
+            if (!stats_parse_format(optarg, &stats_format)) {
+                help();
+                return 1;
+            }
+            break;
+        default: help(); return 1;
+        }
+    }
+
+    keyring_t keyring;
+    key_job_t *jobs = NULL;
+    if (!keyring_open(&keyring, dir)) {
+        fprintf(stderr, "Error: Failed to open the keyring %s\n", dir);
+        return 1;
+    }
+    int64_t count = list_keys(dir, &jobs);
+    if (count < 0) {
+        fprintf(stderr, "Error: Failed to open the keyring %s\n", dir);
+        keyring_close(&keyring);
+        return 1;
+    }
+
+    // Check every key file in parallel; the workers only read the index.
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(threads);
+    key_batch_t batch = { .kr = force ? NULL : &keyring, .dir = dir, .jobs = jobs };
+    pool_run(pool, check_key, &batch, (uint64_t) count);
+    pool_delete(&pool);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+
+    // Rebuild the index from the files that verify now, dropping entries of changed or removed
+    // files.
+    uint64_t tally[KEYRING_BAD_SIGNATURE + 1] = { 0 };
+    keyring_clear(&keyring);
+    for (int64_t i = 0; i < count; i++) {
+        tally[jobs[i].status] += 1;
+        if (jobs[i].status == KEYRING_OK || jobs[i].status == KEYRING_CACHED) {
+            keyring_append(&keyring, jobs[i].hash, jobs[i].user);
+        }
+        if (verbose || (jobs[i].status != KEYRING_OK && jobs[i].status != KEYRING_CACHED)) {
+            printf("%s: %s\n", jobs[i].user, keyring_status_name(jobs[i].status));
+        }
+    }
+    keyring_sort(&keyring);
+    uint64_t failed = (uint64_t) count - tally[KEYRING_OK] - tally[KEYRING_CACHED];
+    printf("keys: %" PRId64 ", verified: %" PRIu64 ", cached: %" PRIu64 ", failed: %" PRIu64 "\n",
+        count, tally[KEYRING_OK], tally[KEYRING_CACHED], failed);
+    bool ok = keyring_save(&keyring);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write the keyring index in %s\n", dir);
+    }
+
+    // Print the counters and phase times if requested
+    stats_print(stderr, stats_format);
+
+    keyring_close(&keyring);
+    free(jobs);
+
+    return ok && failed == 0 ? 0 : 1;
+}
@@ -2,43 +2,175 @@
 #include <stdint.h>
 #include <gmp.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "randstate.h"
 #include "numtheory.h"
+#include "pool.h"
+#include "stats.h"
+
+// Initializes a workspace. With bits > 0, its integers and exponentiation buffers are
+// preallocated for moduli of up to bits bits, so that calls on such moduli never allocate.
+void nt_ws_init(nt_ws_t *ws, uint64_t bits) {
+    for (int i = 0; i < NT_WS_INTS; i++) {
+        if (bits > 0) {
+            mpz_init2(ws->t[i], 2 * bits + GMP_NUMB_BITS); // room for a double-width product
+        } else {
+            mpz_init(ws->t[i]);
+        }
+    }
+    if (bits == 0) {
+        mpz_t one;
+        mpz_init_set_ui(one, 1);
+        powm_init(&ws->pm, one, one); // no buffers until the first call
+        mpz_clear(one);
+        return;
+    }
+    // size the context for the largest odd modulus and exponent of bits bits
+    mpz_set_ui(ws->t[0], 0);
+    mpz_setbit(ws->t[0], bits);
+    mpz_sub_ui(ws->t[0], ws->t[0], 1); // t[0] <- 2^bits - 1
+    powm_init(&ws->pm, ws->t[0], ws->t[0]);
+}
+
+// Clears and frees all memory used by a workspace.
+void nt_ws_clear(nt_ws_t *ws) {
+    for (int i = 0; i < NT_WS_INTS; i++) {
+        mpz_clear(ws->t[i]);
+    }
+    powm_clear(&ws->pm);
+}
+
+// Bits of the leading digits that Lehmer's algorithm runs Euclid's algorithm on: two below a limb,
+// so that the cosequence entries and the sums formed with them fit in a signed long.
+#define LEHMER_BITS (GMP_NUMB_BITS - 2)
+
+// Returns floor(x / 2^shift) for x >= 0, which must fit in LEHMER_BITS bits.
+static long lehmer_digits(mpz_t x, size_t shift) {
+    size_t limb = shift / GMP_NUMB_BITS, offset = shift % GMP_NUMB_BITS;
+    mp_limb_t digits = mpz_getlimbn(x, limb) >> offset; // limbs past the top read as 0
+    if (offset != 0) {
+        digits |= mpz_getlimbn(x, limb + 1) << (GMP_NUMB_BITS - offset);
+    }
+    return (long) digits;
+}
+
+// Runs Euclid's algorithm on the leading LEHMER_BITS bits of u >= v > 0 for as long as its
+// quotients are certain to be those of u and v (Knuth's Algorithm L), storing the product of their
+// quotient matrices in m: the same steps on u and v yield m[0] * u + m[1] * v and
+// m[2] * u + m[3] * v. Returns false if not a single step could be taken that way, in which case
+// the caller takes one step with a full division.
+static bool lehmer_matrix(long m[4], mpz_t u, mpz_t v) {
+    if (mpz_sgn(v) <= 0 || mpz_cmp(u, v) < 0) {
+        return false;
+    }
+    size_t bits = mpz_sizeinbase(u, 2);
+    size_t shift = bits > LEHMER_BITS ? bits - LEHMER_BITS : 0;
+    long uh = lehmer_digits(u, shift), vh = lehmer_digits(v, shift);
+    long a = 1, b = 0, c = 0, d = 1;
+    // uh + a and uh + b bound the leading digits of the current remainders, so equal quotients
+    // of the two bounds are the quotient of the full remainders
+    while (vh + c > 0 && vh + d > 0 && uh + a >= 0 && uh + b >= 0) {
+        long q = (uh + a) / (vh + c);
+        if (q != (uh + b) / (vh + d)) {
+            break;
+        }
+        long t = a - q * c;
+        a = c;
+        c = t;
+        t = b - q * d;
+        b = d;
+        d = t;
+        t = uh - q * vh;
+        uh = vh;
+        vh = t;
+    }
+    m[0] = a;
+    m[1] = b;
+    m[2] = c;
+    m[3] = d;
+    return b != 0;
+}
+
+// Sets out to x * a + y * b. out must not be x or y.
+static void lehmer_combine(mpz_t out, mpz_t x, long a, mpz_t y, long b) {
+    mpz_mul_si(out, x, a);
+    if (b >= 0) {
+        mpz_addmul_ui(out, y, (unsigned long) b);
+    } else {
+        mpz_submul_ui(out, y, -(unsigned long) b);
+    }
+}
+
+// Applies the matrix m of lehmer_matrix() to the pair (x, y), using scratch integers s and t.
+static void lehmer_apply(const long m[4], mpz_t x, mpz_t y, mpz_t s, mpz_t t) {
+    lehmer_combine(s, x, m[0], y, m[1]);
+    lehmer_combine(t, x, m[2], y, m[3]);
+    mpz_swap(x, s);
+    mpz_swap(y, t);
+}
 
 // Computes the greatest common divisor of a and b, storing the value of the computed divisor in d.
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
-    mpz_t temp, a_val, b_val;
-    mpz_inits(temp, a_val, b_val, NULL);
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    gcd_ws(d, a, b, &ws);
+    nt_ws_clear(&ws);
+}
+
+// Computes the greatest common divisor of a and b like gcd(), using the scratch integers of ws.
+// Runs of Euclid steps are taken on the leading word of the operands with Lehmer's algorithm and
+// then applied to the full operands at once; the remaining steps use a full division.
+void gcd_ws(mpz_t d, mpz_t a, mpz_t b, nt_ws_t *ws) {
+    mpz_ptr temp = ws->t[0], a_val = ws->t[1], b_val = ws->t[2], scratch = ws->t[3];
+    long m[4];
     mpz_set(a_val, a);
     mpz_set(b_val, b);
     while (mpz_cmp_ui(b_val, 0) != 0) { // while b != 0
-        mpz_set(temp, b_val); // t <- b
-        mpz_mod(b_val, a_val, b_val); // b <- a mod b
-        mpz_set(a_val, temp); // a <- t
+        if (lehmer_matrix(m, a_val, b_val)) {
+            lehmer_apply(m, a_val, b_val, temp, scratch);
+            continue;
+        }
+        mpz_mod(temp, a_val, b_val); // t <- a mod b
+        mpz_swap(a_val, b_val); // a <- b
+        mpz_swap(b_val, temp); // b <- t
     }
     mpz_set(d, a_val); // d <- a
-    mpz_clears(temp, a_val, b_val, NULL);
 }
 
 // Computes the inverse i of a modulo n. If a modular inverse cannot be found, i is set to 0.
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
-    mpz_t r, rp, t, tp, q, temp;
-    mpz_inits(r, rp, t, tp, q, temp, NULL);
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    mod_inverse_ws(i, a, n, &ws);
+    nt_ws_clear(&ws);
+}
+
+// Computes the inverse i of a modulo n like mod_inverse(), using the scratch integers of ws.
+// Takes runs of Euclid steps with Lehmer's algorithm as gcd_ws() does, applying each run to the
+// cofactors (t, t') as well.
+void mod_inverse_ws(mpz_t i, mpz_t a, mpz_t n, nt_ws_t *ws) {
+    mpz_ptr r = ws->t[0], rp = ws->t[1], t = ws->t[2], tp = ws->t[3], q = ws->t[4];
+    mpz_ptr temp = ws->t[5], scratch = ws->t[6];
+    long m[4];
     mpz_set(r, n); // r <- n
     mpz_set(rp, a); // rp <- a
     mpz_set_ui(t, 0); // t <- 0
     mpz_set_ui(tp, 1); // t' <- 1
     while (mpz_cmp_ui(rp, 0) != 0) { // while r' != 0
+        if (lehmer_matrix(m, r, rp)) {
+            lehmer_apply(m, r, rp, temp, scratch);
+            lehmer_apply(m, t, tp, temp, scratch);
+            continue;
+        }
         mpz_fdiv_q(q, r, rp); // q <- floor of r/r'
-        mpz_set(temp, r); // temp <- r
-        mpz_set(r, rp); // r <- r'
-        mpz_submul(temp, q, rp); // temp <- (r - q * r')
-        mpz_set(rp, temp); // r' <- (r - q * r')
-        mpz_set(temp, t); // temp <- t
-        mpz_set(t, tp); // t <- t'
-        mpz_submul(temp, q, tp); // temp <- (t - q * t')
-        mpz_set(tp, temp); // t' <- (t - q * t')
+        mpz_submul(r, q, rp); // r <- (r - q * r')
+        mpz_swap(r, rp); // (r, r') <- (r', r - q * r')
+        mpz_submul(t, q, tp); // t <- (t - q * t')
+        mpz_swap(t, tp); // (t, t') <- (t', t - q * t')
     }
     if (mpz_cmp_ui(r, 1) > 0) { // if r > 1
         mpz_set_ui(t, 0); // t <- 0
@@ -47,14 +179,145 @@ void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
         mpz_add(t, t, n); // t <- t + n
     }
     mpz_set(i, t); // i <- t
-    mpz_clears(r, rp, t, tp, q, temp, NULL);
 }
 
-// Performs fast modular exponentiation, computing base raised to the exponent power modulo modulus
-// and stores the computed result in out.
-void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+// Copies a (0 <= a < 2^(size * GMP_NUMB_BITS)) into size limbs, zero-padding the high limbs.
+static void limbs_from_mpz(mp_limb_t *out, mp_size_t size, mpz_t a) {
+    mp_size_t used = mpz_size(a);
+    memcpy(out, mpz_limbs_read(a), used * sizeof(mp_limb_t));
+    memset(out + used, 0, (size - used) * sizeof(mp_limb_t));
+}
+
+// Montgomery reduction (REDC) of the 2 * size limb product t, storing t * R^-1 mod n in out.
+// Only word multiplications and additions are used; t is clobbered.
+static void mont_redc(mont_t *mt, mp_limb_t *out, mp_limb_t *t) {
+    mp_size_t size = mt->size;
+    for (mp_size_t i = 0; i < size; i++) {
+        mp_limb_t q = t[i] * mt->ninv; // q <- t[i] * -n^-1 so that t + q * n is 0 in limb i
+        t[i] = mpn_addmul_1(t + i, mt->n, size, q); // limb i is now 0, keep its carry there
+    }
+    // add the saved carries to the high half, which is at most 2n - 1
+    mp_limb_t carry = mpn_add_n(out, t + size, t, size);
+    if (carry != 0 || mpn_cmp(out, mt->n, size) >= 0) {
+        mpn_sub_n(out, out, mt->n, size);
+    }
+}
+
+// Initializes a Montgomery context for the odd modulus modulus (modulus > 1).
+void mont_init(mont_t *mt, mpz_t modulus) {
+    mt->n = NULL;
+    mt->capacity = 0;
+    mont_set(mt, modulus);
+}
+
+// Sizes the buffers of a Montgomery context for modulus, growing them only if the modulus has
+// more limbs than any before it, and copies the modulus in.
+static void mont_resize(mont_t *mt, mpz_t modulus) {
+    mp_size_t size = mpz_size(modulus);
+    if (size > mt->capacity) {
+        // n, r2, one, then 2 * size limbs of scratch and a size + 1 limb quotient
+        free(mt->n);
+        mt->n = (mp_limb_t *) malloc((6 * size + 1) * sizeof(mp_limb_t));
+        mt->capacity = size;
+    }
+    mt->size = size;
+    mt->r2 = mt->n + size;
+    mt->one = mt->r2 + size;
+    mt->scratch = mt->one + size;
+    limbs_from_mpz(mt->n, size, modulus);
+}
+
+// Retargets an initialized Montgomery context to the odd modulus modulus (modulus > 1). The
+// buffers are only reallocated if the modulus has more limbs than any before it.
+void mont_set(mont_t *mt, mpz_t modulus) {
+    mont_resize(mt, modulus);
+    mp_size_t size = mt->size;
+    // Newton iteration for n^-1 mod 2^GMP_NUMB_BITS; n * n = 1 mod 8 gives the first 3 bits
+    mp_limb_t inv = mt->n[0];
+    for (int i = 0; i < 6; i++) {
+        inv *= 2 - mt->n[0] * inv;
+    }
+    mt->ninv = -inv;
+    mp_limb_t *t = mt->scratch, *quotient = mt->scratch + 2 * size;
+    memset(t, 0, size * sizeof(mp_limb_t));
+    t[size] = 1; // t <- R
+    mpn_tdiv_qr(quotient, mt->one, 0, t, size + 1, mt->n, size); // one <- R mod n
+    mpn_sqr(t, mt->one, size); // t <- (R mod n)^2
+    mpn_tdiv_qr(quotient, mt->r2, 0, t, 2 * size, mt->n, size); // r2 <- R^2 mod n
+}
+
+// Retargets an initialized Montgomery context to modulus like mont_set(), taking its constants
+// from pc instead of computing them.
+static void mont_set_cached(mont_t *mt, mpz_t modulus, const powm_cache_t *pc) {
+    mont_resize(mt, modulus);
+    mt->ninv = pc->ninv;
+    limbs_from_mpz(mt->one, mt->size, (mpz_ptr) pc->one);
+    limbs_from_mpz(mt->r2, mt->size, (mpz_ptr) pc->r2);
+}
+
+// Clears and frees all memory used by a Montgomery context.
+void mont_clear(mont_t *mt) {
+    free(mt->n);
+    mt->n = mt->r2 = mt->one = mt->scratch = NULL;
+    mt->size = 0;
+    mt->capacity = 0;
+}
+
+// Stores a mod n in out without converting it into Montgomery form.
+static void mont_load(mont_t *mt, mp_limb_t *out, mpz_t a) {
+    mp_size_t used = mpz_size(a);
+    if (mpz_sgn(a) > 0 && used >= mt->size && used <= 2 * mt->size) {
+        // divide in place; the quotient fits in the size + 1 limbs after the scratch product
+        mp_limb_t *quotient = mt->scratch + 2 * mt->size;
+        mpn_tdiv_qr(quotient, out, 0, mpz_limbs_read(a), used, mt->n, mt->size);
+        return;
+    }
+    if (mpz_sgn(a) < 0 || used >= mt->size) {
+        mpz_t modulus, reduced;
+        mpz_init(reduced);
+        mpz_roinit_n(modulus, mt->n, mt->size);
+        mpz_mod(reduced, a, modulus); // reduced <- a mod n
+        limbs_from_mpz(out, mt->size, reduced);
+        mpz_clear(reduced);
+    } else {
+        limbs_from_mpz(out, mt->size, a);
+    }
+}
+
+// Converts a into Montgomery form, storing a * R mod n in out.
+void mont_to(mont_t *mt, mp_limb_t *out, mpz_t a) {
+    mont_load(mt, out, a);
+    mont_mul(mt, out, out, mt->r2); // out <- a * R^2 * R^-1 = a * R mod n
+}
+
+// Converts a out of Montgomery form, storing a * R^-1 mod n in out.
+void mont_from(mont_t *mt, mpz_t out, const mp_limb_t *a) {
+    mp_limb_t *t = mt->scratch;
+    memcpy(t, a, mt->size * sizeof(mp_limb_t));
+    memset(t + mt->size, 0, mt->size * sizeof(mp_limb_t));
+    mont_redc(mt, mpz_limbs_write(out, mt->size), t);
+    mpz_limbs_finish(out, mt->size);
+}
+
+// Montgomery multiplication, storing a * b * R^-1 mod n in out. out may alias a or b.
+void mont_mul(mont_t *mt, mp_limb_t *out, const mp_limb_t *a, const mp_limb_t *b) {
+    mpn_mul_n(mt->scratch, a, b, mt->size);
+    mont_redc(mt, out, mt->scratch);
+}
+
+// Montgomery squaring, storing a * a * R^-1 mod n in out. out may alias a.
+void mont_sqr(mont_t *mt, mp_limb_t *out, const mp_limb_t *a) {
+    mpn_sqr(mt->scratch, a, mt->size);
+    mont_redc(mt, out, mt->scratch);
+}
+
+// Performs modular exponentiation with the original square-and-multiply loop over mpz_t values.
+// Used for moduli the Montgomery engine cannot handle (even moduli and 1).
+static void pow_mod_plain(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_t v, p, d, remainder, product, expression, temp;
     mpz_inits(v, p, d, remainder, product, expression, temp, NULL);
+    stats_add(STAT_POWM_CALLS, 1);
+    stats_add(STAT_POWM_BITS, mpz_sgn(exponent) > 0 ? mpz_sizeinbase(exponent, 2) : 0);
     mpz_set_ui(v, 1); // v <- 1
     mpz_set(p, base); // p <- a
     mpz_set(d, exponent); // d <- exponent
@@ -74,14 +337,322 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_clears(v, p, d, remainder, product, expression, temp, NULL);
 }
 
+// Picks the sliding window width for an exponent of bits bits.
+static uint32_t powm_window(size_t bits) {
+    if (bits <= 24) {
+        return 1;
+    } else if (bits <= 80) {
+        return 3;
+    } else if (bits <= 240) {
+        return 4;
+    } else if (bits <= 672) {
+        return 5;
+    } else if (bits <= 1792) {
+        return 6;
+    }
+    return 7;
+}
+
+// Computes the correction R^e mod n of the one-limb exponent e (> 0) into out, using the size
+// limbs of acc as scratch.
+static void powm_correction(mont_t *mt, mp_limb_t *out, mp_limb_t *acc, mp_limb_t e) {
+    // raise R (whose Montgomery form is R^2 mod n) to e, then convert back
+    memcpy(acc, mt->one, mt->size * sizeof(mp_limb_t));
+    for (int i = GMP_NUMB_BITS - __builtin_clzll(e); i-- > 0;) {
+        mont_sqr(mt, acc, acc);
+        if ((e >> i) & 1) {
+            mont_mul(mt, acc, acc, mt->r2);
+        }
+    }
+    memcpy(mt->scratch, acc, mt->size * sizeof(mp_limb_t));
+    memset(mt->scratch + mt->size, 0, mt->size * sizeof(mp_limb_t));
+    mont_redc(mt, out, mt->scratch);
+}
+
+// Initializes an exponentiation context for exponent (>= 0) and modulus. The exponent is recoded
+// into sliding-window steps and every buffer needed by powm() is allocated here.
+void powm_init(powm_t *pm, mpz_t exponent, mpz_t modulus) {
+    powm_init_cached(pm, exponent, modulus, NULL);
+}
+
+// Retargets an initialized exponentiation context to exponent (>= 0) and modulus. Its buffers are
+// only reallocated if they are too small, so a context reused for keys of one size stops
+// allocating after the first call.
+void powm_set(powm_t *pm, mpz_t exponent, mpz_t modulus) {
+    powm_set_cached(pm, exponent, modulus, NULL);
+}
+
+// Initializes an exponentiation context like powm_init(), taking the Montgomery constants and the
+// short-exponent correction from pc when it is valid (see powm_set_cached()).
+void powm_init_cached(powm_t *pm, mpz_t exponent, mpz_t modulus, const powm_cache_t *pc) {
+    pm->mt.n = NULL;
+    pm->mt.capacity = 0;
+    pm->steps = NULL;
+    pm->steps_capacity = 0;
+    pm->table = NULL;
+    pm->table_capacity = 0;
+    mpz_inits(pm->exponent, pm->modulus, NULL);
+    powm_set_cached(pm, exponent, modulus, pc);
+}
+
+// Retargets an initialized exponentiation context like powm_set(). If pc is valid, it must have
+// been saved by powm_cache_save() from a context for the same modulus; its Montgomery constants
+// are then used instead of dividing, and its correction instead of exponentiating when it belongs
+// to the same one-limb exponent. pc may be NULL.
+void powm_set_cached(powm_t *pm, mpz_t exponent, mpz_t modulus, const powm_cache_t *pc) {
+    pm->mont = mpz_odd_p(modulus) && mpz_cmp_ui(modulus, 1) > 0;
+    pm->nsteps = 0;
+    if (!pm->mont) {
+        mpz_set(pm->exponent, exponent);
+        mpz_set(pm->modulus, modulus);
+        return;
+    }
+    bool cached = pc != NULL && pc->valid;
+    if (cached) {
+        mont_set_cached(&pm->mt, modulus, pc);
+    } else if (pm->mt.n == NULL) {
+        mont_init(&pm->mt, modulus);
+    } else {
+        mont_set(&pm->mt, modulus);
+    }
+    size_t bits = mpz_sgn(exponent) > 0 ? mpz_sizeinbase(exponent, 2) : 0;
+    pm->window = powm_window(bits);
+    pm->bits = bits;
+    pm->short_exp = bits > 0 && bits <= GMP_NUMB_BITS;
+    pm->exp_word = pm->short_exp ? mpz_getlimbn(exponent, 0) : 0;
+    // each step consumes at least one exponent bit, plus one step for trailing squarings
+    if (bits + 1 > pm->steps_capacity) {
+        free(pm->steps);
+        pm->steps = (powm_step_t *) malloc((bits + 1) * sizeof(powm_step_t));
+        pm->steps_capacity = bits + 1;
+    }
+    uint32_t pending = 0;
+    for (int64_t i = (int64_t) bits - 1; i >= 0;) {
+        if (!mpz_tstbit(exponent, i)) { // zero bits only need a squaring
+            pending += 1;
+            i -= 1;
+            continue;
+        }
+        // take the longest window of at most window bits starting at i and ending in a 1 bit
+        int64_t low = i - (int64_t) pm->window + 1 > 0 ? i - (int64_t) pm->window + 1 : 0;
+        while (!mpz_tstbit(exponent, low)) {
+            low += 1;
+        }
+        uint32_t digit = 0;
+        for (int64_t j = i; j >= low; j--) {
+            digit = (digit << 1) | mpz_tstbit(exponent, j);
+        }
+        // the accumulator starts at 1, so squarings before the first window are skipped
+        pm->steps[pm->nsteps].squares = pm->nsteps == 0 ? 0 : pending + (uint32_t) (i - low + 1);
+        pm->steps[pm->nsteps].digit = digit;
+        pm->nsteps += 1;
+        pending = 0;
+        i = low - 1;
+    }
+    if (pending > 0) {
+        pm->steps[pm->nsteps].squares = pending;
+        pm->steps[pm->nsteps].digit = 0;
+        pm->nsteps += 1;
+    }
+    // odd powers base^1, base^3, ..., base^(2^window - 1), then the accumulator and base^2
+    size_t entries = (size_t) 1 << (pm->window - 1);
+    if ((entries + 3) * pm->mt.size > pm->table_capacity) {
+        free(pm->table);
+        pm->table_capacity = (entries + 3) * pm->mt.size;
+        pm->table = (mp_limb_t *) malloc(pm->table_capacity * sizeof(mp_limb_t));
+    }
+    pm->acc = pm->table + entries * pm->mt.size;
+    pm->square = pm->acc + pm->mt.size;
+    pm->correction = pm->square + pm->mt.size;
+    if (pm->short_exp && cached && pc->exp_word == pm->exp_word) {
+        limbs_from_mpz(pm->correction, pm->mt.size, (mpz_ptr) pc->correction);
+    } else if (pm->short_exp) {
+        powm_correction(&pm->mt, pm->correction, pm->acc, pm->exp_word);
+    }
+}
+
+// Clears and frees all memory used by an exponentiation context.
+void powm_clear(powm_t *pm) {
+    mpz_clears(pm->exponent, pm->modulus, NULL);
+    mont_clear(&pm->mt);
+    free(pm->steps);
+    free(pm->table);
+    pm->steps = NULL;
+    pm->table = NULL;
+    pm->steps_capacity = 0;
+    pm->table_capacity = 0;
+}
+
+// Initializes an empty (not valid) exponentiation cache.
+void powm_cache_init(powm_cache_t *pc) {
+    pc->valid = false;
+    pc->ninv = 0;
+    pc->exp_word = 0;
+    mpz_inits(pc->one, pc->r2, pc->correction, NULL);
+}
+
+// Clears and frees all memory used by an exponentiation cache.
+void powm_cache_clear(powm_cache_t *pc) {
+    mpz_clears(pc->one, pc->r2, pc->correction, NULL);
+    pc->valid = false;
+}
+
+// Copies size limbs into out.
+static void mpz_from_limbs(mpz_t out, const mp_limb_t *limbs, mp_size_t size) {
+    memcpy(mpz_limbs_write(out, size), limbs, size * sizeof(mp_limb_t));
+    mpz_limbs_finish(out, size);
+}
+
+// Saves the constants of a set-up exponentiation context into pc, which stays invalid if the
+// context does not use Montgomery form.
+void powm_cache_save(powm_cache_t *pc, const powm_t *pm) {
+    pc->valid = pm->mont;
+    if (!pm->mont) {
+        return;
+    }
+    pc->ninv = pm->mt.ninv;
+    mpz_from_limbs(pc->one, pm->mt.one, pm->mt.size);
+    mpz_from_limbs(pc->r2, pm->mt.r2, pm->mt.size);
+    pc->exp_word = pm->short_exp ? pm->exp_word : 0;
+    if (pm->short_exp) {
+        mpz_from_limbs(pc->correction, pm->correction, pm->mt.size);
+    } else {
+        mpz_set_ui(pc->correction, 0);
+    }
+}
+
+// Checks that the constants in pc, e.g. as read from a key file, belong to the odd modulus
+// modulus (> 1): -n^-1 times n is -1, R^2 mod n reduces to R mod n, R mod n reduces to 1, and the
+// correction is R^exp_word mod n, which is recomputed. Returns false if any of them does not hold.
+bool powm_cache_check(const powm_cache_t *pc, mpz_t modulus) {
+    if (!mpz_odd_p(modulus) || mpz_cmp_ui(modulus, 1) <= 0
+        || pc->ninv * mpz_getlimbn(modulus, 0) != ~(mp_limb_t) 0
+        || mpz_sgn(pc->one) < 0 || mpz_cmp(pc->one, modulus) >= 0 || mpz_sgn(pc->r2) < 0
+        || mpz_cmp(pc->r2, modulus) >= 0 || mpz_sgn(pc->correction) < 0
+        || mpz_cmp(pc->correction, modulus) >= 0) {
+        return false;
+    }
+    mont_t mt;
+    mt.n = NULL;
+    mt.capacity = 0;
+    mont_set_cached(&mt, modulus, pc); // the constants under test, without dividing
+    mpz_t value;
+    mpz_init(value);
+    mont_from(&mt, value, mt.r2); // value <- REDC(R^2 mod n), which must be R mod n
+    bool ok = mpz_cmp(value, pc->one) == 0;
+    mont_from(&mt, value, mt.one); // value <- REDC(R mod n), which must be 1
+    ok = ok && mpz_cmp_ui(value, 1) == 0;
+    if (ok && pc->exp_word != 0) {
+        mp_limb_t *limbs = (mp_limb_t *) malloc(3 * mt.size * sizeof(mp_limb_t));
+        powm_correction(&mt, limbs, limbs + mt.size, pc->exp_word);
+        limbs_from_mpz(limbs + 2 * mt.size, mt.size, (mpz_ptr) pc->correction);
+        ok = mpn_cmp(limbs, limbs + 2 * mt.size, mt.size) == 0;
+        free(limbs);
+    }
+    mont_clear(&mt);
+    mpz_clear(value);
+    return ok;
+}
+
+// Computes base raised to the context's exponent modulo its modulus and stores it in out.
+// Apart from growing out on first use, no memory is allocated.
+void powm(powm_t *pm, mpz_t out, mpz_t base) {
+    if (!pm->mont) {
+        pow_mod_plain(out, base, pm->exponent, pm->modulus);
+        return;
+    }
+    mont_t *mt = &pm->mt;
+    size_t limbs = mt->size * sizeof(mp_limb_t);
+    size_t entries = (size_t) 1 << (pm->window - 1);
+    stats_add(STAT_POWM_CALLS, 1);
+    stats_add(STAT_POWM_BITS, pm->bits);
+    if (pm->short_exp) {
+        // Fast path for exponents of one limb (such as 65537): square-and-multiply on the
+        // unconverted base x leaves x^e * R^-(e-1), and one multiplication by R^e mod n turns
+        // that into x^e, so no conversion into or out of Montgomery form is needed.
+        mont_load(mt, pm->table, base); // table[0] <- x
+        memcpy(pm->acc, pm->table, limbs);
+        for (int i = GMP_NUMB_BITS - 1 - __builtin_clzll(pm->exp_word); i-- > 0;) {
+            mont_sqr(mt, pm->acc, pm->acc);
+            if ((pm->exp_word >> i) & 1) {
+                mont_mul(mt, pm->acc, pm->acc, pm->table);
+            }
+        }
+        mont_mul(mt, mpz_limbs_write(out, mt->size), pm->acc, pm->correction);
+        mpz_limbs_finish(out, mt->size);
+        return;
+    }
+    mont_to(mt, pm->table, base); // table[0] <- base in Montgomery form
+    if (entries > 1) {
+        mont_sqr(mt, pm->square, pm->table); // square <- base^2
+        for (size_t k = 1; k < entries; k++) { // table[k] <- base^(2k + 1)
+            mont_mul(mt, pm->table + k * mt->size, pm->table + (k - 1) * mt->size, pm->square);
+        }
+    }
+    memcpy(pm->acc, mt->one, limbs); // acc <- 1 in Montgomery form
+    for (size_t i = 0; i < pm->nsteps; i++) {
+        powm_step_t step = pm->steps[i];
+        for (uint32_t j = 0; j < step.squares; j++) {
+            mont_sqr(mt, pm->acc, pm->acc); // acc <- acc * acc
+        }
+        if (step.digit != 0) {
+            const mp_limb_t *power = pm->table + (step.digit >> 1) * mt->size;
+            if (i == 0) {
+                memcpy(pm->acc, power, limbs); // acc <- base^digit
+            } else {
+                mont_mul(mt, pm->acc, pm->acc, power); // acc <- acc * base^digit
+            }
+        }
+    }
+    mont_from(mt, out, pm->acc);
+}
+
+// Performs fast modular exponentiation, computing base raised to the exponent power modulo modulus
+// and stores the computed result in out. Odd moduli use the Montgomery engine.
+void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+    if (mpz_sgn(exponent) < 0) {
+        pow_mod_plain(out, base, exponent, modulus);
+        return;
+    }
+    powm_t pm;
+    powm_init(&pm, exponent, modulus);
+    powm(&pm, out, base);
+    powm_clear(&pm);
+}
+
+// Performs fast modular exponentiation like pow_mod(), retargeting the exponentiation context of
+// ws instead of building a new one.
+void pow_mod_ws(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, nt_ws_t *ws) {
+    if (mpz_sgn(exponent) < 0) {
+        pow_mod_plain(out, base, exponent, modulus);
+        return;
+    }
+    powm_set(&ws->pm, exponent, modulus);
+    powm(&ws->pm, out, base);
+}
+
 // Conducts the Miller-Rabin primality test to indicate whether or not n is prime using
 // iters number of Miller-Rabin iterations.
 bool is_prime(mpz_t n, uint64_t iters) {
-    mpz_t s, r, a, y, j, t, remainder, temp, temp2;
-    mpz_inits(s, r, a, y, j, t, remainder, temp, temp2, NULL);
+    return is_prime_r(n, iters, state);
+}
+
+// Conducts the Miller-Rabin primality test like is_prime(), drawing the random bases from rs.
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rs) {
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    bool prime = is_prime_ws(n, iters, rs, &ws);
+    nt_ws_clear(&ws);
+    return prime;
+}
+
+// Conducts the Miller-Rabin primality test like is_prime_r(), using the scratch integers and
+// exponentiation context of ws.
+bool is_prime_ws(mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_ws_t *ws) {
+    mpz_ptr s = ws->t[0], r = ws->t[1], a = ws->t[2], y = ws->t[3], j = ws->t[4];
+    mpz_ptr remainder = ws->t[5], temp = ws->t[6], temp2 = ws->t[7];
     // Corner cases (1 and 4 are false, 2 and 3 are true)
     if ((mpz_cmp_ui(n, 1) <= 0) || (mpz_cmp_ui(n, 4) == 0)) { // if n <= 1 or n == 4
-        mpz_clears(s, r, a, y, j, t, remainder, temp, temp2, NULL);
         return false;
     }
     if ((mpz_cmp_ui(n, 2) == 0) || (mpz_cmp_ui(n, 3) == 0)) { // if n == 2 or n == 3
@@ -96,38 +667,380 @@ bool is_prime(mpz_t n, uint64_t iters) {
         mpz_divexact_ui(r, r, 2); // r = r/2
         mpz_mod_ui(remainder, r, 2); // checking remainder of r/2
     }
-    mpz_set_ui(t, 2); // t <- 2 for pow_mod on line 110
+    powm_set(&ws->pm, r, n); // every round raises a random base to the same r modulo n
     for (uint64_t i = 1; i < iters; i++) {
         mpz_sub_ui(temp, n, 3); // temp <- n - 3
-        mpz_urandomm(a, state, temp); // choose a random number a between 0 and n - 4
+        mpz_urandomm(a, rs, temp); // choose a random number a between 0 and n - 4
         mpz_add_ui(a, a, 2); // a += 2 to make the random number between 2 and n - 2
-        pow_mod(y, a, r, n); // y <- pow_mod(a, r, n)
+        powm(&ws->pm, y, a); // y <- pow_mod(a, r, n)
         mpz_sub_ui(temp, n, 1); // temp <- n - 1
         mpz_sub_ui(temp2, s, 1); // temp2 <- s - 1
         if ((mpz_cmp_ui(y, 1) != 0) && (mpz_cmp(y, temp) != 0)) { // if y != 1 and y != n - 1
             mpz_set_ui(j, 1); // j <- 1
             while ((mpz_cmp(j, temp2) <= 0) && (mpz_cmp(y, temp) != 0)) { // while j<=s-1 and y!=n-1
-                pow_mod(y, y, t, n); // y <- pow_mod(y, 2, n)
+                mpz_mul(y, y, y); // y <- y * y
+                mpz_mod(y, y, n); // y <- y * y mod n
                 if ((mpz_cmp_ui(y, 1)) == 0) { // if y == 1
-                    mpz_clears(s, r, a, y, j, t, remainder, temp, temp2, NULL);
                     return false;
                 }
                 mpz_add_ui(j, j, 1); // j <- j + 1
             }
             if (mpz_cmp(y, temp) != 0) { // if y != n - 1
-                mpz_clears(s, r, a, y, j, t, remainder, temp, temp2, NULL);
                 return false;
             }
         }
     }
-    mpz_clears(s, r, a, y, j, t, remainder, temp, temp2, NULL);
     return true; // n is probably prime
 }
 
+// Odd small primes is_prime_bpsw() trial-divides by before its probable-prime tests.
+#define BPSW_TRIAL_PRIMES 128
+
+// Conducts the strong probable-prime test to base 2 on odd n > 2.
+static bool strong_base2(mpz_t n, nt_ws_t *ws) {
+    bool prime = false;
+    mpz_ptr d = ws->t[0], y = ws->t[1], nm1 = ws->t[2], two = ws->t[3];
+    mpz_sub_ui(nm1, n, 1); // nm1 <- n - 1
+    mp_bitcnt_t s = mpz_scan1(nm1, 0);
+    mpz_tdiv_q_2exp(d, nm1, s); // n - 1 = d * 2^s with d odd
+    mpz_set_ui(two, 2);
+    pow_mod_ws(y, two, d, n, ws); // y <- 2^d mod n
+    if (mpz_cmp_ui(y, 1) == 0 || mpz_cmp(y, nm1) == 0) {
+        prime = true;
+    }
+    for (mp_bitcnt_t r = 1; r < s && !prime; r++) {
+        mpz_mul(y, y, y); // y <- y * y
+        mpz_mod(y, y, n); // y <- y * y mod n
+        if (mpz_cmp(y, nm1) == 0) {
+            prime = true;
+        } else if (mpz_cmp_ui(y, 1) == 0) {
+            break;
+        }
+    }
+    return prime;
+}
+
+// Halves x modulo the odd modulus n.
+static void half_mod(mpz_t x, mpz_t n) {
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n);
+    }
+    mpz_fdiv_q_2exp(x, x, 1);
+}
+
+// Conducts the strong Lucas probable-prime test on odd n > 2 that is not a perfect square, using
+// Selfridge's parameters: the first D in 5, -7, 9, -11, ... with (D/n) = -1, P = 1, Q = (1 - D)/4.
+static bool strong_lucas(mpz_t n, nt_ws_t *ws) {
+    long D = 5;
+    mpz_ptr d_mpz = ws->t[0];
+    while (true) {
+        mpz_set_si(d_mpz, D);
+        int jacobi = mpz_jacobi(d_mpz, n);
+        if (jacobi == -1) {
+            break;
+        }
+        if (jacobi == 0 && mpz_cmpabs_ui(n, labs(D)) != 0) { // D shares a factor with n
+            return false;
+        }
+        D = D > 0 ? -(D + 2) : -D + 2;
+    }
+    long Q = (1 - D) / 4;
+    bool prime = false;
+    mpz_ptr d = ws->t[1], u = ws->t[2], v = ws->t[3], qk = ws->t[4], t = ws->t[5];
+    mpz_add_ui(d, n, 1);
+    mp_bitcnt_t s = mpz_scan1(d, 0);
+    mpz_tdiv_q_2exp(d, d, s); // n + 1 = d * 2^s with d odd
+    // U_1 = 1, V_1 = P = 1, Q^1
+    mpz_set_ui(u, 1);
+    mpz_set_ui(v, 1);
+    mpz_set_si(qk, Q);
+    mpz_mod(qk, qk, n);
+    for (size_t i = mpz_sizeinbase(d, 2) - 1; i-- > 0;) {
+        mpz_mul(u, u, v); // U_2k = U_k * V_k
+        mpz_mod(u, u, n);
+        mpz_mul(v, v, v); // V_2k = V_k^2 - 2 Q^k
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk); // Q^2k
+        mpz_mod(qk, qk, n);
+        if (mpz_tstbit(d, i)) {
+            mpz_set(t, u); // t <- U_2k
+            mpz_add(u, u, v); // U_2k+1 = (P U_2k + V_2k) / 2
+            mpz_mod(u, u, n);
+            half_mod(u, n);
+            mpz_mul_si(t, t, D); // V_2k+1 = (D U_2k + P V_2k) / 2
+            mpz_add(v, v, t);
+            mpz_mod(v, v, n);
+            half_mod(v, n);
+            mpz_mul_si(qk, qk, Q); // Q^2k+1
+            mpz_mod(qk, qk, n);
+        }
+    }
+    if (mpz_sgn(u) == 0 || mpz_sgn(v) == 0) { // U_d = 0 or V_d = 0
+        prime = true;
+    }
+    for (mp_bitcnt_t r = 1; r < s && !prime; r++) {
+        mpz_mul(v, v, v); // V_2k = V_k^2 - 2 Q^k
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+        prime = mpz_sgn(v) == 0; // V_(d * 2^r) = 0
+    }
+    return prime;
+}
+
+// Number of odd small primes (3, 5, 7, ...) candidates are sieved with before is_prime().
+#define SIEVE_PRIMES 2048
+
+// Odd candidates covered by one sieve interval.
+#define SIEVE_SPAN 4096
+
+// Candidates shorter than this are drawn and tested one at a time; they may be small primes.
+#define SIEVE_MIN_BITS 32
+
+static uint32_t sieve_primes[SIEVE_PRIMES];
+static pthread_once_t sieve_once = PTHREAD_ONCE_INIT;
+
+// Fills sieve_primes with the first SIEVE_PRIMES odd primes using the sieve of Eratosthenes.
+static void sieve_primes_init(void) {
+    uint32_t limit = 32768; // the 2049th prime is 17881
+    uint8_t *composite = (uint8_t *) calloc(limit, sizeof(uint8_t));
+    uint32_t count = 0;
+    for (uint32_t i = 3; i < limit && count < SIEVE_PRIMES; i += 2) {
+        if (!composite[i]) {
+            sieve_primes[count++] = i;
+            for (uint32_t j = i * i; j < limit; j += 2 * i) {
+                composite[j] = 1;
+            }
+        }
+    }
+    free(composite);
+}
+
+// Conducts the Baillie-PSW probable-prime test on n: trial division by small primes, a strong
+// probable-prime test to base 2 and a strong Lucas probable-prime test. No composite passing
+// all three is known, and the test needs no random bases.
+bool is_prime_bpsw(mpz_t n) {
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    bool prime = is_prime_bpsw_ws(n, &ws);
+    nt_ws_clear(&ws);
+    return prime;
+}
+
+// Conducts the Baillie-PSW probable-prime test like is_prime_bpsw(), using the scratch integers
+// and exponentiation context of ws.
+bool is_prime_bpsw_ws(mpz_t n, nt_ws_t *ws) {
+    pthread_once(&sieve_once, sieve_primes_init);
+    if (mpz_cmp_ui(n, 2) < 0) {
+        return false;
+    }
+    if (mpz_even_p(n)) {
+        return mpz_cmp_ui(n, 2) == 0;
+    }
+    for (uint32_t i = 0; i < BPSW_TRIAL_PRIMES; i++) {
+        if (mpz_cmp_ui(n, sieve_primes[i]) == 0) {
+            return true;
+        }
+        if (mpz_divisible_ui_p(n, sieve_primes[i])) {
+            return false;
+        }
+    }
+    if (!strong_base2(n, ws) || mpz_perfect_square_p(n)) {
+        return false;
+    }
+    return strong_lucas(n, ws);
+}
+
+// Incremental sieve over odd candidates base, base + 2, base + 4, ... of a random stream.
+// The residues of base modulo the small primes are kept up to date as the interval advances,
+// so stepping to the next interval costs no big-number division.
+typedef struct {
+    uint64_t bits;
+    __gmp_randstate_struct *rs;
+    mpz_t base; // candidate at offset 0 of the current interval
+    uint32_t residues[SIEVE_PRIMES]; // base mod sieve_primes[i]
+    uint8_t composite[SIEVE_SPAN]; // offset j is divisible by a small prime
+    uint32_t next; // next offset of the interval to hand out
+    bool fresh; // base must be redrawn
+} sieve_t;
+
+// Marks the offsets of the current interval that are divisible by a small prime.
+static void sieve_mark(sieve_t *sv) {
+    memset(sv->composite, 0, SIEVE_SPAN);
+    for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+        uint32_t p = sieve_primes[i];
+        // base + 2j = 0 mod p  <=>  j = -base * 2^-1 mod p, and 2^-1 = (p + 1) / 2
+        uint64_t j = ((uint64_t) (p - sv->residues[i]) % p) * ((p + 1) / 2) % p;
+        for (; j < SIEVE_SPAN; j += p) {
+            sv->composite[j] = 1;
+        }
+    }
+    sv->next = 0;
+}
+
+// Draws a new random odd base of at least bits - 1 bits and sieves its interval.
+static void sieve_draw(sieve_t *sv) {
+    mpz_urandomb(sv->base, sv->rs, sv->bits);
+    while (mpz_sizeinbase(sv->base, 2) < sv->bits - 1) {
+        mpz_urandomb(sv->base, sv->rs, sv->bits);
+    }
+    mpz_setbit(sv->base, 0); // even numbers are never prime
+    for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+        sv->residues[i] = mpz_fdiv_ui(sv->base, sieve_primes[i]);
+    }
+    sieve_mark(sv);
+    sv->fresh = false;
+}
+
+// Initializes a sieve for candidates of bits bits drawn from rs.
+static void sieve_init(sieve_t *sv, uint64_t bits, gmp_randstate_t rs) {
+    pthread_once(&sieve_once, sieve_primes_init);
+    sv->bits = bits;
+    sv->rs = rs;
+    sv->fresh = true;
+    mpz_init(sv->base);
+}
+
+// Clears and frees all memory used by a sieve.
+static void sieve_clear(sieve_t *sv) {
+    mpz_clear(sv->base);
+}
+
+// Stores the next candidate that survives the sieve in p.
+static void sieve_next(sieve_t *sv, mpz_t p) {
+    if (sv->bits < SIEVE_MIN_BITS) { // too small to sieve: draw candidates one at a time
+        mpz_urandomb(p, sv->rs, sv->bits);
+        while (mpz_sizeinbase(p, 2) < sv->bits - 1) {
+            mpz_urandomb(p, sv->rs, sv->bits);
+        }
+        stats_add(STAT_PRIME_CANDIDATES, 1);
+        return;
+    }
+    while (true) {
+        if (sv->fresh) {
+            sieve_draw(sv);
+        }
+        if (sv->next == SIEVE_SPAN) { // step to the following interval
+            mpz_add_ui(sv->base, sv->base, 2 * SIEVE_SPAN);
+            for (uint32_t i = 0; i < SIEVE_PRIMES; i++) {
+                sv->residues[i] = (sv->residues[i] + 2 * SIEVE_SPAN) % sieve_primes[i];
+            }
+            sieve_mark(sv);
+        }
+        uint32_t j = sv->next++;
+        stats_add(STAT_PRIME_CANDIDATES, 1);
+        if (sv->composite[j]) {
+            stats_add(STAT_PRIME_SIEVED, 1);
+            continue;
+        }
+        mpz_add_ui(p, sv->base, 2 * j); // p <- base + 2j
+        if (mpz_sizeinbase(p, 2) > sv->bits) { // walked past bits bits: start over
+            sv->fresh = true;
+            continue;
+        }
+        return;
+    }
+}
+
+// Runs the probable-prime test on a sieved candidate, counting the result.
+static bool sieve_test(
+    mpz_t p, uint64_t iters, prime_test_t test, gmp_randstate_t rs, nt_ws_t *ws) {
+    stats_add(STAT_PRIME_TESTED, 1);
+    if (test == PRIME_TEST_BPSW ? is_prime_bpsw_ws(p, ws) : is_prime_ws(p, iters, rs, ws)) {
+        return true;
+    }
+    stats_add(STAT_PRIME_COMPOSITE, 1);
+    return false;
+}
+
+// Stores the number of candidates handled by each stage of all prime searches so far in stats.
+void prime_stats_get(prime_stats_t *stats) {
+    stats->candidates = stats_get(STAT_PRIME_CANDIDATES);
+    stats->sieved = stats_get(STAT_PRIME_SIEVED);
+    stats->tested = stats_get(STAT_PRIME_TESTED);
+    stats->composite = stats_get(STAT_PRIME_COMPOSITE);
+}
+
 // Generates a new prime number stored in p at least bits number of bits long.
+// Random odd candidates are sieved by the first SIEVE_PRIMES odd primes, stepping through an
+// interval after each random draw, and only the survivors are tested with is_prime().
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    mpz_urandomb(p, state, bits);
-    while ((mpz_sizeinbase(p, 2) < bits - 1) || !is_prime(p, iters)) {
-        mpz_urandomb(p, state, bits);
+    make_prime_mt(p, bits, iters, 1, PRIME_TEST_MR);
+}
+
+// Shared state of a parallel prime search. Candidate r of worker w has the global index
+// r * threads + w, and the search keeps the prime with the lowest index.
+typedef struct {
+    uint64_t bits;
+    uint64_t iters;
+    prime_test_t test;
+    uint32_t threads;
+    gmp_randstate_t *rs; // one random stream per worker
+    mpz_t *found; // the prime each worker found, if any
+    atomic_uint_fast64_t best; // lowest index of a prime found so far
+} prime_search_t;
+
+// Pool job: search index searches its own random stream until it finds a prime or every index it
+// could still draw is above the best one found by any search. The job is keyed by index rather
+// than by the pool thread running it, since one thread may end up running several searches.
+static void prime_search(void *arg, uint32_t worker, uint64_t index) {
+    prime_search_t *search = (prime_search_t *) arg;
+    (void) worker;
+    mpz_ptr p = search->found[index];
+    sieve_t sv;
+    sieve_init(&sv, search->bits, search->rs[index]);
+    nt_ws_t ws;
+    nt_ws_init(&ws, search->bits);
+    for (uint64_t g = index; g < atomic_load(&search->best); g += search->threads) {
+        sieve_next(&sv, p);
+        if (sieve_test(p, search->iters, search->test, search->rs[index], &ws)) {
+            uint_fast64_t best = atomic_load(&search->best);
+            while (g < best && !atomic_compare_exchange_weak(&search->best, &best, g)) {
+            }
+            break;
+        }
+    }
+    nt_ws_clear(&ws);
+    sieve_clear(&sv);
+}
+
+// Generates a new prime number stored in p at least bits number of bits long, searching with
+// threads workers and accepting candidates that pass test (iters rounds for PRIME_TEST_MR).
+// Each worker draws candidates from its own random stream seeded from the global random state,
+// and the first prime in the combined candidate order wins, so the result depends only on the
+// seed and the number of threads. A single-threaded Miller-Rabin search behaves exactly like
+// make_prime().
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, uint32_t threads, prime_test_t test) {
+    if (threads <= 1) {
+        sieve_t sv;
+        sieve_init(&sv, bits, state);
+        nt_ws_t ws;
+        nt_ws_init(&ws, bits);
+        do {
+            sieve_next(&sv, p);
+        } while (!sieve_test(p, iters, test, state, &ws));
+        nt_ws_clear(&ws);
+        sieve_clear(&sv);
+        return;
+    }
+    prime_search_t search = { bits, iters, test, threads, NULL, NULL, UINT64_MAX };
+    search.rs = (gmp_randstate_t *) malloc(threads * sizeof(gmp_randstate_t));
+    search.found = (mpz_t *) malloc(threads * sizeof(mpz_t));
+    for (uint32_t i = 0; i < threads; i++) {
+        randstate_fork(search.rs[i]);
+        mpz_init(search.found[i]);
+    }
+    pool_t *pool = pool_create(threads);
+    pool_run(pool, prime_search, &search, threads);
+    pool_delete(&pool);
+    uint64_t best = atomic_load(&search.best);
+    mpz_set(p, search.found[best % threads]);
+    for (uint32_t i = 0; i < threads; i++) {
+        gmp_randclear(search.rs[i]);
+        mpz_clear(search.found[i]);
     }
+    free(search.rs);
+    free(search.found);
 }
@@ -5,6 +5,132 @@
 #include <stdio.h>
 #include <gmp.h>
 
+// Montgomery arithmetic context for an odd modulus n of size limbs, with
+// R = 2^(size * GMP_NUMB_BITS). Values in Montgomery form are stored as size-limb arrays holding
+// a * R mod n.
+typedef struct {
+    mp_size_t size; // limbs in the modulus
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+    mp_limb_t *n; // modulus limbs
+    mp_limb_t *r2; // R^2 mod n, used to convert into Montgomery form
+    mp_limb_t *one; // R mod n, the Montgomery form of 1
+    mp_limb_t *scratch; // 2 * size limbs holding the double-width product before reduction
+    mp_size_t capacity; // largest size the buffers can hold without growing
+} mont_t;
+
+void mont_init(mont_t *mt, mpz_t modulus);
+
+void mont_set(mont_t *mt, mpz_t modulus);
+
+void mont_clear(mont_t *mt);
+
+void mont_to(mont_t *mt, mp_limb_t *out, mpz_t a);
+
+void mont_from(mont_t *mt, mpz_t out, const mp_limb_t *a);
+
+void mont_mul(mont_t *mt, mp_limb_t *out, const mp_limb_t *a, const mp_limb_t *b);
+
+void mont_sqr(mont_t *mt, mp_limb_t *out, const mp_limb_t *a);
+
+// One step of a recoded exponent: square the accumulator squares times, then multiply it by
+// base^digit (digit is odd, or 0 for no multiplication).
+typedef struct {
+    uint32_t squares;
+    uint32_t digit;
+} powm_step_t;
+
+// Reusable exponentiation context for a fixed (exponent, modulus) pair. The exponent is recoded
+// once into sliding-window steps, and the window table and accumulator are allocated up front so
+// that every powm() call only performs the multiplications themselves.
+typedef struct {
+    bool mont; // false for moduli Montgomery form cannot handle (even or 1)
+    mont_t mt;
+    uint32_t window; // window width in bits
+    powm_step_t *steps;
+    size_t nsteps;
+    mp_limb_t *table; // odd powers base^1, base^3, ..., base^(2^window - 1)
+    mp_limb_t *acc; // accumulator
+    mp_limb_t *square; // base^2, used to build the table
+    size_t bits; // exponent bits, counted by the stats
+    bool short_exp; // exponent fits in one limb and takes the fast path
+    mp_limb_t exp_word; // the exponent, when short_exp is set
+    mp_limb_t *correction; // R^e mod n, when short_exp is set
+    size_t steps_capacity; // steps the step buffer can hold without growing
+    size_t table_capacity; // limbs the table buffer can hold without growing
+    mpz_t exponent, modulus; // only used when mont is false
+} powm_t;
+
+// Precomputed constants of an exponentiation context, which can be stored with a key so that
+// contexts for it are set up without dividing or exponentiating (see powm_set_cached()).
+typedef struct {
+    bool valid;
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+    mpz_t one, r2; // R mod n and R^2 mod n
+    mp_limb_t exp_word; // one-limb exponent the correction belongs to, or 0 for none
+    mpz_t correction; // R^exp_word mod n
+} powm_cache_t;
+
+void powm_init(powm_t *pm, mpz_t exponent, mpz_t modulus);
+
+void powm_init_cached(powm_t *pm, mpz_t exponent, mpz_t modulus, const powm_cache_t *pc);
+
+void powm_set(powm_t *pm, mpz_t exponent, mpz_t modulus);
+
+void powm_set_cached(powm_t *pm, mpz_t exponent, mpz_t modulus, const powm_cache_t *pc);
+
+void powm_clear(powm_t *pm);
+
+void powm(powm_t *pm, mpz_t out, mpz_t base);
+
+void powm_cache_init(powm_cache_t *pc);
+
+void powm_cache_clear(powm_cache_t *pc);
+
+void powm_cache_save(powm_cache_t *pc, const powm_t *pm);
+
+bool powm_cache_check(const powm_cache_t *pc, mpz_t modulus);
+
+// Probable-prime test used to accept prime candidates.
+typedef enum {
+    PRIME_TEST_MR, // Miller-Rabin with a caller-chosen number of random bases
+    PRIME_TEST_BPSW, // Baillie-PSW: trial division, strong base-2 test and strong Lucas test
+} prime_test_t;
+
+// Number of prime candidates handled by each stage of make_prime() and make_prime_mt().
+typedef struct {
+    uint64_t candidates; // odd candidates stepped through (or drawn, for tiny primes)
+    uint64_t sieved; // rejected by the small-prime sieve
+    uint64_t tested; // passed on to the probable-prime test
+    uint64_t composite; // rejected by the probable-prime test
+} prime_stats_t;
+
+// Scratch integers held by a workspace.
+#define NT_WS_INTS 9
+
+// Workspace for the _ws variants of the number theory functions: scratch integers and an
+// exponentiation context that every call reuses. Once they have grown to the working size, or
+// were preallocated for it by nt_ws_init(), calls do not allocate (apart from pow_mod_ws() with an
+// even modulus or a negative exponent). A workspace may only be used by one thread at a time, and
+// its integers must not be passed as arguments.
+typedef struct {
+    mpz_t t[NT_WS_INTS];
+    powm_t pm;
+} nt_ws_t;
+
+void nt_ws_init(nt_ws_t *ws, uint64_t bits);
+
+void nt_ws_clear(nt_ws_t *ws);
+
+void gcd_ws(mpz_t d, mpz_t a, mpz_t b, nt_ws_t *ws);
+
+void mod_inverse_ws(mpz_t i, mpz_t a, mpz_t n, nt_ws_t *ws);
+
+void pow_mod_ws(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, nt_ws_t *ws);
+
+bool is_prime_ws(mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_ws_t *ws);
+
+bool is_prime_bpsw_ws(mpz_t n, nt_ws_t *ws);
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n);
@@ -13,4 +139,12 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rs);
+
+bool is_prime_bpsw(mpz_t n);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, uint32_t threads, prime_test_t test);
+
+void prime_stats_get(prime_stats_t *stats);
@@ -0,0 +1,139 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct pool {
+    uint32_t threads; // total workers, including the thread calling pool_run()
+    pthread_t *tids; // threads - 1 background workers
+    pthread_mutex_t lock;
+    pthread_cond_t start; // signalled when a new job is posted
+    pthread_cond_t done; // signalled when the last background worker finishes a job
+    uint64_t generation; // incremented for every job
+    uint32_t busy; // background workers still running the current job
+    bool stop;
+    pool_fn fn;
+    void *arg;
+    uint64_t count;
+    atomic_uint_fast64_t next; // next unclaimed item of the current job
+};
+
+typedef struct {
+    pool_t *pool;
+    uint32_t worker;
+} pool_worker_t;
+
+// Claims and processes items of the current job until none are left.
+static void pool_drain(pool_t *pool, uint32_t worker) {
+    uint64_t index;
+    while ((index = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        pool->fn(pool->arg, worker, index);
+    }
+}
+
+// Body of a background worker: waits for a job, helps drain it, and reports back.
+static void *pool_main(void *data) {
+    pool_worker_t *self = (pool_worker_t *) data;
+    pool_t *pool = self->pool;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        pool_drain(pool, self->worker);
+        pthread_mutex_lock(&pool->lock);
+        pool->busy -= 1;
+        if (pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(self);
+    return NULL;
+}
+
+// Creates a pool of threads workers. The thread calling pool_run() acts as worker 0, so only
+// threads - 1 background threads are started; a pool of 0 or 1 threads runs jobs inline.
+pool_t *pool_create(uint32_t threads) {
+    pool_t *pool = (pool_t *) calloc(1, sizeof(pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = threads > 1 ? threads : 1;
+    pool->tids = (pthread_t *) calloc(pool->threads, sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->next, 0);
+    for (uint32_t i = 1; i < pool->threads; i++) {
+        pool_worker_t *self = (pool_worker_t *) malloc(sizeof(pool_worker_t));
+        self->pool = pool;
+        self->worker = i;
+        if (pthread_create(&pool->tids[i - 1], NULL, pool_main, self) != 0) {
+            free(self);
+            pool->threads = i; // run with the workers started so far
+            break;
+        }
+    }
+    return pool;
+}
+
+// Returns the number of workers in the pool.
+uint32_t pool_threads(pool_t *pool) {
+    return pool->threads;
+}
+
+// Runs fn(arg, worker, index) for every index in [0, count) across the pool and returns once
+// all items have been processed.
+void pool_run(pool_t *pool, pool_fn fn, void *arg, uint64_t count) {
+    if (pool->threads == 1 || count <= 1) {
+        for (uint64_t i = 0; i < count; i++) {
+            fn(arg, 0, i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->count = count;
+    atomic_store(&pool->next, 0);
+    pool->busy = pool->threads - 1;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    pool_drain(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stops all workers and frees the pool, setting the pointer to NULL.
+void pool_delete(pool_t **pool) {
+    if (!pool || !*pool) {
+        return;
+    }
+    pthread_mutex_lock(&(*pool)->lock);
+    (*pool)->stop = true;
+    pthread_cond_broadcast(&(*pool)->start);
+    pthread_mutex_unlock(&(*pool)->lock);
+    for (uint32_t i = 1; i < (*pool)->threads; i++) {
+        pthread_join((*pool)->tids[i - 1], NULL);
+    }
+    pthread_mutex_destroy(&(*pool)->lock);
+    pthread_cond_destroy(&(*pool)->start);
+    pthread_cond_destroy(&(*pool)->done);
+    free((*pool)->tids);
+    free(*pool);
+    *pool = NULL;
+}
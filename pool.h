@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Work function run by the pool: index is the item to process and worker identifies the
+// calling thread (0 .. threads - 1), so that callers can keep per-worker scratch space.
+typedef void (*pool_fn)(void *arg, uint32_t worker, uint64_t index);
+
+typedef struct pool pool_t;
+
+pool_t *pool_create(uint32_t threads);
+
+uint32_t pool_threads(pool_t *pool);
+
+void pool_run(pool_t *pool, pool_fn fn, void *arg, uint64_t count);
+
+void pool_delete(pool_t **pool);
@@ -15,3 +15,14 @@ void randstate_init(uint64_t seed) {
 void randstate_clear(void) {
     gmp_randclear(state);
 }
+
+// initializes rs as an independent Mersenne Twister stream seeded with 64 bits drawn from state,
+// so that every stream is determined by the seed given to randstate_init()
+void randstate_fork(gmp_randstate_t rs) {
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_urandomb(seed, state, 64);
+    gmp_randinit_mt(rs);
+    gmp_randseed(rs, seed);
+    mpz_clear(seed);
+}
@@ -0,0 +1,141 @@
+#include "rpc.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Fills in the header of a frame with the given operation or status and payload length.
+void rpc_put_header(uint8_t *buf, uint8_t code, uint32_t len) {
+    buf[0] = code;
+    for (int i = 0; i < 4; i++) {
+        buf[1 + i] = (uint8_t) (len >> (24 - 8 * i));
+    }
+}
+
+// Returns the payload length stored in the header of a frame.
+uint32_t rpc_get_length(const uint8_t *buf) {
+    return (uint32_t) buf[1] << 24 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 8 | buf[4];
+}
+
+// Writes all len bytes of buf to fd, retrying short and interrupted writes.
+// Returns false if fd failed or was closed by the peer.
+bool rpc_write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *data = (const uint8_t *) buf;
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+// Reads exactly len bytes from fd into buf, retrying short and interrupted reads.
+// Returns false if fd failed or reached end of file first.
+bool rpc_read_full(int fd, void *buf, size_t len) {
+    uint8_t *data = (uint8_t *) buf;
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+// Sends one frame with the given operation or status and payload.
+bool rpc_send(int fd, uint8_t code, const uint8_t *payload, uint32_t len) {
+    uint8_t header[RPC_HEADER_SIZE];
+    rpc_put_header(header, code, len);
+    // Send the header and payload with one call, finishing a short write piece by piece.
+    struct iovec iov[2] = { { header, RPC_HEADER_SIZE }, { (void *) payload, len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return false;
+    }
+    size_t sent = (size_t) n;
+    if (sent < RPC_HEADER_SIZE) {
+        return rpc_write_full(fd, header + sent, RPC_HEADER_SIZE - sent)
+               && rpc_write_full(fd, payload, len);
+    }
+    sent -= RPC_HEADER_SIZE;
+    return rpc_write_full(fd, payload + sent, len - sent);
+}
+
+// Receives one frame into code and payload, storing its payload length in len.
+// Returns false if fd failed, or if the payload is longer than max bytes.
+bool rpc_recv(int fd, uint8_t *code, uint8_t *payload, uint32_t *len, uint32_t max) {
+    uint8_t header[RPC_HEADER_SIZE];
+    if (!rpc_read_full(fd, header, RPC_HEADER_SIZE)) {
+        return false;
+    }
+    *code = header[0];
+    *len = rpc_get_length(header);
+    return *len <= max && rpc_read_full(fd, payload, *len);
+}
+
+// Fills in the address of the socket at path. Returns false if the path is too long.
+static bool rpc_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Creates a Unix domain socket listening at path, replacing any stale socket file there.
+// Returns the socket, or -1 on failure.
+int rpc_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!rpc_address(&addr, path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Connects to the Unix domain socket at path. Returns the socket, or -1 on failure.
+int rpc_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (!rpc_address(&addr, path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
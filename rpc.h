@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Framing of the requests and replies exchanged with the rsad daemon over a Unix domain socket:
+// a one-byte operation (a status, in a reply), a four-byte big-endian payload length, and then
+// the payload. Replies come back on each connection in the order its requests were sent.
+#define RPC_HEADER_SIZE 5
+
+#define RPC_OP_DECRYPT 'D' // payload: one ciphertext block; reply: its plaintext bytes
+#define RPC_OP_SIGN    'S' // payload: a message below n; reply: its signature, ceil(bits / 8) bytes
+#define RPC_OP_KEY     'K' // no payload; reply: the public modulus n, big-endian
+
+#define RPC_OK    0 // status of a reply carrying a result
+#define RPC_ERROR 1 // status of a reply to a rejected request; the payload is a message
+
+// Largest payload either side accepts.
+#define RPC_MAX_PAYLOAD (64 * 1024)
+
+void rpc_put_header(uint8_t *buf, uint8_t code, uint32_t len);
+
+uint32_t rpc_get_length(const uint8_t *buf);
+
+bool rpc_write_full(int fd, const void *buf, size_t len);
+
+bool rpc_read_full(int fd, void *buf, size_t len);
+
+bool rpc_send(int fd, uint8_t code, const uint8_t *payload, uint32_t len);
+
+bool rpc_recv(int fd, uint8_t *code, uint8_t *payload, uint32_t *len, uint32_t max);
+
+int rpc_listen(const char *path);
+
+int rpc_connect(const char *path);
@@ -5,42 +5,129 @@
 #include <unistd.h>
 #include <math.h>
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 
 #include "rsa.h"
+#include "aead.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "pool.h"
+#include "stream.h"
+#include "stats.h"
+#include "sha256.h"
 
 // Creates parts of a new RSA public key: two large primes p and q,
 // their product n, and the public exponent e.
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    rsa_make_pub_opts(p, q, n, e, nbits, iters, NULL);
+}
+
+// Creates a prime with the given number of bits like make_prime_mt(), drawing new primes until
+// p - 1 is coprime with the fixed public exponent e (unless e is 0).
+static void rsa_make_prime_for(mpz_t p, uint64_t bits, uint64_t iters, uint32_t threads,
+    prime_test_t test, uint64_t e, nt_ws_t *ws) {
+    mpz_t fixed, temp;
+    mpz_inits(fixed, temp, NULL);
+    mpz_set_ui(fixed, e);
+    while (true) {
+        make_prime_mt(p, bits, iters, threads, test);
+        if (e == 0) {
+            break;
+        }
+        mpz_sub_ui(temp, p, 1); // temp <- p - 1
+        stats_add(STAT_GCD_ATTEMPTS, 1);
+        gcd_ws(temp, temp, fixed, ws);
+        if (mpz_cmp_ui(temp, 1) == 0) {
+            break;
+        }
+    }
+    mpz_clears(fixed, temp, NULL);
+}
+
+// Creates parts of a new RSA public key like rsa_make_pub(), searching for each prime with
+// opts->threads workers and accepting primes with opts->test. A nonzero opts->e fixes the public
+// exponent, and primes are regenerated until it is coprime with the totient. opts may be NULL,
+// which selects a single thread, iters rounds of Miller-Rabin and a random exponent.
+// opts->primes is ignored: the key always has the two primes p and q.
+void rsa_make_pub_opts(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    const rsa_keygen_opts_t *opts) {
+    mpz_t primes[2];
+    mpz_inits(primes[0], primes[1], NULL);
+    rsa_make_pub_multi(primes, 2, n, e, nbits, iters, opts);
+    mpz_set(p, primes[0]);
+    mpz_set(q, primes[1]);
+    mpz_clears(primes[0], primes[1], NULL);
+}
+
+// Creates parts of a new RSA public key made of count primes (2 to RSA_MAX_PRIMES), storing
+// the primes in primes[0..count-1], their product in n and the public exponent in e. Options
+// are as in rsa_make_pub_opts(). Two primes split nbits at random as rsa_make_pub() always has;
+// more primes split it evenly.
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, const rsa_keygen_opts_t *opts) {
+    uint32_t threads = opts ? opts->threads : 1;
+    prime_test_t test = opts ? opts->test : PRIME_TEST_MR;
+    uint64_t fixed = opts ? opts->e : 0;
     bool done = false;
-    uint64_t p_bits, q_bits;
-    mpz_t totient, temp1, temp2, rand_num, d;
-    mpz_inits(totient, temp1, temp2, rand_num, d, NULL);
-    // number of p_bits is random number in the range [nbits/4,(3 * nbits)/4)
-    p_bits = random() % (((3 * nbits) / 4) - (nbits / 4)) + nbits / 4;
-    // The remaining bits go to q
-    q_bits = nbits - p_bits;
-    // creates large primes p and q
-    make_prime(p, p_bits + 1, iters);
-    make_prime(q, q_bits + 1, iters);
-    // compute n (product of p and q)
-    mpz_mul(n, p, q); // n <- p * q
+    uint64_t bits[RSA_MAX_PRIMES];
+    mpz_t totient, temp, rand_num, d;
+    mpz_inits(totient, temp, rand_num, d, NULL);
+    nt_ws_t ws;
+    nt_ws_init(&ws, 0);
+    if (count == 2) {
+        // number of p_bits is random number in the range [nbits/4,(3 * nbits)/4)
+        bits[0] = random() % (((3 * nbits) / 4) - (nbits / 4)) + nbits / 4;
+    } else {
+        for (uint32_t i = 0; i < count - 1; i++) {
+            bits[i] = nbits / count;
+        }
+    }
+    // The remaining bits go to the last prime
+    bits[count - 1] = nbits;
+    for (uint32_t i = 0; i < count - 1; i++) {
+        bits[count - 1] -= bits[i];
+    }
+    // creates the large primes, drawing again if a prime repeats
+    mpz_set_ui(n, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        bool repeated = true;
+        while (repeated) {
+            rsa_make_prime_for(primes[i], bits[i] + 1, iters, threads, test, fixed, &ws);
+            repeated = false;
+            for (uint32_t j = 0; j < i; j++) {
+                repeated = repeated || mpz_cmp(primes[i], primes[j]) == 0;
+            }
+        }
+        mpz_mul(n, n, primes[i]); // n <- n * primes[i]
+    }
+    if (fixed != 0) {
+        mpz_set_ui(e, fixed); // e <- fixed exponent, already coprime with every prime - 1
+        mpz_clears(totient, temp, rand_num, d, NULL);
+        nt_ws_clear(&ws);
+        return;
+    }
     // compute totient
-    mpz_sub_ui(temp1, p, 1); // temp1 <- p - 1
-    mpz_sub_ui(temp2, q, 1); // temp2 <- q - 1
-    mpz_mul(totient, temp1, temp2); // totient <- temp1 * temp2
+    mpz_set_ui(totient, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_sub_ui(temp, primes[i], 1); // temp <- primes[i] - 1
+        mpz_mul(totient, totient, temp); // totient <- totient * temp
+    }
     // find suitable public exponent e
     while (done == false) {
         mpz_urandomb(rand_num, state, nbits);
-        gcd(d, rand_num, totient); // greatest common divisor of rand_num and totient
+        stats_add(STAT_GCD_ATTEMPTS, 1);
+        gcd_ws(d, rand_num, totient, &ws); // greatest common divisor of rand_num and totient
         if (mpz_cmp_ui(d, 1) == 0) { // rand_num and totient are coprime
             done = true;
         }
     }
     // rand_num will be the public exponent
     mpz_set(e, rand_num); // e <- rand_num
-    mpz_clears(totient, temp1, temp2, rand_num, d, NULL);
+    mpz_clears(totient, temp, rand_num, d, NULL);
+    nt_ws_clear(&ws);
 }
 
 // Writes a public RSA key to pbfile.
@@ -49,10 +136,12 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
     fprintf(pbfile, "%s\n", username); // writes username to pbfile
 }
 
-// Reads a public RSA key from pbfile.
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-    gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n", n, e, s); // reads n, e, and s from pbfile
-    fscanf(pbfile, "%s\n", username); // reads username from pbfile
+// Reads a public RSA key from pbfile. username must hold RSA_USERNAME_MAX + 1 bytes.
+// Returns false if the key could not be read.
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
+    int fields = gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n", n, e, s); // reads n, e, and s from pbfile
+    // reads username from pbfile, at most RSA_USERNAME_MAX characters of it
+    return fields == 3 && fscanf(pbfile, RSA_USERNAME_FORMAT "\n", username) == 1;
 }
 
 // Creates a new RSA private key d given primes p and q and public exponent e.
@@ -67,6 +156,21 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     mpz_clears(temp1, temp2, totient, NULL);
 }
 
+// Creates a new RSA private key d given public exponent e and the count primes of a
+// multi-prime key.
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t count) {
+    mpz_t temp, totient;
+    mpz_inits(temp, totient, NULL);
+    mpz_set_ui(totient, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_sub_ui(temp, primes[i], 1); // temp <- primes[i] - 1
+        mpz_mul(totient, totient, temp); // totient <- totient * temp
+    }
+    // compute the inverse of e mod totient
+    mod_inverse(d, e, totient);
+    mpz_clears(temp, totient, NULL);
+}
+
 // Writes a private RSA key to pvfile.
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     gmp_fprintf(pvfile, "%Zx\n%Zx\n", n, d); // writes n and d to pvfile
@@ -77,59 +181,1517 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d); // reads n and d from pvfile
 }
 
+// Initializes the CRT parameters of a private key. The key starts out invalid (non-CRT).
+void rsa_crt_init(rsa_crt_t *crt) {
+    crt->valid = false;
+    crt->extra = 0;
+    mpz_inits(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_inits(crt->r[i], crt->dr[i], crt->t[i], NULL);
+    }
+}
+
+// Clears and frees all memory used by the CRT parameters of a private key.
+void rsa_crt_clear(rsa_crt_t *crt) {
+    crt->valid = false;
+    crt->extra = 0;
+    mpz_clears(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_clears(crt->r[i], crt->dr[i], crt->t[i], NULL);
+    }
+}
+
+// Computes the CRT parameters of the private key d given its primes p and q.
+void rsa_make_crt(rsa_crt_t *crt, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t temp;
+    mpz_init(temp);
+    mpz_set(crt->p, p); // p
+    mpz_set(crt->q, q); // q
+    mpz_sub_ui(temp, p, 1); // temp <- p - 1
+    mpz_mod(crt->dp, d, temp); // dp <- d mod (p - 1)
+    mpz_sub_ui(temp, q, 1); // temp <- q - 1
+    mpz_mod(crt->dq, d, temp); // dq <- d mod (q - 1)
+    mod_inverse(crt->qinv, q, p); // qinv <- q^-1 mod p
+    crt->extra = 0;
+    crt->valid = true;
+    mpz_clear(temp);
+}
+
+// Computes the CRT parameters of the private key d given its count primes (2 to RSA_MAX_PRIMES).
+// The first two primes become p and q, and the rest become the extra primes.
+void rsa_make_crt_multi(rsa_crt_t *crt, mpz_t d, mpz_t primes[], uint32_t count) {
+    mpz_t temp, prefix;
+    mpz_inits(temp, prefix, NULL);
+    rsa_make_crt(crt, d, primes[0], primes[1]);
+    mpz_mul(prefix, primes[0], primes[1]); // prefix <- p * q
+    for (uint32_t i = 0; i < count - 2; i++) {
+        mpz_set(crt->r[i], primes[i + 2]); // r[i]
+        mpz_sub_ui(temp, crt->r[i], 1); // temp <- r[i] - 1
+        mpz_mod(crt->dr[i], d, temp); // dr[i] <- d mod (r[i] - 1)
+        mod_inverse(crt->t[i], prefix, crt->r[i]); // t[i] <- prefix^-1 mod r[i]
+        mpz_mul(prefix, prefix, crt->r[i]); // prefix <- prefix * r[i]
+    }
+    crt->extra = count - 2;
+    mpz_clears(temp, prefix, NULL);
+}
+
+// Writes an extended private RSA key to pvfile. The first two lines are n and d as in the
+// legacy format, followed by p, q, dp, dq and qinv, and by r, dr and t for each extra prime.
+void rsa_write_priv_crt(mpz_t n, mpz_t d, rsa_crt_t *crt, FILE *pvfile) {
+    rsa_write_priv(n, d, pvfile);
+    if (crt->valid) {
+        gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", crt->p, crt->q, crt->dp, crt->dq,
+            crt->qinv);
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n", crt->r[i], crt->dr[i], crt->t[i]);
+        }
+    }
+}
+
+// Reads a private RSA key from pvfile in either the legacy or the extended format.
+// crt->valid is set only if all CRT parameters were present and the primes multiply to n.
+// Returns false if not even n and d could be read.
+bool rsa_read_priv_crt(mpz_t n, mpz_t d, rsa_crt_t *crt, FILE *pvfile) {
+    int fields = gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", n, d, crt->p, crt->q,
+        crt->dp, crt->dq, crt->qinv);
+    crt->valid = false;
+    crt->extra = 0;
+    if (fields == 7) {
+        while (crt->extra < RSA_MAX_PRIMES - 2
+               && gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", crt->r[crt->extra], crt->dr[crt->extra],
+                      crt->t[crt->extra])
+                      == 3) {
+            crt->extra += 1;
+        }
+        mpz_t product;
+        mpz_init(product);
+        mpz_mul(product, crt->p, crt->q); // product <- p * q
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            mpz_mul(product, product, crt->r[i]); // product <- product * r[i]
+        }
+        crt->valid = (mpz_cmp(product, n) == 0);
+        mpz_clear(product);
+    }
+    return fields >= 2;
+}
+
+// Initializes a key cache with no valid entries.
+void rsa_cache_init(rsa_cache_t *cache) {
+    powm_cache_init(&cache->n);
+    powm_cache_init(&cache->p);
+    powm_cache_init(&cache->q);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        powm_cache_init(&cache->r[i]);
+    }
+}
+
+// Clears and frees all memory used by a key cache.
+void rsa_cache_clear(rsa_cache_t *cache) {
+    powm_cache_clear(&cache->n);
+    powm_cache_clear(&cache->p);
+    powm_cache_clear(&cache->q);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        powm_cache_clear(&cache->r[i]);
+    }
+}
+
+// Saves the constants of a set-up exponentiation state into the matching entries of cache.
+void rsa_cache_save(rsa_cache_t *cache, const rsa_ctx_t *ctx) {
+    if (!ctx->crt) {
+        powm_cache_save(&cache->n, &ctx->full);
+        return;
+    }
+    powm_cache_save(&cache->p, &ctx->cp);
+    powm_cache_save(&cache->q, &ctx->cq);
+    for (uint32_t i = 0; i < ctx->extra; i++) {
+        powm_cache_save(&cache->r[i], &ctx->cr[i]);
+    }
+}
+
+// Computes the constants of the key (exponent, n) and, if crt holds valid CRT parameters, those of
+// its primes. crt may be NULL.
+void rsa_make_cache(rsa_cache_t *cache, mpz_t exponent, mpz_t n, rsa_crt_t *crt) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, exponent, n, NULL);
+    rsa_cache_save(cache, &ctx);
+    rsa_ctx_clear(&ctx);
+    if (crt != NULL && crt->valid) {
+        rsa_ctx_init(&ctx, exponent, n, crt);
+        rsa_cache_save(cache, &ctx);
+        rsa_ctx_clear(&ctx);
+    }
+}
+
+// Kinds of key stored in a binary key file.
+#define RSA_KEY_PUBLIC  1
+#define RSA_KEY_PRIVATE 2
+
+// Record tags of the binary key format. The records of extra prime i use the tag plus i.
+enum {
+    RSA_TAG_USERNAME = 1, // username bytes, without a terminator
+    RSA_TAG_N, // integers, stored as raw limbs, least significant first
+    RSA_TAG_E,
+    RSA_TAG_S,
+    RSA_TAG_D,
+    RSA_TAG_P,
+    RSA_TAG_Q,
+    RSA_TAG_DP,
+    RSA_TAG_DQ,
+    RSA_TAG_QINV,
+    RSA_TAG_R = 0x10,
+    RSA_TAG_DR = 0x18,
+    RSA_TAG_T = 0x20,
+    RSA_TAG_CACHE_N = 0x28, // exponentiation constants of a modulus, see rsa_keybuf_cache()
+    RSA_TAG_CACHE_P,
+    RSA_TAG_CACHE_Q,
+    RSA_TAG_CACHE_R = 0x30,
+    RSA_TAGS = 0x38,
+};
+
+// A binary key file being assembled in memory.
+typedef struct {
+    uint8_t *data;
+    size_t used, size;
+    uint32_t records;
+} rsa_keybuf_t;
+
+// Returns the FNV-1a hash of len bytes, the checksum of binary key files.
+static uint64_t rsa_checksum(const uint8_t *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Returns 1 if this machine stores integers little-endian, 2 if big-endian.
+static uint8_t rsa_byte_order(void) {
+    uint16_t probe = 1;
+    uint8_t first;
+    memcpy(&first, &probe, 1);
+    return first == 1 ? 1 : 2;
+}
+
+// Appends a record with a zeroed payload of len bytes, padded to a multiple of 8 bytes so that
+// every payload stays limb-aligned. Returns the payload.
+static uint8_t *rsa_keybuf_record(rsa_keybuf_t *kb, uint32_t tag, size_t len) {
+    size_t padded = (len + 7) & ~(size_t) 7;
+    if (kb->used + 8 + padded > kb->size) {
+        kb->size = 2 * (kb->used + 8 + padded);
+        kb->data = (uint8_t *) realloc(kb->data, kb->size);
+    }
+    uint32_t fields[2] = { tag, (uint32_t) len };
+    memcpy(kb->data + kb->used, fields, sizeof(fields));
+    uint8_t *payload = kb->data + kb->used + 8;
+    memset(payload, 0, padded);
+    kb->used += 8 + padded;
+    kb->records += 1;
+    return payload;
+}
+
+// Appends x >= 0 as a record of raw limbs.
+static void rsa_keybuf_mpz(rsa_keybuf_t *kb, uint32_t tag, mpz_srcptr x) {
+    size_t bytes = mpz_size(x) * sizeof(mp_limb_t);
+    memcpy(rsa_keybuf_record(kb, tag, bytes), mpz_limbs_read(x), bytes);
+}
+
+// Appends the exponentiation constants of modulus, if pc is valid: -n^-1 mod 2^GMP_NUMB_BITS and
+// the one-limb exponent of the correction (0 for none), followed by R mod n, R^2 mod n and the
+// correction R^e mod n if present, each zero-padded to the size of the modulus.
+static void rsa_keybuf_cache(
+    rsa_keybuf_t *kb, uint32_t tag, const powm_cache_t *pc, mpz_srcptr modulus) {
+    if (!pc->valid) {
+        return;
+    }
+    size_t size = mpz_size(modulus);
+    size_t limbs = 2 + 2 * size + (pc->exp_word != 0 ? size : 0);
+    uint8_t *payload = rsa_keybuf_record(kb, tag, limbs * sizeof(mp_limb_t));
+    mp_limb_t head[2] = { pc->ninv, pc->exp_word };
+    memcpy(payload, head, sizeof(head));
+    payload += sizeof(head);
+    mpz_srcptr values[3] = { pc->one, pc->r2, pc->correction };
+    for (int i = 0; i < (pc->exp_word != 0 ? 3 : 2); i++) {
+        memcpy(payload, mpz_limbs_read(values[i]), mpz_size(values[i]) * sizeof(mp_limb_t));
+        payload += size * sizeof(mp_limb_t);
+    }
+}
+
+// Starts an empty binary key file, leaving room for its header.
+static void rsa_keybuf_init(rsa_keybuf_t *kb) {
+    kb->size = 4096;
+    kb->data = (uint8_t *) calloc(kb->size, sizeof(uint8_t));
+    kb->used = RSA_KEY_HEADER_SIZE;
+    kb->records = 0;
+}
+
+// Fills in the header of a finished binary key file, writes it to file with a single write and
+// frees it.
+static void rsa_keybuf_write(rsa_keybuf_t *kb, uint8_t kind, mpz_srcptr n, FILE *file) {
+    uint8_t *header = kb->data;
+    memcpy(header, RSA_KEY_MAGIC, 4);
+    header[4] = RSA_KEY_VERSION;
+    header[5] = kind;
+    header[6] = sizeof(mp_limb_t);
+    header[7] = rsa_byte_order();
+    uint32_t counts[2] = { (uint32_t) mpz_sizeinbase(n, 2), kb->records };
+    uint64_t sums[2] = { kb->used, 0 };
+    memcpy(header + 8, counts, sizeof(counts));
+    memcpy(header + 16, sums, sizeof(sums));
+    sums[1] = rsa_checksum(kb->data, kb->used); // computed with the checksum field zeroed
+    memcpy(header + 24, &sums[1], sizeof(uint64_t));
+    fwrite(kb->data, sizeof(uint8_t), kb->used, file);
+    free(kb->data);
+}
+
+// Writes a public RSA key to pbfile in the binary key format, with the constants of cache.
+// cache may be NULL.
+void rsa_write_pub_bin(
+    mpz_t n, mpz_t e, mpz_t s, const char username[], const rsa_cache_t *cache, FILE *pbfile) {
+    rsa_keybuf_t kb;
+    rsa_keybuf_init(&kb);
+    size_t len = strlen(username);
+    memcpy(rsa_keybuf_record(&kb, RSA_TAG_USERNAME, len), username, len);
+    rsa_keybuf_mpz(&kb, RSA_TAG_N, n);
+    rsa_keybuf_mpz(&kb, RSA_TAG_E, e);
+    rsa_keybuf_mpz(&kb, RSA_TAG_S, s);
+    if (cache != NULL) {
+        rsa_keybuf_cache(&kb, RSA_TAG_CACHE_N, &cache->n, n);
+    }
+    rsa_keybuf_write(&kb, RSA_KEY_PUBLIC, n, pbfile);
+}
+
+// Writes a private RSA key to pvfile in the binary key format, with its CRT parameters if crt is
+// valid and the constants of cache. cache may be NULL.
+void rsa_write_priv_bin(
+    mpz_t n, mpz_t d, const rsa_crt_t *crt, const rsa_cache_t *cache, FILE *pvfile) {
+    rsa_keybuf_t kb;
+    rsa_keybuf_init(&kb);
+    rsa_keybuf_mpz(&kb, RSA_TAG_N, n);
+    rsa_keybuf_mpz(&kb, RSA_TAG_D, d);
+    if (crt->valid) {
+        rsa_keybuf_mpz(&kb, RSA_TAG_P, crt->p);
+        rsa_keybuf_mpz(&kb, RSA_TAG_Q, crt->q);
+        rsa_keybuf_mpz(&kb, RSA_TAG_DP, crt->dp);
+        rsa_keybuf_mpz(&kb, RSA_TAG_DQ, crt->dq);
+        rsa_keybuf_mpz(&kb, RSA_TAG_QINV, crt->qinv);
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            rsa_keybuf_mpz(&kb, RSA_TAG_R + i, crt->r[i]);
+            rsa_keybuf_mpz(&kb, RSA_TAG_DR + i, crt->dr[i]);
+            rsa_keybuf_mpz(&kb, RSA_TAG_T + i, crt->t[i]);
+        }
+    }
+    if (cache != NULL) {
+        rsa_keybuf_cache(&kb, RSA_TAG_CACHE_N, &cache->n, n);
+        if (crt->valid) {
+            rsa_keybuf_cache(&kb, RSA_TAG_CACHE_P, &cache->p, crt->p);
+            rsa_keybuf_cache(&kb, RSA_TAG_CACHE_Q, &cache->q, crt->q);
+            for (uint32_t i = 0; i < crt->extra; i++) {
+                rsa_keybuf_cache(&kb, RSA_TAG_CACHE_R + i, &cache->r[i], crt->r[i]);
+            }
+        }
+    }
+    rsa_keybuf_write(&kb, RSA_KEY_PRIVATE, n, pvfile);
+}
+
+// A binary key file read into memory, with the payload of each record found by its tag.
+typedef struct {
+    uint8_t *data;
+    uint32_t bits; // modulus bits recorded in the header
+    const uint8_t *payload[RSA_TAGS];
+    uint32_t len[RSA_TAGS];
+} rsa_keyfile_t;
+
+// Reads the whole of a binary key file of the given kind, in a single read for a regular file, and
+// indexes its records. Returns false, leaving nothing to free, if the file is not a well-formed
+// key of that kind written on a machine with the same limb size and byte order.
+static bool rsa_keyfile_read(rsa_keyfile_t *kf, FILE *file, uint8_t kind) {
+    struct stat st;
+    size_t size = fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size + 1 : 4096;
+    size_t used = 0, got;
+    kf->data = (uint8_t *) malloc(size);
+    while ((got = fread(kf->data + used, sizeof(uint8_t), size - used, file)) > 0) {
+        used += got;
+        if (used == size) {
+            size *= 2;
+            kf->data = (uint8_t *) realloc(kf->data, size);
+        }
+    }
+    uint8_t *h = kf->data;
+    uint32_t counts[2];
+    uint64_t sums[2];
+    bool ok = used >= RSA_KEY_HEADER_SIZE && memcmp(h, RSA_KEY_MAGIC, 4) == 0
+              && h[4] == RSA_KEY_VERSION && h[5] == kind && h[6] == sizeof(mp_limb_t)
+              && h[7] == rsa_byte_order();
+    if (ok) {
+        memcpy(counts, h + 8, sizeof(counts));
+        memcpy(sums, h + 16, sizeof(sums));
+        memset(h + 24, 0, sizeof(uint64_t)); // the checksum covers the file with its field zeroed
+        ok = sums[0] == used && sums[1] == rsa_checksum(h, used);
+    }
+    memset(kf->payload, 0, sizeof(kf->payload));
+    memset(kf->len, 0, sizeof(kf->len));
+    kf->bits = ok ? counts[0] : 0;
+    size_t offset = RSA_KEY_HEADER_SIZE;
+    for (uint32_t i = 0; ok && i < counts[1]; i++) {
+        uint32_t fields[2];
+        ok = used - offset >= 8;
+        if (ok) {
+            memcpy(fields, h + offset, sizeof(fields));
+            size_t padded = ((size_t) fields[1] + 7) & ~(size_t) 7;
+            ok = fields[0] < RSA_TAGS && kf->payload[fields[0]] == NULL
+                 && used - offset - 8 >= padded;
+            if (ok) {
+                kf->payload[fields[0]] = h + offset + 8;
+                kf->len[fields[0]] = fields[1];
+                offset += 8 + padded;
+            }
+        }
+    }
+    if (!ok || offset != used) {
+        free(kf->data);
+        kf->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Loads size limbs stored at data into x.
+static void rsa_limbs_to_mpz(mpz_t x, const uint8_t *data, size_t size) {
+    if (size == 0) {
+        mpz_set_ui(x, 0);
+        return;
+    }
+    memcpy(mpz_limbs_write(x, size), data, size * sizeof(mp_limb_t));
+    mpz_limbs_finish(x, size);
+}
+
+// Loads the integer record with the given tag into x. Returns false if it is missing or malformed.
+static bool rsa_keyfile_mpz(const rsa_keyfile_t *kf, uint32_t tag, mpz_t x) {
+    if (kf->payload[tag] == NULL || kf->len[tag] % sizeof(mp_limb_t) != 0) {
+        return false;
+    }
+    rsa_limbs_to_mpz(x, kf->payload[tag], kf->len[tag] / sizeof(mp_limb_t));
+    return true;
+}
+
+// Loads the constants record with the given tag for modulus into pc, which is left invalid if the
+// file has no such record. Returns false if the record is malformed or cannot belong to modulus.
+static bool rsa_keyfile_cache(
+    const rsa_keyfile_t *kf, uint32_t tag, mpz_t modulus, powm_cache_t *pc) {
+    pc->valid = false;
+    if (kf->payload[tag] == NULL) {
+        return true;
+    }
+    size_t size = mpz_size(modulus);
+    mp_limb_t head[2];
+    if (kf->len[tag] < sizeof(head) || !mpz_odd_p(modulus)) {
+        return false;
+    }
+    memcpy(head, kf->payload[tag], sizeof(head));
+    size_t limbs = 2 + 2 * size + (head[1] != 0 ? size : 0);
+    if (kf->len[tag] != limbs * sizeof(mp_limb_t)) {
+        return false;
+    }
+    const uint8_t *data = kf->payload[tag] + sizeof(head);
+    mpz_ptr values[3] = { pc->one, pc->r2, pc->correction };
+    mpz_set_ui(pc->correction, 0);
+    for (int i = 0; i < (head[1] != 0 ? 3 : 2); i++) {
+        rsa_limbs_to_mpz(values[i], data + i * size * sizeof(mp_limb_t), size);
+    }
+    pc->ninv = head[0];
+    pc->exp_word = head[1];
+    // a record that passed the checksum can still hold the constants of another modulus
+    pc->valid = powm_cache_check(pc, modulus);
+    return pc->valid;
+}
+
+// Reads a public RSA key in the binary key format from pbfile, and its constants into cache.
+// username must hold RSA_USERNAME_MAX + 1 bytes; cache may be NULL.
+// Returns false if the file is not a well-formed binary public key for this machine.
+bool rsa_read_pub_bin(
+    mpz_t n, mpz_t e, mpz_t s, char username[], rsa_cache_t *cache, FILE *pbfile) {
+    rsa_keyfile_t kf;
+    if (!rsa_keyfile_read(&kf, pbfile, RSA_KEY_PUBLIC)) {
+        return false;
+    }
+    const uint8_t *name = kf.payload[RSA_TAG_USERNAME];
+    uint32_t len = kf.len[RSA_TAG_USERNAME];
+    bool ok = name != NULL && len <= RSA_USERNAME_MAX && memchr(name, '\0', len) == NULL
+              && rsa_keyfile_mpz(&kf, RSA_TAG_N, n) && rsa_keyfile_mpz(&kf, RSA_TAG_E, e)
+              && rsa_keyfile_mpz(&kf, RSA_TAG_S, s) && mpz_sizeinbase(n, 2) == kf.bits
+              && (cache == NULL || rsa_keyfile_cache(&kf, RSA_TAG_CACHE_N, n, &cache->n));
+    if (ok) {
+        memcpy(username, name, len);
+        username[len] = '\0';
+    }
+    free(kf.data);
+    return ok;
+}
+
+// Reads a private RSA key in the binary key format from pvfile, and its constants into cache.
+// crt->valid is set if the key has CRT parameters; cache may be NULL.
+// Returns false if the file is not a well-formed binary private key for this machine, or if its
+// primes do not multiply to n.
+bool rsa_read_priv_bin(mpz_t n, mpz_t d, rsa_crt_t *crt, rsa_cache_t *cache, FILE *pvfile) {
+    rsa_keyfile_t kf;
+    crt->valid = false;
+    crt->extra = 0;
+    if (!rsa_keyfile_read(&kf, pvfile, RSA_KEY_PRIVATE)) {
+        return false;
+    }
+    bool ok = rsa_keyfile_mpz(&kf, RSA_TAG_N, n) && rsa_keyfile_mpz(&kf, RSA_TAG_D, d)
+              && mpz_sizeinbase(n, 2) == kf.bits;
+    if (ok && kf.payload[RSA_TAG_P] != NULL) {
+        ok = rsa_keyfile_mpz(&kf, RSA_TAG_P, crt->p) && rsa_keyfile_mpz(&kf, RSA_TAG_Q, crt->q)
+             && rsa_keyfile_mpz(&kf, RSA_TAG_DP, crt->dp)
+             && rsa_keyfile_mpz(&kf, RSA_TAG_DQ, crt->dq)
+             && rsa_keyfile_mpz(&kf, RSA_TAG_QINV, crt->qinv);
+        while (ok && crt->extra < RSA_MAX_PRIMES - 2
+               && kf.payload[RSA_TAG_R + crt->extra] != NULL) {
+            uint32_t i = crt->extra;
+            ok = rsa_keyfile_mpz(&kf, RSA_TAG_R + i, crt->r[i])
+                 && rsa_keyfile_mpz(&kf, RSA_TAG_DR + i, crt->dr[i])
+                 && rsa_keyfile_mpz(&kf, RSA_TAG_T + i, crt->t[i]);
+            crt->extra += 1;
+        }
+        mpz_t product;
+        mpz_init(product);
+        mpz_mul(product, crt->p, crt->q); // product <- p * q
+        for (uint32_t i = 0; i < crt->extra; i++) {
+            mpz_mul(product, product, crt->r[i]); // product <- product * r[i]
+        }
+        ok = ok && mpz_cmp(product, n) == 0;
+        crt->valid = ok;
+        mpz_clear(product);
+    }
+    if (ok && cache != NULL) {
+        ok = rsa_keyfile_cache(&kf, RSA_TAG_CACHE_N, n, &cache->n);
+        if (ok && crt->valid) {
+            ok = rsa_keyfile_cache(&kf, RSA_TAG_CACHE_P, crt->p, &cache->p)
+                 && rsa_keyfile_cache(&kf, RSA_TAG_CACHE_Q, crt->q, &cache->q);
+            for (uint32_t i = 0; ok && i < crt->extra; i++) {
+                ok = rsa_keyfile_cache(&kf, RSA_TAG_CACHE_R + i, crt->r[i], &cache->r[i]);
+            }
+        }
+    }
+    free(kf.data);
+    return ok;
+}
+
+// Reads a public RSA key from pbfile in either the text or the binary key format, telling them
+// apart by the first byte (text keys start with a hex digit). cache receives the constants stored
+// in a binary key; cache may be NULL. Returns false if the key could not be read.
+bool rsa_load_pub(mpz_t n, mpz_t e, mpz_t s, char username[], rsa_cache_t *cache, FILE *pbfile) {
+    int first = getc(pbfile);
+    if (first == EOF) {
+        return false;
+    }
+    ungetc(first, pbfile);
+    if (first == RSA_KEY_MAGIC[0]) {
+        return rsa_read_pub_bin(n, e, s, username, cache, pbfile);
+    }
+    return rsa_read_pub(n, e, s, username, pbfile);
+}
+
+// Reads a private RSA key from pvfile in either the text or the binary key format, like
+// rsa_load_pub(). Returns false if the key could not be read.
+bool rsa_load_priv(mpz_t n, mpz_t d, rsa_crt_t *crt, rsa_cache_t *cache, FILE *pvfile) {
+    int first = getc(pvfile);
+    if (first == EOF) {
+        return false;
+    }
+    ungetc(first, pvfile);
+    if (first == RSA_KEY_MAGIC[0]) {
+        return rsa_read_priv_bin(n, d, crt, cache, pvfile);
+    }
+    return rsa_read_priv_crt(n, d, crt, pvfile);
+}
+
+// Initializes the exponentiation state for a key. crt may be NULL; when it holds valid CRT
+// parameters, exponent is ignored and the state exponentiates modulo each prime instead.
+void rsa_ctx_init(rsa_ctx_t *ctx, mpz_t exponent, mpz_t n, rsa_crt_t *crt) {
+    rsa_ctx_init_cached(ctx, exponent, n, crt, NULL);
+}
+
+// Initializes the exponentiation state for a key like rsa_ctx_init(), taking the constants of the
+// modulus or primes from the valid entries of cache, which must belong to the same key.
+// cache may be NULL.
+void rsa_ctx_init_cached(
+    rsa_ctx_t *ctx, mpz_t exponent, mpz_t n, rsa_crt_t *crt, const rsa_cache_t *cache) {
+    ctx->crt = (crt != NULL && crt->valid);
+    ctx->extra = 0;
+    ctx->lanes = 1;
+    mpz_inits(ctx->m1, ctx->m2, ctx->h, NULL);
+    if (ctx->crt) {
+        powm_init_cached(&ctx->cp, crt->dp, crt->p, cache ? &cache->p : NULL);
+        powm_init_cached(&ctx->cq, crt->dq, crt->q, cache ? &cache->q : NULL);
+        mpz_init_set(ctx->p, crt->p);
+        mpz_init_set(ctx->q, crt->q);
+        mpz_init_set(ctx->qinv, crt->qinv);
+        ctx->extra = crt->extra;
+        for (uint32_t i = 0; i < ctx->extra; i++) {
+            powm_init_cached(&ctx->cr[i], crt->dr[i], crt->r[i], cache ? &cache->r[i] : NULL);
+            mpz_init_set(ctx->r[i], crt->r[i]);
+            mpz_init_set(ctx->t[i], crt->t[i]);
+            mpz_init(ctx->prefix[i]);
+            if (i == 0) {
+                mpz_mul(ctx->prefix[i], crt->p, crt->q); // prefix[0] <- p * q
+            } else {
+                mpz_mul(ctx->prefix[i], ctx->prefix[i - 1], crt->r[i - 1]);
+            }
+        }
+    } else {
+        powm_init_cached(&ctx->full, exponent, n, cache ? &cache->n : NULL);
+    }
+}
+
+// One step of Garner's recombination: given acc, the result modulo prefix, and m1, the result
+// modulo prime, sets acc to the result modulo prefix * prime. coeff is prefix^-1 mod prime.
+static void rsa_ctx_garner(
+    rsa_ctx_t *ctx, mpz_t acc, mpz_t m1, mpz_t coeff, mpz_t prime, mpz_t prefix) {
+    mpz_sub(ctx->h, m1, acc); // h <- m1 - acc
+    mpz_mul(ctx->h, ctx->h, coeff); // h <- coeff * (m1 - acc)
+    mpz_mod(ctx->h, ctx->h, prime); // h <- coeff * (m1 - acc) mod prime
+    mpz_mul(ctx->h, ctx->h, prefix); // h <- h * prefix
+    mpz_add(acc, acc, ctx->h); // acc <- acc + h * prefix
+}
+
+// Raises in to the key's exponent, storing the result in out.
+void rsa_ctx_apply(rsa_ctx_t *ctx, mpz_t out, mpz_t in) {
+    if (!ctx->crt) {
+        powm(&ctx->full, out, in);
+        return;
+    }
+    mpz_mod(ctx->h, in, ctx->p); // h <- in mod p
+    powm(&ctx->cp, ctx->m1, ctx->h); // m1 <- in^dp mod p
+    mpz_mod(ctx->h, in, ctx->q); // h <- in mod q
+    powm(&ctx->cq, ctx->m2, ctx->h); // m2 <- in^dq mod q
+    rsa_ctx_garner(ctx, ctx->m2, ctx->m1, ctx->qinv, ctx->p, ctx->q); // m2 <- result mod p * q
+    // Fold in each extra prime, keeping m2 = result mod prefix[i] * r[i]
+    for (uint32_t i = 0; i < ctx->extra; i++) {
+        mpz_mod(ctx->h, in, ctx->r[i]); // h <- in mod r[i]
+        powm(&ctx->cr[i], ctx->m1, ctx->h); // m1 <- in^dr[i] mod r[i]
+        rsa_ctx_garner(ctx, ctx->m2, ctx->m1, ctx->t[i], ctx->r[i], ctx->prefix[i]);
+    }
+    mpz_set(out, ctx->m2);
+}
+
+// Clears the vector contexts of an exponentiation state, making it scalar again.
+static void rsa_ctx_clear_lanes(rsa_ctx_t *ctx) {
+    if (ctx->crt) {
+        vpowm_clear(&ctx->vp);
+        vpowm_clear(&ctx->vq);
+        for (uint32_t i = 0; i < ctx->extra; i++) {
+            vpowm_clear(&ctx->vr[i]);
+        }
+    } else {
+        vpowm_clear(&ctx->vfull);
+    }
+    ctx->lanes = 1;
+}
+
+// Sets up vector forms of the state's exponentiation contexts for kernel, so that
+// rsa_ctx_apply_lanes() exponentiates several blocks at once. Returns false, leaving the state
+// scalar, if kernel is VPOWM_SCALAR or cannot take the key.
+bool rsa_ctx_enable_lanes(rsa_ctx_t *ctx, vpowm_kernel_t kernel) {
+    if (ctx->lanes > 1) {
+        return true;
+    }
+    // every context is initialized, and cleared again if any of them cannot take its modulus
+    bool ok;
+    if (ctx->crt) {
+        ok = vpowm_init(&ctx->vp, &ctx->cp, kernel);
+        ok = vpowm_init(&ctx->vq, &ctx->cq, kernel) && ok;
+        for (uint32_t i = 0; i < ctx->extra; i++) {
+            ok = vpowm_init(&ctx->vr[i], &ctx->cr[i], kernel) && ok;
+        }
+    } else {
+        ok = vpowm_init(&ctx->vfull, &ctx->full, kernel);
+    }
+    ctx->lanes = vpowm_kernel_lanes(kernel);
+    if (!ok) {
+        rsa_ctx_clear_lanes(ctx);
+        return false;
+    }
+    for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+        mpz_inits(ctx->lm1[i], ctx->lm2[i], ctx->lh[i], NULL);
+    }
+    return true;
+}
+
+// Raises in[i] to the key's exponent, storing the result in out[i], for count blocks, using the
+// vector contexts for up to lanes blocks at a time.
+void rsa_ctx_apply_lanes(rsa_ctx_t *ctx, mpz_t out[], mpz_t in[], uint32_t count) {
+    if (ctx->lanes == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            rsa_ctx_apply(ctx, out[i], in[i]);
+        }
+        return;
+    }
+    for (; count > ctx->lanes; count -= ctx->lanes, out += ctx->lanes, in += ctx->lanes) {
+        rsa_ctx_apply_lanes(ctx, out, in, ctx->lanes);
+    }
+    if (!ctx->crt) {
+        vpowm(&ctx->vfull, out, in, count);
+        return;
+    }
+    // The same steps as rsa_ctx_apply(), with every exponentiation done for all lanes at once
+    for (uint32_t l = 0; l < count; l++) {
+        mpz_mod(ctx->lh[l], in[l], ctx->p);
+    }
+    vpowm(&ctx->vp, ctx->lm1, ctx->lh, count);
+    for (uint32_t l = 0; l < count; l++) {
+        mpz_mod(ctx->lh[l], in[l], ctx->q);
+    }
+    vpowm(&ctx->vq, ctx->lm2, ctx->lh, count);
+    for (uint32_t l = 0; l < count; l++) {
+        rsa_ctx_garner(ctx, ctx->lm2[l], ctx->lm1[l], ctx->qinv, ctx->p, ctx->q);
+    }
+    for (uint32_t i = 0; i < ctx->extra; i++) {
+        for (uint32_t l = 0; l < count; l++) {
+            mpz_mod(ctx->lh[l], in[l], ctx->r[i]);
+        }
+        vpowm(&ctx->vr[i], ctx->lm1, ctx->lh, count);
+        for (uint32_t l = 0; l < count; l++) {
+            rsa_ctx_garner(ctx, ctx->lm2[l], ctx->lm1[l], ctx->t[i], ctx->r[i], ctx->prefix[i]);
+        }
+    }
+    for (uint32_t l = 0; l < count; l++) {
+        mpz_set(out[l], ctx->lm2[l]);
+    }
+}
+
+// Clears and frees all memory used by the exponentiation state for a key.
+void rsa_ctx_clear(rsa_ctx_t *ctx) {
+    if (ctx->crt) {
+        powm_clear(&ctx->cp);
+        powm_clear(&ctx->cq);
+        mpz_clears(ctx->p, ctx->q, ctx->qinv, NULL);
+        for (uint32_t i = 0; i < ctx->extra; i++) {
+            powm_clear(&ctx->cr[i]);
+            mpz_clears(ctx->r[i], ctx->t[i], ctx->prefix[i], NULL);
+        }
+    } else {
+        powm_clear(&ctx->full);
+    }
+    mpz_clears(ctx->m1, ctx->m2, ctx->h, NULL);
+    if (ctx->lanes > 1) {
+        rsa_ctx_clear_lanes(ctx);
+        for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+            mpz_clears(ctx->lm1[i], ctx->lm2[i], ctx->lh[i], NULL);
+        }
+    }
+}
+
 // Performs RSA encryption, computing ciphertext c by encrypting message m
 // using public exponent e and modulus n.
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
     pow_mod(c, m, e, n);
 }
 
+// A batch of blocks exponentiated in parallel, with one exponentiation state per worker.
+typedef struct {
+    uint64_t size; // blocks per batch
+    uint32_t workers;
+    uint32_t lanes; // blocks each job exponentiates at once
+    bool picked; // whether the vector kernel was considered yet, on the first run
+    uint64_t count; // blocks filled in for the current run
+    rsa_ctx_t *ctx;
+    mpz_t *in;
+    mpz_t *out;
+} rsa_batch_t;
+
+// Initializes a batch for the given key and number of workers. A batch holds enough blocks of
+// block_bytes bytes to fill a streaming window, and at least RSA_BATCH_BLOCKS per worker. Without
+// a cache, the workers share the constants computed for the first one. cache may be NULL. The
+// vector kernel is only picked once a run has blocks for all of its lanes (rsa_batch_run()).
+static void rsa_batch_init(rsa_batch_t *batch, uint32_t workers, size_t block_bytes,
+    mpz_t exponent, mpz_t n, rsa_crt_t *crt, const rsa_cache_t *cache) {
+    batch->workers = workers;
+    batch->size = (uint64_t) workers * RSA_BATCH_BLOCKS;
+    if (block_bytes > 0 && batch->size < RSA_WINDOW_BYTES / block_bytes) {
+        batch->size = RSA_WINDOW_BYTES / block_bytes;
+    }
+    batch->ctx = (rsa_ctx_t *) malloc(workers * sizeof(rsa_ctx_t));
+    batch->in = (mpz_t *) malloc(batch->size * sizeof(mpz_t));
+    batch->out = (mpz_t *) malloc(batch->size * sizeof(mpz_t));
+    rsa_cache_t shared;
+    rsa_cache_init(&shared);
+    rsa_ctx_init_cached(&batch->ctx[0], exponent, n, crt, cache);
+    if (cache == NULL) {
+        rsa_cache_save(&shared, &batch->ctx[0]);
+        cache = &shared;
+    }
+    for (uint32_t i = 1; i < workers; i++) {
+        rsa_ctx_init_cached(&batch->ctx[i], exponent, n, crt, cache);
+    }
+    rsa_cache_clear(&shared);
+    batch->lanes = 1;
+    batch->picked = false;
+    for (uint64_t i = 0; i < batch->size; i++) {
+        mpz_inits(batch->in[i], batch->out[i], NULL);
+    }
+}
+
+// Clears and frees all memory used by a batch.
+static void rsa_batch_clear(rsa_batch_t *batch) {
+    for (uint32_t i = 0; i < batch->workers; i++) {
+        rsa_ctx_clear(&batch->ctx[i]);
+    }
+    for (uint64_t i = 0; i < batch->size; i++) {
+        mpz_clears(batch->in[i], batch->out[i], NULL);
+    }
+    free(batch->ctx);
+    free(batch->in);
+    free(batch->out);
+}
+
+// Pool job: exponentiates group index of lanes blocks of the batch with the calling worker's
+// state.
+static void rsa_batch_apply(void *arg, uint32_t worker, uint64_t index) {
+    rsa_batch_t *batch = (rsa_batch_t *) arg;
+    uint64_t first = index * batch->lanes;
+    uint64_t count = batch->count - first < batch->lanes ? batch->count - first : batch->lanes;
+    rsa_ctx_apply_lanes(
+        &batch->ctx[worker], batch->out + first, batch->in + first, (uint32_t) count);
+}
+
+// Exponentiates the first count blocks of the batch across the workers of pool. The first run
+// with more than one block picks the kernel of vpowm_select(), and the workers exponentiate with it
+// if the run fills its lanes and the kernel can take the key. Short inputs, whose first run is
+// also their last, skip the vector setup and the kernel's self test.
+static void rsa_batch_run(rsa_batch_t *batch, pool_t *pool, uint64_t count) {
+    if (!batch->picked && count > 1) {
+        vpowm_kernel_t kernel = vpowm_select();
+        batch->picked = true;
+        for (uint32_t i = 0; i < batch->workers && count >= vpowm_kernel_lanes(kernel)
+             && rsa_ctx_enable_lanes(&batch->ctx[i], kernel);
+             i++) {
+            batch->lanes = batch->ctx[i].lanes;
+        }
+    }
+    batch->count = count;
+    pool_run(pool, rsa_batch_apply, batch, (count + batch->lanes - 1) / batch->lanes);
+}
+
+// Stores the low bytes bytes of value big-endian in buf.
+static void rsa_put_be(uint8_t *buf, uint64_t value, size_t bytes) {
+    for (size_t i = bytes; i-- > 0;) {
+        buf[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+// Returns the bytes-byte big-endian value stored in buf.
+static uint64_t rsa_get_be(const uint8_t *buf, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+// Encodes the header of the binary ciphertext format into buf.
+static void rsa_pack_bin_header(uint8_t *buf, const rsa_bin_header_t *header) {
+    memset(buf, 0, RSA_BIN_HEADER_SIZE);
+    memcpy(buf, RSA_BIN_MAGIC, 4);
+    buf[4] = header->version; // bytes 5 to 7 are reserved
+    rsa_put_be(buf + 8, header->bits, 4);
+    rsa_put_be(buf + 12, header->k, 4);
+    rsa_put_be(buf + 16, header->blocks, 8);
+}
+
+// Decodes the header of the binary ciphertext format from buf.
+// Returns false if the magic or version do not match.
+static bool rsa_unpack_bin_header(const uint8_t *buf, rsa_bin_header_t *header) {
+    if (memcmp(buf, RSA_BIN_MAGIC, 4) != 0 || buf[4] != RSA_BIN_VERSION) {
+        return false;
+    }
+    header->version = buf[4];
+    header->bits = rsa_get_be(buf + 8, 4);
+    header->k = rsa_get_be(buf + 12, 4);
+    header->blocks = rsa_get_be(buf + 16, 8);
+    return true;
+}
+
+// Writes the header of the binary ciphertext format to outfile.
+void rsa_write_bin_header(FILE *outfile, const rsa_bin_header_t *header) {
+    uint8_t buf[RSA_BIN_HEADER_SIZE];
+    rsa_pack_bin_header(buf, header);
+    fwrite(buf, sizeof(uint8_t), RSA_BIN_HEADER_SIZE, outfile);
+}
+
+// Reads the header of the binary ciphertext format from infile.
+// Returns false if the magic or version do not match.
+bool rsa_read_bin_header(FILE *infile, rsa_bin_header_t *header) {
+    uint8_t buf[RSA_BIN_HEADER_SIZE];
+    if (fread(buf, sizeof(uint8_t), RSA_BIN_HEADER_SIZE, infile) != RSA_BIN_HEADER_SIZE) {
+        return false;
+    }
+    return rsa_unpack_bin_header(buf, header);
+}
+
+// Converts a hexstring of len characters into c, using scratch (size bytes) for the decoded
+// bytes. Returns false if the text is not a hexstring of at most 2 * size digits.
+static bool rsa_import_hex(
+    mpz_t c, const uint8_t *text, size_t len, uint8_t *scratch, size_t size) {
+    while (len > 0 && (text[len - 1] == '\r' || text[len - 1] == ' ')) { // trailing whitespace
+        len -= 1;
+    }
+    while (len > 0 && text[0] == ' ') { // leading whitespace
+        text += 1;
+        len -= 1;
+    }
+    size_t bytes = (len + 1) / 2;
+    if (len == 0 || bytes > size) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        uint8_t ch = text[len - 1 - i], nibble;
+        if (ch >= '0' && ch <= '9') {
+            nibble = ch - '0';
+        } else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+            nibble = (ch | 0x20) - 'a' + 10;
+        } else {
+            return false;
+        }
+        // digit i (from the right) is the low or high nibble of byte i / 2 from the right
+        uint8_t *byte = scratch + bytes - 1 - i / 2;
+        *byte = (i % 2 == 0) ? nibble : (*byte | (uint8_t) (nibble << 4));
+    }
+    mpz_import(c, bytes, 1, 1, 1, 0, scratch);
+    return true;
+}
+
+// Stores c big-endian in exactly width bytes of block, zero-padding on the left.
+void rsa_export_fixed(uint8_t *block, size_t width, mpz_t c) {
+    size_t j = mpz_sgn(c) == 0 ? 0 : mpz_sizeinbase(c, 256);
+    memset(block, 0, width - j);
+    mpz_export(block + width - j, NULL, 1, 1, 1, 0, c);
+}
+
 // Encrypts the contents of infile, writing the encrypted contents to outfile.
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    size_t j = 1;
-    uint64_t index = 1;
-    uint64_t bytes = 0;
-    uint64_t bytes_to_read = 0;
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
-    // Calculate the block size k
+    rsa_encrypt_file_opts(infile, outfile, n, e, NULL);
+}
+
+// Converts the j plaintext bytes at data, with 0xFF prepended, into m without copying them.
+static void rsa_import_block(mpz_t m, const uint8_t *data, size_t j) {
+    mpz_import(m, j, 1, 1, 1, 0, data);
+    for (size_t bit = 8 * j; bit < 8 * j + 8; bit++) { // the prepended 0xFF byte
+        mpz_setbit(m, bit);
+    }
+}
+
+// Fills buf with len bytes from the kernel's random number generator.
+// Returns false if it cannot be read.
+static bool rsa_random_bytes(uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t got = getrandom(buf, len, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        len -= (size_t) got;
+    }
+    return true;
+}
+
+// Encodes the header of the hybrid container into buf. field is the modulus bit length in
+// version 1 and the number of recipients in version 2.
+static void rsa_pack_hyb_header(uint8_t *buf, uint8_t version, uint32_t field, uint32_t chunk) {
+    memset(buf, 0, RSA_HYB_HEADER_SIZE);
+    memcpy(buf, RSA_HYB_MAGIC, 4);
+    buf[4] = version; // bytes 5 to 7 are reserved
+    rsa_put_be(buf + 8, field, 4);
+    rsa_put_be(buf + 12, chunk, 4);
+}
+
+// Stores the first RSA_HYB_FINGERPRINT bytes of the SHA-256 hash of n, big-endian in
+// ceil(bits / 8) bytes, in fingerprint.
+static void rsa_hyb_fingerprint(uint8_t fingerprint[RSA_HYB_FINGERPRINT], mpz_t n) {
+    size_t width = mpz_sizeinbase(n, 256);
+    uint8_t *bytes = (uint8_t *) calloc(width, sizeof(uint8_t));
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    rsa_export_fixed(bytes, width, n);
+    sha256(digest, bytes, width);
+    memcpy(fingerprint, digest, RSA_HYB_FINGERPRINT);
+    free(bytes);
+}
+
+// Derives a key from the secret bytes wrapped with RSA and from the wrapped secret itself.
+static void rsa_hyb_derive(uint8_t key[AEAD_KEY_SIZE], const uint8_t *secret, size_t len,
+    const uint8_t *wrapped, size_t width) {
+    sha256_t hash;
+    sha256_init(&hash);
+    sha256_update(&hash, secret, len);
+    sha256_update(&hash, wrapped, width);
+    sha256_final(&hash, key);
+}
+
+// Draws a random secret of k - 1 bytes, encrypts it with 0xFF prepended, like a block of
+// plaintext, for the public key (e, n) into the ceil(bits / 8) bytes at wrapped, and derives key
+// from both. cache may be NULL. Returns false if no random secret could be drawn.
+static bool rsa_hyb_wrap(uint8_t key[AEAD_KEY_SIZE], uint8_t *wrapped, mpz_t e, mpz_t n,
+    const rsa_cache_t *cache) {
+    uint64_t k = floor((mpz_sizeinbase(n, 2) - 1) / 8);
+    uint8_t *secret = (uint8_t *) calloc(k - 1, sizeof(uint8_t));
+    bool ok = rsa_random_bytes(secret, k - 1);
+    rsa_ctx_t ctx;
+    rsa_ctx_init_cached(&ctx, e, n, NULL, cache);
+    mpz_t m;
+    mpz_init(m);
+    rsa_import_block(m, secret, k - 1);
+    rsa_ctx_apply(&ctx, m, m);
+    rsa_export_fixed(wrapped, mpz_sizeinbase(n, 256), m);
+    rsa_hyb_derive(key, secret, k - 1, wrapped, mpz_sizeinbase(n, 256));
+    mpz_clear(m);
+    rsa_ctx_clear(&ctx);
+    memset(secret, 0, k - 1);
+    free(secret);
+    return ok;
+}
+
+// Decrypts the secret in the ceil(bits / 8) bytes at wrapped with the private key (d, n) and
+// derives key from it as rsa_hyb_wrap() did. crt and cache may be NULL.
+// Returns false if wrapped does not hold a secret for this key.
+static bool rsa_hyb_unwrap(uint8_t key[AEAD_KEY_SIZE], const uint8_t *wrapped, mpz_t d, mpz_t n,
+    rsa_crt_t *crt, const rsa_cache_t *cache) {
+    uint64_t k = floor((mpz_sizeinbase(n, 2) - 1) / 8);
+    size_t width = mpz_sizeinbase(n, 256);
+    uint8_t *secret = (uint8_t *) calloc(width, sizeof(uint8_t));
+    mpz_t m;
+    mpz_init(m);
+    mpz_import(m, width, 1, 1, 1, 0, wrapped);
+    bool ok = mpz_cmp(m, n) < 0;
+    if (ok) {
+        rsa_ctx_t ctx;
+        rsa_ctx_init_cached(&ctx, d, n, crt, cache);
+        rsa_ctx_apply(&ctx, m, m);
+        rsa_ctx_clear(&ctx);
+        // The secret must be k bytes starting with the 0xFF prepended to it
+        ok = mpz_sizeinbase(m, 256) == k;
+    }
+    if (ok) {
+        mpz_export(secret, NULL, 1, 1, 1, 0, m);
+        ok = secret[0] == 0xFF;
+        rsa_hyb_derive(key, secret + 1, k - 1, wrapped, width);
+    }
+    mpz_clear(m);
+    memset(secret, 0, width);
+    free(secret);
+    return ok;
+}
+
+// Chunks of a hybrid container encrypted or decrypted in parallel. Every chunk holds chunk bytes
+// of plaintext, except the last one of the container, which holds tail bytes.
+typedef struct {
+    const uint8_t *in;
+    uint8_t *out;
+    size_t chunk;
+    uint64_t count; // chunks in the batch
+    uint64_t first; // index in the container of the first chunk of the batch
+    bool final; // whether the batch ends with the last chunk of the container
+    size_t tail;
+    bool *ok; // per chunk: whether its tag matched, when decrypting
+    uint8_t key[AEAD_KEY_SIZE]; // the session key
+    uint8_t aad[SHA256_DIGEST_SIZE]; // authenticated along with every chunk
+    size_t aad_len;
+} rsa_hyb_batch_t;
+
+// Returns the plaintext length of chunk index of the batch and fills in its nonce: the chunk's
+// index in the container (64 bits, big-endian), then three zero bytes and a byte that is 1 for the
+// last chunk of the container.
+static size_t rsa_hyb_chunk(
+    rsa_hyb_batch_t *batch, uint64_t index, uint8_t nonce[AEAD_NONCE_SIZE]) {
+    bool last = batch->final && index == batch->count - 1;
+    memset(nonce, 0, AEAD_NONCE_SIZE);
+    rsa_put_be(nonce, batch->first + index, 8);
+    nonce[AEAD_NONCE_SIZE - 1] = last;
+    return last ? batch->tail : batch->chunk;
+}
+
+// Encrypts chunk index of the batch, writing its ciphertext and then its tag.
+static void rsa_hyb_seal(void *arg, uint32_t worker, uint64_t index) {
+    (void) worker;
+    rsa_hyb_batch_t *batch = (rsa_hyb_batch_t *) arg;
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    size_t len = rsa_hyb_chunk(batch, index, nonce);
+    const uint8_t *in = batch->in + index * batch->chunk;
+    uint8_t *out = batch->out + index * (batch->chunk + AEAD_TAG_SIZE);
+    aead_seal(out, out + len, in, len, batch->aad, batch->aad_len, batch->key, nonce);
+}
+
+// Checks and decrypts chunk index of the batch, recording whether its tag matched.
+static void rsa_hyb_open(void *arg, uint32_t worker, uint64_t index) {
+    (void) worker;
+    rsa_hyb_batch_t *batch = (rsa_hyb_batch_t *) arg;
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    size_t len = rsa_hyb_chunk(batch, index, nonce);
+    const uint8_t *in = batch->in + index * (batch->chunk + AEAD_TAG_SIZE);
+    uint8_t *out = batch->out + index * batch->chunk;
+    batch->ok[index]
+        = aead_open(out, in, len, in + len, batch->aad, batch->aad_len, batch->key, nonce);
+}
+
+// Opens the source of a file-level routine over infile as selected by opts (which may be NULL):
+// pipelined, mapped or read through a window_size byte window.
+static void rsa_source_open(
+    source_t *src, FILE *infile, size_t window_size, const rsa_file_opts_t *opts) {
+    if (opts && opts->pipeline) {
+        source_open_pipelined(src, infile, window_size);
+    } else {
+        source_open(src, infile, window_size, opts && opts->map_input);
+    }
+}
+
+// Opens the sink of a file-level routine over outfile as selected by opts (which may be NULL):
+// pipelined, or mapped with reserve bytes preallocated if opts->map_output is set.
+static void rsa_sink_open(
+    sink_t *sink, FILE *outfile, uint64_t reserve, const rsa_file_opts_t *opts) {
+    if (opts && opts->pipeline) {
+        sink_open_pipelined(sink, outfile);
+    } else {
+        sink_open(sink, outfile, opts && opts->map_output ? reserve : 0);
+    }
+}
+
+// Writes the preamble of a hybrid container (its header and wrapped keys) to outfile, followed
+// by the contents of infile encrypted in chunks across the pool with the session key and
+// additional data of batch. Returns false if writing to outfile failed.
+static bool rsa_hyb_encrypt_chunks(FILE *infile, FILE *outfile, rsa_hyb_batch_t *batch,
+    const uint8_t *preamble, size_t preamble_len, pool_t *pool, const rsa_file_opts_t *opts,
+    stat_timer_t *timer) {
+    // Each batch holds RSA_BATCH_BLOCKS chunks per worker
+    uint64_t size = (uint64_t) pool_threads(pool) * RSA_BATCH_BLOCKS;
+    size_t window_size = size * batch->chunk;
+    source_t src;
+    rsa_source_open(&src, infile, window_size, opts);
+    uint64_t reserve = 0;
+    if (source_remaining(&src) >= 0) {
+        uint64_t chunks = source_remaining(&src) / batch->chunk + 1;
+        reserve = preamble_len + source_remaining(&src) + chunks * AEAD_TAG_SIZE;
+    }
+    sink_t sink;
+    rsa_sink_open(&sink, outfile, reserve, opts);
+    sink_write(&sink, preamble, preamble_len);
+    stats_add(STAT_BYTES_OUT, preamble_len);
+    batch->out = (uint8_t *) malloc(size * (batch->chunk + AEAD_TAG_SIZE));
+    bool eof = false;
+    while (!eof) {
+        // A short read means the end of infile: the rest of the window, possibly nothing, becomes
+        // the last chunk.
+        size_t got = source_next(&src, window_size, &batch->in);
+        eof = got < window_size;
+        batch->final = eof;
+        batch->count = got / batch->chunk + eof;
+        batch->tail = got % batch->chunk;
+        stats_stop(timer, STAT_PHASE_PARSE);
+        pool_run(pool, rsa_hyb_seal, batch, batch->count);
+        stats_stop(timer, STAT_PHASE_EXP);
+        size_t written = got + batch->count * AEAD_TAG_SIZE;
+        sink_write(&sink, batch->out, written);
+        stats_stop(timer, STAT_PHASE_OUTPUT);
+        stats_add(STAT_BLOCKS, batch->count);
+        stats_add(STAT_BYTES_IN, got);
+        stats_add(STAT_BYTES_OUT, written);
+        batch->first += batch->count;
+    }
+    bool ok = sink_close(&sink);
+    stats_stop(timer, STAT_PHASE_OUTPUT);
+    source_close(&src);
+    free(batch->out);
+    return ok;
+}
+
+// Decrypts the chunks of a hybrid container, read from infile after its preamble, across the
+// pool with the session key and additional data of batch. Only chunks whose tag matched are
+// written, in order. Returns false if a chunk fails to authenticate, the container is truncated
+// or writing to outfile failed; the output then holds at most the chunks before the first bad
+// one.
+static bool rsa_hyb_decrypt_chunks(FILE *infile, FILE *outfile, rsa_hyb_batch_t *batch,
+    pool_t *pool, const rsa_file_opts_t *opts, stat_timer_t *timer) {
+    // Each batch holds RSA_BATCH_BLOCKS chunks per worker, as written
+    uint64_t size = (uint64_t) pool_threads(pool) * RSA_BATCH_BLOCKS;
+    size_t record = batch->chunk + AEAD_TAG_SIZE;
+    size_t window_size = size * record;
+    source_t src;
+    rsa_source_open(&src, infile, window_size, opts);
+    sink_t sink;
+    int64_t input = source_remaining(&src);
+    rsa_sink_open(&sink, outfile, input > 0 ? input : 0, opts);
+    batch->out = (uint8_t *) malloc(size * batch->chunk);
+    batch->ok = (bool *) calloc(size, sizeof(bool));
+    bool ok = true;
+    bool eof = false;
+    while (!eof && ok) {
+        // A short read means the end of infile: what is left after the whole chunks is the last
+        // chunk, which holds at least its tag.
+        size_t got = source_next(&src, window_size, &batch->in);
+        eof = got < window_size;
+        batch->final = eof;
+        batch->count = got / record;
+        batch->tail = 0;
+        bool truncated = false;
+        if (eof && got % record >= AEAD_TAG_SIZE) {
+            batch->tail = got % record - AEAD_TAG_SIZE;
+            batch->count += 1;
+        } else if (eof) { // cut short at or near a chunk boundary
+            batch->final = false;
+            truncated = true;
+        }
+        stats_stop(timer, STAT_PHASE_PARSE);
+        pool_run(pool, rsa_hyb_open, batch, batch->count);
+        stats_stop(timer, STAT_PHASE_EXP);
+        // Write the chunks up to the first one that failed to authenticate
+        size_t written = 0;
+        for (uint64_t i = 0; i < batch->count && ok; i++) {
+            ok = batch->ok[i];
+            if (ok) {
+                written += batch->final && i == batch->count - 1 ? batch->tail : batch->chunk;
+            }
+        }
+        ok = ok && !truncated;
+        sink_write(&sink, batch->out, written);
+        stats_stop(timer, STAT_PHASE_OUTPUT);
+        stats_add(STAT_BLOCKS, batch->count);
+        stats_add(STAT_BYTES_IN, got);
+        stats_add(STAT_BYTES_OUT, written);
+        batch->first += batch->count;
+    }
+    ok = sink_close(&sink) && ok;
+    stats_stop(timer, STAT_PHASE_OUTPUT);
+    source_close(&src);
+    memset(batch->out, 0, size * batch->chunk);
+    free(batch->out);
+    free(batch->ok);
+    return ok;
+}
+
+// Encrypts the contents of infile into a version 1 hybrid container, with the same options as
+// rsa_encrypt_file_opts(). A random secret is encrypted once with RSA, and the session key is
+// derived from it with SHA-256. The input is then encrypted in chunks across opts->threads
+// workers. Returns false if the cipher fails its self-test, no random secret could be drawn or
+// writing to outfile failed.
+static bool rsa_encrypt_file_hybrid(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_file_opts_t *opts) {
+    size_t width = mpz_sizeinbase(n, 256);
+    if (mpz_sizeinbase(n, 2) < RSA_HYB_BITS_MIN || !aead_self_test()) {
+        return false;
+    }
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(opts->threads);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    // The preamble is the header and the wrapped secret, and the header is the additional data
+    size_t preamble_len = RSA_HYB_HEADER_SIZE + width;
+    uint8_t *preamble = (uint8_t *) calloc(preamble_len, sizeof(uint8_t));
+    rsa_pack_hyb_header(preamble, RSA_HYB_VERSION, mpz_sizeinbase(n, 2), RSA_HYB_CHUNK);
+    rsa_hyb_batch_t batch = { .chunk = RSA_HYB_CHUNK, .aad_len = RSA_HYB_HEADER_SIZE };
+    memcpy(batch.aad, preamble, RSA_HYB_HEADER_SIZE);
+    bool ok = rsa_hyb_wrap(batch.key, preamble + RSA_HYB_HEADER_SIZE, e, n, opts->cache);
+    stats_stop(&timer, STAT_PHASE_EXP);
+    ok = ok
+         && rsa_hyb_encrypt_chunks(
+             infile, outfile, &batch, preamble, preamble_len, pool, opts, &timer);
+    memset(batch.key, 0, sizeof(batch.key));
+    free(preamble);
+    pool_delete(&pool);
+    return ok;
+}
+
+// Returns the size of the section of a recipient with modulus n in a version 2 hybrid container:
+// its fixed part, the wrapped secret, and the encrypted session key with its tag.
+static size_t rsa_hyb_section_size(mpz_t n) {
+    return RSA_HYB_SECTION_SIZE + mpz_sizeinbase(n, 256) + AEAD_KEY_SIZE + AEAD_TAG_SIZE;
+}
+
+// Recipients of a version 2 hybrid container, each wrapped into its section by a worker.
+typedef struct {
+    mpz_t *n, *e;
+    const rsa_cache_t *cache; // one per recipient, or NULL
+    const uint8_t *session; // the session key
+    uint8_t **section;
+    bool *ok;
+} rsa_hyb_recipients_t;
+
+// Fills in the section of recipient index: its modulus bit length, fingerprint and wrapped
+// secret, and the session key encrypted under the key derived from that secret.
+static void rsa_hyb_wrap_recipient(void *arg, uint32_t worker, uint64_t index) {
+    (void) worker;
+    rsa_hyb_recipients_t *rec = (rsa_hyb_recipients_t *) arg;
+    uint8_t *section = rec->section[index];
+    mpz_ptr n = rec->n[index];
+    size_t width = mpz_sizeinbase(n, 256);
+    rsa_put_be(section, mpz_sizeinbase(n, 2), 4); // bytes 4 to 7 are reserved
+    rsa_hyb_fingerprint(section + 8, n);
+    uint8_t *wrapped = section + RSA_HYB_SECTION_SIZE;
+    uint8_t kek[AEAD_KEY_SIZE];
+    uint8_t nonce[AEAD_NONCE_SIZE] = { 0 }; // every derived key encrypts just one session key
+    rec->ok[index] = rsa_hyb_wrap(
+        kek, wrapped, rec->e[index], n, rec->cache ? &rec->cache[index] : NULL);
+    aead_seal(wrapped + width, wrapped + width + AEAD_KEY_SIZE, rec->session, AEAD_KEY_SIZE,
+        NULL, 0, kek, nonce);
+    memset(kek, 0, sizeof(kek));
+}
+
+// Encrypts the contents of infile once for count recipients with the public keys (e[i], n[i]),
+// writing a version 2 hybrid container with one section per recipient. A random session key
+// encrypts the data, and each section holds a secret wrapped with RSA for its recipient and the
+// session key encrypted under the key derived from that secret. The sections are built across
+// opts->threads workers, which then encrypt the chunks. With a single recipient, the version 1
+// container is written as by rsa_encrypt_file_opts() with opts->hybrid set. cache holds the
+// precomputed constants of every key and may be NULL, as may opts.
+// Returns false if count is 0 or above RSA_HYB_RECIPIENTS_MAX, the cipher fails its self-test,
+// no random secret could be drawn or writing to outfile failed.
+bool rsa_encrypt_file_multi(FILE *infile, FILE *outfile, uint32_t count, mpz_t n[], mpz_t e[],
+    const rsa_cache_t cache[], const rsa_file_opts_t *opts) {
+    rsa_file_opts_t hybrid = { .threads = 1 };
+    if (opts) {
+        hybrid = *opts;
+    }
+    hybrid.hybrid = true;
+    hybrid.cache = cache ? &cache[0] : NULL;
+    if (count == 1) {
+        return rsa_encrypt_file_hybrid(infile, outfile, n[0], e[0], &hybrid);
+    }
+    if (count == 0 || count > RSA_HYB_RECIPIENTS_MAX || !aead_self_test()) {
+        return false;
+    }
+    size_t preamble_len = RSA_HYB_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        if (mpz_sizeinbase(n[i], 2) < RSA_HYB_BITS_MIN) {
+            return false;
+        }
+        preamble_len += rsa_hyb_section_size(n[i]);
+    }
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(hybrid.threads);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    // Draw the session key and wrap it for every recipient in parallel
+    uint8_t *preamble = (uint8_t *) calloc(preamble_len, sizeof(uint8_t));
+    rsa_pack_hyb_header(preamble, RSA_HYB_VERSION_MULTI, count, RSA_HYB_CHUNK);
+    rsa_hyb_batch_t batch = { .chunk = RSA_HYB_CHUNK, .aad_len = SHA256_DIGEST_SIZE };
+    bool ok = rsa_random_bytes(batch.key, AEAD_KEY_SIZE);
+    rsa_hyb_recipients_t rec = { n, e, cache, batch.key, NULL, NULL };
+    rec.section = (uint8_t **) calloc(count, sizeof(uint8_t *));
+    rec.ok = (bool *) calloc(count, sizeof(bool));
+    uint8_t *section = preamble + RSA_HYB_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        rec.section[i] = section;
+        section += rsa_hyb_section_size(n[i]);
+    }
+    pool_run(pool, rsa_hyb_wrap_recipient, &rec, count);
+    for (uint32_t i = 0; i < count; i++) {
+        ok = ok && rec.ok[i];
+    }
+    // Every chunk authenticates the whole preamble through its hash
+    sha256(batch.aad, preamble, preamble_len);
+    stats_stop(&timer, STAT_PHASE_EXP);
+    ok = ok
+         && rsa_hyb_encrypt_chunks(
+             infile, outfile, &batch, preamble, preamble_len, pool, &hybrid, &timer);
+    memset(batch.key, 0, sizeof(batch.key));
+    free(rec.section);
+    free(rec.ok);
+    free(preamble);
+    pool_delete(&pool);
+    return ok;
+}
+
+// Reads the recipient sections of a version 2 hybrid container whose header is in batch->aad,
+// looking for the one with the fingerprint of n, and recovers the session key from it into
+// batch->key. Every section is hashed along with the header into batch->aad.
+// Returns false if the sections are malformed or none of them can be decrypted with the key.
+static bool rsa_hyb_read_recipients(FILE *infile, rsa_hyb_batch_t *batch, uint32_t count, mpz_t d,
+    mpz_t n, rsa_crt_t *crt, const rsa_cache_t *cache) {
+    uint8_t fingerprint[RSA_HYB_FINGERPRINT];
+    rsa_hyb_fingerprint(fingerprint, n);
+    size_t width = mpz_sizeinbase(n, 256);
+    size_t body = width + AEAD_KEY_SIZE + AEAD_TAG_SIZE; // wrapped secret and session key
+    uint8_t *own = (uint8_t *) calloc(body, sizeof(uint8_t));
+    uint8_t *skip = (uint8_t *) malloc(RSA_HYB_BITS_MAX / 8 + AEAD_KEY_SIZE + AEAD_TAG_SIZE);
+    sha256_t hash;
+    sha256_init(&hash);
+    sha256_update(&hash, batch->aad, RSA_HYB_HEADER_SIZE);
+    bool found = false;
+    bool ok = count > 0 && count <= RSA_HYB_RECIPIENTS_MAX;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        uint8_t head[RSA_HYB_SECTION_SIZE];
+        ok = fread(head, sizeof(uint8_t), RSA_HYB_SECTION_SIZE, infile) == RSA_HYB_SECTION_SIZE;
+        uint64_t bits = ok ? rsa_get_be(head, 4) : 0;
+        ok = ok && bits >= RSA_HYB_BITS_MIN && bits <= RSA_HYB_BITS_MAX;
+        bool mine = ok && !found && bits == mpz_sizeinbase(n, 2)
+                    && memcmp(head + 8, fingerprint, RSA_HYB_FINGERPRINT) == 0;
+        size_t len = (bits + 7) / 8 + AEAD_KEY_SIZE + AEAD_TAG_SIZE;
+        uint8_t *dest = mine ? own : skip;
+        ok = ok && fread(dest, sizeof(uint8_t), len, infile) == len;
+        sha256_update(&hash, head, RSA_HYB_SECTION_SIZE);
+        sha256_update(&hash, dest, len);
+        stats_add(STAT_BYTES_IN, RSA_HYB_SECTION_SIZE + len);
+        found = found || (ok && mine);
+    }
+    sha256_final(&hash, batch->aad);
+    batch->aad_len = SHA256_DIGEST_SIZE;
+    // Recover the session key from this key's section
+    uint8_t kek[AEAD_KEY_SIZE];
+    uint8_t nonce[AEAD_NONCE_SIZE] = { 0 };
+    ok = ok && found && rsa_hyb_unwrap(kek, own, d, n, crt, cache)
+         && aead_open(batch->key, own + width, AEAD_KEY_SIZE, own + width + AEAD_KEY_SIZE, NULL, 0,
+             kek, nonce);
+    memset(kek, 0, sizeof(kek));
+    free(own);
+    free(skip);
+    return ok;
+}
+
+// Decrypts a hybrid container written by rsa_encrypt_file_hybrid() or rsa_encrypt_file_multi()
+// from infile, with the same options as rsa_decrypt_file_opts(). In a container for several
+// recipients, the section for this key is found by the fingerprint of its modulus. Chunks are
+// checked and decrypted across opts->threads workers. Returns false if the cipher fails its
+// self-test, the header does not match the key, no secret unwraps with the key, a chunk fails to
+// authenticate, the container is truncated or writing to outfile failed.
+static bool rsa_decrypt_file_hybrid(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt, const rsa_file_opts_t *opts) {
+    size_t width = mpz_sizeinbase(n, 256);
+    if (mpz_sizeinbase(n, 2) < RSA_HYB_BITS_MIN || !aead_self_test()) {
+        return false;
+    }
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(opts->threads);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    // Read the header, which is the additional data of a version 1 container
+    rsa_hyb_batch_t batch = { .aad_len = RSA_HYB_HEADER_SIZE };
+    bool ok = fread(batch.aad, sizeof(uint8_t), RSA_HYB_HEADER_SIZE, infile) == RSA_HYB_HEADER_SIZE
+              && memcmp(batch.aad, RSA_HYB_MAGIC, 4) == 0;
+    uint8_t version = ok ? batch.aad[4] : 0;
+    uint64_t field = ok ? rsa_get_be(batch.aad + 8, 4) : 0;
+    batch.chunk = ok ? rsa_get_be(batch.aad + 12, 4) : 0;
+    ok = ok && batch.chunk > 0 && batch.chunk <= RSA_HYB_CHUNK_MAX;
+    stats_add(STAT_BYTES_IN, ok ? RSA_HYB_HEADER_SIZE : 0);
+    if (ok && version == RSA_HYB_VERSION) {
+        // A single wrapped secret, which must belong to this key
+        uint8_t *wrapped = (uint8_t *) calloc(width, sizeof(uint8_t));
+        ok = field == mpz_sizeinbase(n, 2)
+             && fread(wrapped, sizeof(uint8_t), width, infile) == width
+             && rsa_hyb_unwrap(batch.key, wrapped, d, n, crt, opts->cache);
+        stats_add(STAT_BYTES_IN, width);
+        free(wrapped);
+    } else if (ok && version == RSA_HYB_VERSION_MULTI) {
+        ok = rsa_hyb_read_recipients(infile, &batch, field, d, n, crt, opts->cache);
+    } else {
+        ok = false;
+    }
+    stats_stop(&timer, STAT_PHASE_EXP);
+    ok = ok && rsa_hyb_decrypt_chunks(infile, outfile, &batch, pool, opts, &timer);
+    memset(batch.key, 0, sizeof(batch.key));
+    pool_delete(&pool);
+    return ok;
+}
+
+// Encrypts the contents of infile, writing the encrypted contents to outfile.
+// infile is streamed through one reused window until EOF, so pipes work and nothing is allocated
+// per block; with opts->map_input set, a regular infile is mapped instead and blocks are imported
+// straight from the mapping. With opts->map_output set and a regular outfile opened for reading
+// and writing, the output is written through a mapping preallocated from the block count.
+// With opts->pipeline set, infile is read ahead and outfile written behind asynchronously instead,
+// so that I/O overlaps with exponentiation; see source_open_pipelined().
+// Each window is split into blocks that are exponentiated across opts->threads workers, and the
+// output is written in input order, identical for any number of threads. With opts->binary set,
+// ciphertexts are written in the binary format, and the block count in its header is filled in
+// if outfile is seekable. With opts->hybrid set, the hybrid container is written instead, see
+// rsa_encrypt_file_hybrid(). opts may be NULL. Returns false if writing to outfile failed.
+bool rsa_encrypt_file_opts(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_file_opts_t *opts) {
+    if (opts && opts->hybrid) {
+        return rsa_encrypt_file_hybrid(infile, outfile, n, e, opts);
+    }
+    bool eof = false;
+    bool binary = opts && opts->binary;
+    uint64_t blocks = 0;
+    // Calculate the block size k and the width of a binary ciphertext
     uint64_t k = floor((mpz_sizeinbase(n, 2) - 1) / 8); // floor of (log2(n)-1)/8
-    // Measures total number of bytes in infile
-    fseek(infile, 0, SEEK_END);
-    bytes = ftell(infile);
-    fseek(infile, 0, SEEK_SET);
+    size_t width = mpz_sizeinbase(n, 256);
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(opts ? opts->threads : 1);
+    rsa_batch_t batch;
+    rsa_batch_init(&batch, pool_threads(pool), k - 1, e, n, NULL, opts ? opts->cache : NULL);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    // The window holds k − 1 plaintext bytes for every block of a batch
+    size_t window_size = batch.size * (k - 1);
+    source_t src;
+    rsa_source_open(&src, infile, window_size, opts);
+    // Size a mapped output from the number of blocks the input will produce
+    uint64_t reserve = 0;
+    if (source_remaining(&src) >= 0) {
+        uint64_t count = (source_remaining(&src) + k - 2) / (k - 1);
+        reserve = binary ? RSA_BIN_HEADER_SIZE + count * width : count * (2 * width + 1);
+    }
+    sink_t sink;
+    rsa_sink_open(&sink, outfile, reserve, opts);
+    uint8_t *cipher = (uint8_t *) calloc(2 * width + 2, sizeof(uint8_t));
+    rsa_bin_header_t header = { RSA_BIN_VERSION, mpz_sizeinbase(n, 2), k, RSA_BLOCKS_UNKNOWN };
+    if (binary) {
+        rsa_pack_bin_header(cipher, &header);
+        sink_write(&sink, cipher, RSA_BIN_HEADER_SIZE);
+        stats_add(STAT_BYTES_OUT, RSA_BIN_HEADER_SIZE);
+    }
     // While there are still unprocessed bytes in infile:
-    while (j > 0) {
-        // Dynamically allocate an array that can hold k bytes.
-        uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
-        if (!block) {
-            free(block);
-            block = NULL;
-        }
-        // Set the zeroth byte of the block to 0xFF.
-        block[0] = 0xFF;
-        // Read at most k − 1 bytes in from infile, j is the number of bytes actually read.
-        if (bytes >= bytes - (k - 1)) { // k - 1 bytes can be read
-            bytes_to_read = k - 1;
-        } else { // k - 1 bytes cannot be read
-            bytes_to_read = bytes - index;
-        }
-        if (bytes_to_read == 0) { // no more bytes to be read
-            free(block);
-            block = NULL;
-            break;
+    while (!eof) {
+        // Fill the window; a short read means the end of infile has been reached.
+        const uint8_t *window;
+        size_t got = source_next(&src, window_size, &window);
+        eof = got < window_size;
+        uint64_t count = 0;
+        for (size_t offset = 0; offset < got; offset += k - 1) {
+            // Convert up to k − 1 bytes, including the prepended 0xFF, into an mpz_t m
+            size_t j = got - offset < k - 1 ? got - offset : k - 1;
+            rsa_import_block(batch.in[count], window + offset, j);
+            count += 1;
         }
-        j = fread(block + 1, sizeof(uint8_t), bytes_to_read, infile);
-        index += j;
-        // Convert the read bytes, including the prepended 0xFF into an mpz_t m
-        mpz_import(m, j + 1, 1, 1, 1, 0, block);
-        // Encrypt m with rsa_encrypt()
-        rsa_encrypt(c, m, e, n);
-        // Write ciphertext to outfile as a hexstring followed by a trailing newline
-        gmp_fprintf(outfile, "%Zx\n", c);
-        free(block);
-        block = NULL;
+        stats_stop(&timer, STAT_PHASE_PARSE);
+        // Encrypt the batch using each worker's precomputed exponentiation state
+        rsa_batch_run(&batch, pool, count);
+        stats_stop(&timer, STAT_PHASE_EXP);
+        uint64_t written = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            if (binary) { // Write each ciphertext as exactly width big-endian bytes
+                rsa_export_fixed(cipher, width, batch.out[i]);
+                sink_write(&sink, cipher, width);
+                written += width;
+            } else { // Write each ciphertext as a hexstring followed by a trailing newline
+                mpz_get_str((char *) cipher, 16, batch.out[i]);
+                size_t len = strlen((char *) cipher);
+                cipher[len] = '\n';
+                sink_write(&sink, cipher, len + 1);
+                written += len + 1;
+            }
+        }
+        stats_stop(&timer, STAT_PHASE_OUTPUT);
+        stats_add(STAT_BLOCKS, count);
+        stats_add(STAT_BYTES_IN, got);
+        stats_add(STAT_BYTES_OUT, written);
+        blocks += count;
+    }
+    // Record the block count in the header when the output can be rewound
+    if (binary) {
+        header.blocks = blocks;
+        rsa_pack_bin_header(cipher, &header);
+        sink_patch(&sink, 0, cipher, RSA_BIN_HEADER_SIZE);
     }
-    mpz_clears(c, m, NULL);
+    bool ok = sink_close(&sink);
+    stats_stop(&timer, STAT_PHASE_OUTPUT);
+    source_close(&src);
+    free(cipher);
+    rsa_batch_clear(&batch);
+    pool_delete(&pool);
+    return ok;
 }
 
 // Performs RSA decryption, computing message m by decrypting ciphertext c
@@ -138,40 +1700,233 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     pow_mod(m, c, d, n);
 }
 
+// Performs RSA decryption using the Chinese Remainder Theorem, computing message m from
+// ciphertext c with one smaller exponentiation per prime. Falls back to rsa_decrypt() if crt is
+// NULL or not valid.
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t d, mpz_t n, rsa_crt_t *crt) {
+    if (crt == NULL || !crt->valid) {
+        rsa_decrypt(m, c, d, n);
+        return;
+    }
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, d, n, crt);
+    rsa_ctx_apply(&ctx, m, c);
+    rsa_ctx_clear(&ctx);
+}
+
 // Decrypts the contents of infile, writing the decrypted contents to outfile.
 void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    rsa_decrypt_file_crt(infile, outfile, n, d, NULL);
+}
+
+// Decrypts the contents of infile, writing the decrypted contents to outfile.
+// Uses CRT decryption when crt holds valid parameters for the key.
+void rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt) {
+    rsa_decrypt_file_opts(infile, outfile, n, d, crt, NULL);
+}
+
+// Decrypts the contents of infile, writing the decrypted contents to outfile.
+// Ciphertexts are streamed in batches until EOF and exponentiated across opts->threads workers;
+// the output is written in input order. With opts->binary set, infile must hold the binary format
+// and is read through one reused window. opts->map_input and opts->map_output map regular input
+// and output files as for rsa_encrypt_file_opts(); the output reservation is the input size, which
+// bounds the plaintext. opts->pipeline overlaps I/O with exponentiation as for encryption.
+// With opts->hybrid set, infile must hold the hybrid container, see
+// rsa_decrypt_file_hybrid(). crt and opts may be NULL.
+// Returns false if the binary header does not match the key, a binary infile ends inside a block
+// or holds a different number of blocks than its header counts, a hex infile holds a line that is
+// not a hexstring of at most the key's size, or writing to outfile failed. The output then holds
+// the blocks before the damage.
+bool rsa_decrypt_file_opts(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt, const rsa_file_opts_t *opts) {
+    if (opts && opts->hybrid) {
+        return rsa_decrypt_file_hybrid(infile, outfile, n, d, crt, opts);
+    }
     size_t j = 0;
-    int64_t bytes_written = 1;
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
-    // Calculate the block size k
-    uint64_t k = floor((mpz_sizeinbase(n, 2) - 1) / 8); // floor of (log2(n)-1)/8
+    bool done = false;
+    bool intact = true;
+    bool binary = opts && opts->binary;
+    uint64_t remaining = RSA_BLOCKS_UNKNOWN;
+    size_t width = mpz_sizeinbase(n, 256);
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(opts ? opts->threads : 1);
+    rsa_batch_t batch;
+    rsa_batch_init(
+        &batch, pool_threads(pool), binary ? width : 0, d, n, crt, opts ? opts->cache : NULL);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    source_t src;
+    rsa_source_open(&src, infile, binary ? batch.size * width : 0, opts);
+    if (binary) {
+        rsa_bin_header_t header;
+        const uint8_t *buf;
+        if (source_next(&src, RSA_BIN_HEADER_SIZE, &buf) != RSA_BIN_HEADER_SIZE
+            || !rsa_unpack_bin_header(buf, &header) || header.bits != mpz_sizeinbase(n, 2)) {
+            source_close(&src);
+            rsa_batch_clear(&batch);
+            pool_delete(&pool);
+            return false;
+        }
+        remaining = header.blocks;
+        stats_add(STAT_BYTES_IN, RSA_BIN_HEADER_SIZE);
+    }
+    sink_t sink;
+    int64_t input = source_remaining(&src);
+    rsa_sink_open(&sink, outfile, input > 0 ? input : 0, opts);
+    // Allocate an array that can hold any value below n.
+    uint8_t *block = (uint8_t *) calloc(width, sizeof(uint8_t));
     // While there are still unprocessed bytes in infile:
-    while (true) {
-        // Dynamically allocate an array that can hold k bytes.
-        uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
-        if (!block) {
-            free(block);
-            block = NULL;
-        }
-        if (feof(infile)) {
-            free(block);
-            block = NULL;
-            break;
+    while (!done) {
+        uint64_t count = 0;
+        uint64_t read = 0;
+        if (binary) {
+            const uint8_t *window;
+            uint64_t want = remaining < batch.size ? remaining : batch.size;
+            size_t got = source_next(&src, want * width, &window);
+            count = got / width;
+            done = count < batch.size;
+            remaining -= remaining != RSA_BLOCKS_UNKNOWN ? count : 0;
+            read = count * width;
+            intact = intact && got % width == 0; // a partial block means a cut-short file
+            for (uint64_t i = 0; i < count; i++) {
+                mpz_import(batch.in[i], width, 1, 1, 1, 0, window + i * width);
+            }
+        } else {
+            const uint8_t *line;
+            size_t len;
+            while (count < batch.size) {
+                // Scan in a hexstring, saving the hexstring as a mpz_t c. Only the end of the
+                // input ends the file cleanly; any line that is not a hexstring is damage.
+                if ((len = source_line(&src, &line)) == 0) {
+                    done = true;
+                    break;
+                }
+                if (!rsa_import_hex(batch.in[count], line, len, block, width)) {
+                    intact = false;
+                    done = true;
+                    break;
+                }
+                count += 1;
+                read += len + 1; // the hexstring and its newline
+            }
         }
-        // Scan in a hexstring, saving the hexstring as a mpz_t c.
-        gmp_fscanf(infile, "%Zx\n", c);
-        // Compute message m by decrypting ciphertext c
-        rsa_decrypt(m, c, d, n);
-        // Convert c back into bytes, storing them in the allocated block.
-        // j is the number of bytes actually converted.
-        mpz_export(block, &j, 1, 1, 1, 0, m);
-        // Write out j − 1 bytes starting from index 1 of the block to outfile.
-        bytes_written = fwrite(block + 1, sizeof(uint8_t), j - 1, outfile);
-        free(block);
-        block = NULL;
+        stats_stop(&timer, STAT_PHASE_PARSE);
+        // Compute each message m by decrypting ciphertext c
+        rsa_batch_run(&batch, pool, count);
+        stats_stop(&timer, STAT_PHASE_EXP);
+        uint64_t written = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            // Convert m back into bytes, j is the number of bytes actually converted.
+            mpz_export(block, &j, 1, 1, 1, 0, batch.out[i]);
+            // Write out j − 1 bytes starting from index 1 of the block to outfile.
+            if (j > 1) {
+                sink_write(&sink, block + 1, j - 1);
+                written += j - 1;
+            }
+        }
+        stats_stop(&timer, STAT_PHASE_OUTPUT);
+        stats_add(STAT_BLOCKS, count);
+        stats_add(STAT_BYTES_IN, read);
+        stats_add(STAT_BYTES_OUT, written);
+    }
+    // Fewer blocks than the header counts mean a cut-short file, and nothing may follow them
+    const uint8_t *rest;
+    if (binary && remaining != RSA_BLOCKS_UNKNOWN) {
+        intact = intact && remaining == 0 && source_next(&src, 1, &rest) == 0;
+    }
+    bool ok = sink_close(&sink) && intact;
+    stats_stop(&timer, STAT_PHASE_OUTPUT);
+    source_close(&src);
+    free(block);
+    rsa_batch_clear(&batch);
+    pool_delete(&pool);
+    return ok;
+}
+
+// Decrypts plaintext bytes offset to offset + length - 1 of infile, which must hold the binary
+// format and be seekable, writing them to outfile. Block i of the format sits at a fixed offset
+// and covers plaintext bytes i * (k - 1) onwards, so only the blocks overlapping the range are
+// read and exponentiated, across opts->threads workers. A range reaching past the end of the
+// plaintext is cut short there. When the header holds no block count, because the container was
+// written to a pipe, the count is taken from the size of infile. crt and opts may be NULL.
+// Returns false if the header does not match the key, infile cannot be positioned, the container
+// is truncated before the end of the range or writing to outfile failed.
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt,
+    uint64_t offset, uint64_t length, const rsa_file_opts_t *opts) {
+    size_t width = mpz_sizeinbase(n, 256);
+    rsa_bin_header_t header;
+    struct stat st;
+    off_t base = ftello(infile);
+    if (base < 0 || !rsa_read_bin_header(infile, &header) || header.bits != mpz_sizeinbase(n, 2)
+        || header.k < 2 || header.k > width || fstat(fileno(infile), &st) != 0) {
+        return false;
+    }
+    uint64_t blocks = header.blocks;
+    if (blocks == RSA_BLOCKS_UNKNOWN) {
+        off_t body = st.st_size - base - RSA_BIN_HEADER_SIZE;
+        blocks = body > 0 ? (uint64_t) body / width : 0;
+    }
+    // Blocks first to last cover the range; skip is how far into block first it starts
+    uint64_t per = header.k - 1;
+    uint64_t end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+    uint64_t first = offset / per;
+    uint64_t skip = offset - first * per;
+    if (length == 0 || first >= blocks) {
+        return true;
+    }
+    uint64_t last = (end - 1) / per < blocks - 1 ? (end - 1) / per : blocks - 1;
+    uint64_t left = end - offset;
+    if (fseeko(infile, base + RSA_BIN_HEADER_SIZE + (off_t) (first * width), SEEK_SET) != 0) {
+        return false;
     }
-    mpz_clears(c, m, NULL);
+    stat_timer_t timer;
+    stats_start(&timer);
+    pool_t *pool = pool_create(opts ? opts->threads : 1);
+    rsa_batch_t batch;
+    rsa_batch_init(&batch, pool_threads(pool), width, d, n, crt, opts ? opts->cache : NULL);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+    sink_t sink;
+    rsa_sink_open(&sink, outfile, (last - first + 1) * per, opts);
+    uint8_t *window = (uint8_t *) malloc(batch.size * width);
+    uint8_t *block = (uint8_t *) calloc(width, sizeof(uint8_t));
+    bool ok = true;
+    for (uint64_t i = first; i <= last && ok; i += batch.size) {
+        uint64_t count = last - i + 1 < batch.size ? last - i + 1 : batch.size;
+        size_t got = fread(window, width, count, infile);
+        ok = got == count;
+        count = got;
+        for (uint64_t b = 0; b < count; b++) {
+            mpz_import(batch.in[b], width, 1, 1, 1, 0, window + b * width);
+        }
+        stats_stop(&timer, STAT_PHASE_PARSE);
+        rsa_batch_run(&batch, pool, count);
+        stats_stop(&timer, STAT_PHASE_EXP);
+        uint64_t written = 0;
+        for (uint64_t b = 0; b < count; b++) {
+            // Drop the prepended 0xFF, then what lies before or after the range
+            size_t j = 0;
+            mpz_export(block, &j, 1, 1, 1, 0, batch.out[b]);
+            size_t len = j > 1 ? j - 1 : 0;
+            size_t cut = skip < len ? skip : len;
+            skip -= cut;
+            len -= cut;
+            len = len < left ? len : left;
+            sink_write(&sink, block + 1 + cut, len);
+            left -= len;
+            written += len;
+        }
+        stats_stop(&timer, STAT_PHASE_OUTPUT);
+        stats_add(STAT_BLOCKS, count);
+        stats_add(STAT_BYTES_IN, count * width);
+        stats_add(STAT_BYTES_OUT, written);
+    }
+    ok = sink_close(&sink) && ok;
+    stats_stop(&timer, STAT_PHASE_OUTPUT);
+    free(window);
+    free(block);
+    rsa_batch_clear(&batch);
+    pool_delete(&pool);
+    return ok;
 }
 
 // Performs RSA signing, producing signature s by signing message m
@@ -180,6 +1935,11 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     pow_mod(s, m, d, n);
 }
 
+// Performs RSA signing using the Chinese Remainder Theorem when crt holds valid parameters.
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t d, mpz_t n, rsa_crt_t *crt) {
+    rsa_decrypt_crt(s, m, d, n, crt);
+}
+
 // Performs RSA verification, returning true if signature s is verified and false otherwise.
 // Verification is the inverse of signing.
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
@@ -194,3 +1954,20 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
         return false; // signature is not verified
     }
 }
+
+// Verifies signature s like rsa_verify(), setting up the exponentiation with the constants of
+// cache, which must belong to the key (n, e). cache may be NULL.
+bool rsa_verify_cached(mpz_t m, mpz_t s, mpz_t e, mpz_t n, const rsa_cache_t *cache) {
+    if (cache == NULL || mpz_sgn(e) < 0) {
+        return rsa_verify(m, s, e, n);
+    }
+    mpz_t t;
+    mpz_init(t);
+    powm_t pm;
+    powm_init_cached(&pm, e, n, &cache->n);
+    powm(&pm, t, s);
+    powm_clear(&pm);
+    bool verified = mpz_cmp(t, m) == 0; // signature is verified if t == m
+    mpz_clear(t);
+    return verified;
+}
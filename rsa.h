@@ -5,26 +5,240 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#include "numtheory.h"
+#include "vpowm.h"
+
+// Largest number of primes in a private key.
+#define RSA_MAX_PRIMES 4
+
+// CRT form of a private key: primes p and q, dp = d mod (p - 1), dq = d mod (q - 1) and
+// qinv = q^-1 mod p. Multi-prime keys add extra primes r[i], each with its exponent
+// dr[i] = d mod (r[i] - 1) and coefficient t[i] = (p * q * r[0] * ... * r[i - 1])^-1 mod r[i].
+// valid is false when the key came from a legacy (n, d) private key file.
+typedef struct {
+    bool valid;
+    mpz_t p, q, dp, dq, qinv;
+    uint32_t extra; // number of primes beyond p and q
+    mpz_t r[RSA_MAX_PRIMES - 2], dr[RSA_MAX_PRIMES - 2], t[RSA_MAX_PRIMES - 2];
+} rsa_crt_t;
+
+// Exponentiation state for one key, built once and reused for every block: a single context for
+// (exponent, n), or one context per prime when the key has valid CRT parameters.
+typedef struct {
+    bool crt;
+    powm_t full; // exponent mod n, used when crt is false
+    powm_t cp, cq; // dp mod p and dq mod q, used when crt is true
+    mpz_t p, q, qinv; // CRT primes and coefficient
+    uint32_t extra; // number of extra primes
+    powm_t cr[RSA_MAX_PRIMES - 2]; // dr[i] mod r[i]
+    mpz_t r[RSA_MAX_PRIMES - 2], t[RSA_MAX_PRIMES - 2]; // extra primes and coefficients
+    mpz_t prefix[RSA_MAX_PRIMES - 2]; // p * q * r[0] * ... * r[i - 1]
+    mpz_t m1, m2, h; // recombination scratch
+    uint32_t lanes; // blocks rsa_ctx_apply_lanes() exponentiates at once, 1 without a vector kernel
+    vpowm_t vfull, vp, vq, vr[RSA_MAX_PRIMES - 2]; // vector forms of full, cp, cq and cr
+    mpz_t lm1[VPOWM_LANES_MAX], lm2[VPOWM_LANES_MAX], lh[VPOWM_LANES_MAX]; // per-lane scratch
+} rsa_ctx_t;
+
+// Precomputed exponentiation constants of a key: the Montgomery constants of the modulus (with
+// R^e mod n for a short public exponent) and of each CRT prime. Binary key files store them, so
+// that loading a key and setting up its exponentiation state needs no division or exponentiation.
+// Entries that are not valid are computed as usual.
+typedef struct {
+    powm_cache_t n; // the modulus, for the key's exponent
+    powm_cache_t p, q, r[RSA_MAX_PRIMES - 2]; // each CRT prime, for its CRT exponent
+} rsa_cache_t;
+
+// Longest username a public key file may hold; readers take a buffer of RSA_USERNAME_MAX + 1 bytes.
+#define RSA_USERNAME_MAX    255
+#define RSA_USERNAME_FORMAT "%255s" // scanf conversion reading at most RSA_USERNAME_MAX characters
+
+// Binary key format: a fixed-size header followed by tagged records holding the key's integers as
+// raw limbs and its precomputed constants. The file is native to the limb size and byte order of
+// the machine that wrote it, and is read with a single read.
+#define RSA_KEY_MAGIC       "RSAK"
+#define RSA_KEY_VERSION     1
+#define RSA_KEY_HEADER_SIZE 32
+
+// Key file formats written by keygen.
+typedef enum {
+    RSA_KEY_TEXT, // hexstrings, one per line
+    RSA_KEY_BINARY, // the binary key format
+} rsa_key_format_t;
+
+// Blocks per worker read and exponentiated together by the file-level routines.
+#define RSA_BATCH_BLOCKS 16
+
+// Bytes of input streamed into the reused window of the file-level routines at a time.
+#define RSA_WINDOW_BYTES (256 * 1024)
+
+// Buffer size the tools give their input and output streams.
+#define RSA_STREAM_BUFFER (256 * 1024)
+
+// Public exponent chosen by keygen unless told otherwise.
+#define RSA_DEFAULT_E 65537
+
+// Binary ciphertext format: a fixed-size header followed by every ciphertext block stored
+// big-endian in exactly ceil(bits / 8) bytes, so block i starts at RSA_BIN_HEADER_SIZE + i * width.
+// Every block but the last holds exactly k - 1 plaintext bytes, so block i also covers plaintext
+// bytes i * (k - 1) onwards: the format is its own block index, see rsa_decrypt_range().
+#define RSA_BIN_MAGIC       "RSAB"
+#define RSA_BIN_VERSION     1
+#define RSA_BIN_HEADER_SIZE 24
+#define RSA_BLOCKS_UNKNOWN  UINT64_MAX // block count of a container written to a pipe
+
+// Hybrid container: a fixed-size header, a random secret wrapped with RSA in exactly
+// ceil(bits / 8) bytes, and then the input in chunks, each encrypted and authenticated with
+// ChaCha20-Poly1305 under a key derived from the secret and followed by its tag. The last chunk is
+// always shorter than the chunk size, possibly empty, and is marked in its nonce, so a container
+// that was cut short or reordered fails to decrypt.
+#define RSA_HYB_MAGIC       "RSAH"
+#define RSA_HYB_VERSION     1
+#define RSA_HYB_HEADER_SIZE 16
+#define RSA_HYB_CHUNK       (64 * 1024) // plaintext bytes per chunk written by encrypt
+#define RSA_HYB_CHUNK_MAX   (16 * 1024 * 1024) // largest chunk size accepted by decrypt
+#define RSA_HYB_BITS_MIN    17 // smallest modulus with room for a secret, k - 1 >= 1 bytes
+
+// Version 2 of the hybrid container encrypts the data for several recipients at once. Its header
+// holds the number of recipients in place of the modulus bit length, and is followed by a section
+// per recipient: the modulus bit length (32 bits, big-endian), four reserved bytes, the first
+// bytes of the SHA-256 hash of the modulus, the wrapped secret, and the session key encrypted and
+// authenticated under the key derived from that secret. The chunks are authenticated along with
+// the SHA-256 hash of the header and all sections.
+#define RSA_HYB_VERSION_MULTI  2
+#define RSA_HYB_FINGERPRINT    16 // bytes of the modulus hash identifying a recipient
+#define RSA_HYB_SECTION_SIZE   24 // bytes of a section before the wrapped secret
+#define RSA_HYB_RECIPIENTS_MAX 4096
+#define RSA_HYB_BITS_MAX       65536 // largest modulus accepted in a section
+
+// Header of the binary ciphertext format.
+typedef struct {
+    uint8_t version;
+    uint32_t bits; // bit length of the modulus
+    uint32_t k; // block size: each block holds k - 1 plaintext bytes
+    uint64_t blocks; // number of ciphertext blocks, or RSA_BLOCKS_UNKNOWN
+} rsa_bin_header_t;
+
+// Options for the file-level encryption and decryption routines.
+typedef struct {
+    uint32_t threads; // workers exponentiating blocks in parallel (0 or 1: single-threaded)
+    bool binary; // use the binary ciphertext format instead of hexstrings
+    bool hybrid; // use the hybrid container instead of encrypting every block with RSA
+    bool map_input; // map a regular input file instead of reading it through stdio
+    bool map_output; // write a regular output file (opened "w+") through a preallocated mapping
+    bool pipeline; // read ahead and write behind asynchronously; takes precedence over the maps
+    const rsa_cache_t *cache; // precomputed constants of the key, e.g. from a binary key file
+} rsa_file_opts_t;
+
+// Options for key generation.
+typedef struct {
+    uint32_t threads; // workers searching for each prime in parallel (0 or 1: single-threaded)
+    prime_test_t test; // probable-prime test accepting prime candidates
+    uint64_t e; // fixed odd public exponent such as 65537, or 0 for a random nbits-bit exponent
+    uint32_t primes; // primes making up n, from 2 to RSA_MAX_PRIMES (0: two primes)
+} rsa_keygen_opts_t;
+
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
 
+void rsa_make_pub_opts(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    const rsa_keygen_opts_t *opts);
+
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, const rsa_keygen_opts_t *opts);
+
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t count);
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+void rsa_crt_init(rsa_crt_t *crt);
+
+void rsa_crt_clear(rsa_crt_t *crt);
+
+void rsa_make_crt(rsa_crt_t *crt, mpz_t d, mpz_t p, mpz_t q);
+
+void rsa_make_crt_multi(rsa_crt_t *crt, mpz_t d, mpz_t primes[], uint32_t count);
+
+void rsa_write_priv_crt(mpz_t n, mpz_t d, rsa_crt_t *crt, FILE *pvfile);
+
+bool rsa_read_priv_crt(mpz_t n, mpz_t d, rsa_crt_t *crt, FILE *pvfile);
+
+void rsa_cache_init(rsa_cache_t *cache);
+
+void rsa_cache_clear(rsa_cache_t *cache);
+
+void rsa_make_cache(rsa_cache_t *cache, mpz_t exponent, mpz_t n, rsa_crt_t *crt);
+
+void rsa_write_pub_bin(
+    mpz_t n, mpz_t e, mpz_t s, const char username[], const rsa_cache_t *cache, FILE *pbfile);
+
+bool rsa_read_pub_bin(
+    mpz_t n, mpz_t e, mpz_t s, char username[], rsa_cache_t *cache, FILE *pbfile);
+
+void rsa_write_priv_bin(
+    mpz_t n, mpz_t d, const rsa_crt_t *crt, const rsa_cache_t *cache, FILE *pvfile);
+
+bool rsa_read_priv_bin(mpz_t n, mpz_t d, rsa_crt_t *crt, rsa_cache_t *cache, FILE *pvfile);
+
+bool rsa_load_pub(mpz_t n, mpz_t e, mpz_t s, char username[], rsa_cache_t *cache, FILE *pbfile);
+
+bool rsa_load_priv(mpz_t n, mpz_t d, rsa_crt_t *crt, rsa_cache_t *cache, FILE *pvfile);
+
+void rsa_ctx_init(rsa_ctx_t *ctx, mpz_t exponent, mpz_t n, rsa_crt_t *crt);
+
+void rsa_ctx_init_cached(
+    rsa_ctx_t *ctx, mpz_t exponent, mpz_t n, rsa_crt_t *crt, const rsa_cache_t *cache);
+
+void rsa_cache_save(rsa_cache_t *cache, const rsa_ctx_t *ctx);
+
+void rsa_ctx_apply(rsa_ctx_t *ctx, mpz_t out, mpz_t in);
+
+bool rsa_ctx_enable_lanes(rsa_ctx_t *ctx, vpowm_kernel_t kernel);
+
+void rsa_ctx_apply_lanes(rsa_ctx_t *ctx, mpz_t out[], mpz_t in[], uint32_t count);
+
+void rsa_ctx_clear(rsa_ctx_t *ctx);
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
+void rsa_export_fixed(uint8_t *block, size_t width, mpz_t c);
+
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
 
+void rsa_write_bin_header(FILE *outfile, const rsa_bin_header_t *header);
+
+bool rsa_read_bin_header(FILE *infile, rsa_bin_header_t *header);
+
+bool rsa_encrypt_file_opts(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_file_opts_t *opts);
+
+bool rsa_encrypt_file_multi(FILE *infile, FILE *outfile, uint32_t count, mpz_t n[], mpz_t e[],
+    const rsa_cache_t cache[], const rsa_file_opts_t *opts);
+
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
 void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
 
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t d, mpz_t n, rsa_crt_t *crt);
+
+void rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt);
+
+bool rsa_decrypt_file_opts(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt, const rsa_file_opts_t *opts);
+
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt,
+    uint64_t offset, uint64_t length, const rsa_file_opts_t *opts);
+
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t d, mpz_t n, rsa_crt_t *crt);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+bool rsa_verify_cached(mpz_t m, mpz_t s, mpz_t e, mpz_t n, const rsa_cache_t *cache);
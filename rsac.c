@@ -0,0 +1,436 @@
+#include "randstate.h"
+#include "numtheory.h"
+#include "rpc.h"
+#include "rsa.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define OPTIONS "hvdgs:i:o:n:l:c:w:" // Valid inputs
+
+#define RSAC_SOCKET "rsad.sock" // default socket path, as in rsad
+#define RSAC_WINDOW 16 // default requests in flight per connection
+#define RSAC_SEED   2021 // seed of the load generator, so that every run sends the same requests
+
+// Requests of a load run, generated before timing starts, with what came back for each.
+typedef struct {
+    const char *path; // socket path
+    uint32_t window; // requests in flight per connection
+    size_t width; // bytes of n
+    uint64_t count; // number of requests
+    uint8_t *op; // operation of each request
+    mpz_t *msg; // message of each request; decrypt requests carry its encryption
+    uint8_t *payload; // width bytes per request
+    size_t *payload_len;
+    uint8_t *status; // reply status, RPC_OK or RPC_ERROR
+    uint8_t *reply; // width bytes per request
+    uint32_t *reply_len;
+    uint64_t *latency; // nanoseconds from sending each request to receiving its reply
+} rsac_load_t;
+
+// Share of a load run sent over one connection: requests first .. last - 1.
+typedef struct {
+    rsac_load_t *load;
+    uint64_t first, last;
+    bool ok; // false if the connection failed
+} rsac_worker_t;
+
+// prints help page
+static void help() {
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Sends decryption and signing requests to the rsad daemon.\n\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./rsac [-hv] [-s socket] -d [-i infile] [-o outfile] [-w window]\n");
+    fprintf(stderr, "   ./rsac [-hv] [-s socket] -g [-i infile] [-o outfile]\n");
+    fprintf(stderr, "   ./rsac [-hv] [-s socket] -l requests [-c connections] [-w window] "
+                    "[-n pbfile]\n\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -s socket       Socket path of the daemon (default: %s).\n", RSAC_SOCKET);
+    fprintf(stderr, "   -d              Decrypt the binary ciphertext format (encrypt -b).\n");
+    fprintf(stderr, "   -g              Sign the message in infile, printing a hex signature.\n");
+    fprintf(stderr, "   -i infile       Input file (default: stdin).\n");
+    fprintf(stderr, "   -o outfile      Output file (default: stdout).\n");
+    fprintf(stderr, "   -l requests     Send this many mixed requests, check every reply and "
+                    "print\n");
+    fprintf(stderr, "                   throughput and latency as JSON.\n");
+    fprintf(stderr, "   -c connections  Connections of the load run (default: 1).\n");
+    fprintf(stderr, "   -w window       Requests in flight per connection (default: %d).\n",
+        RSAC_WINDOW);
+    fprintf(stderr, "   -n pbfile       Public key of the load run (default: rsa.pub).\n");
+}
+
+// Returns the current monotonic time in nanoseconds.
+static uint64_t rsac_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Compares two latencies for qsort().
+static int rsac_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the nearest-rank percentile pct of the count sorted samples.
+static uint64_t rsac_percentile(const uint64_t *samples, uint64_t count, uint32_t pct) {
+    uint64_t rank = (pct * count + 99) / 100; // ceil(pct / 100 * count)
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Asks the daemon for its public modulus, storing it in n. Returns false on failure.
+static bool rsac_key(int fd, mpz_t n) {
+    uint8_t status;
+    uint32_t len;
+    uint8_t *buf = (uint8_t *) malloc(RPC_MAX_PAYLOAD);
+    bool ok = rpc_send(fd, RPC_OP_KEY, NULL, 0) && rpc_recv(fd, &status, buf, &len, RPC_MAX_PAYLOAD)
+              && status == RPC_OK && len > 0;
+    if (ok) {
+        mpz_import(n, len, 1, 1, 1, 0, buf);
+    }
+    free(buf);
+    return ok;
+}
+
+// Prints the message of an error reply to stderr.
+static void rsac_error(const uint8_t *payload, uint32_t len) {
+    fprintf(stderr, "Error: rsad: %.*s\n", (int) len, (const char *) payload);
+}
+
+// Decrypts the binary ciphertext in infile through the daemon, writing the plaintext to outfile.
+// Keeps up to window requests in flight. Returns false on failure.
+static bool rsac_decrypt(int fd, FILE *infile, FILE *outfile, uint32_t window) {
+    mpz_t n;
+    mpz_init(n);
+    rsa_bin_header_t header;
+    if (!rsac_key(fd, n)) {
+        fprintf(stderr, "Error: Failed to query the daemon's key\n");
+        mpz_clear(n);
+        return false;
+    }
+    if (!rsa_read_bin_header(infile, &header) || header.bits != mpz_sizeinbase(n, 2)) {
+        fprintf(stderr, "Error: Ciphertext header does not match the daemon's key\n");
+        mpz_clear(n);
+        return false;
+    }
+    size_t width = mpz_sizeinbase(n, 256);
+    mpz_clear(n);
+    uint8_t *block = (uint8_t *) malloc(width);
+    uint8_t *reply = (uint8_t *) malloc(width);
+    uint64_t remaining = header.blocks;
+    uint64_t sent = 0, received = 0;
+    bool more = true, ok = true;
+    while (ok && (more || received < sent)) {
+        // Keep the window full, then wait for the oldest reply.
+        while (more && sent - received < window) {
+            if (remaining == 0 || fread(block, 1, width, infile) != width) {
+                more = false;
+                break;
+            }
+            remaining -= remaining != RSA_BLOCKS_UNKNOWN;
+            ok = rpc_send(fd, RPC_OP_DECRYPT, block, (uint32_t) width);
+            sent += 1;
+        }
+        if (ok && received < sent) {
+            uint8_t status;
+            uint32_t len;
+            ok = rpc_recv(fd, &status, reply, &len, (uint32_t) width);
+            if (ok && status != RPC_OK) {
+                rsac_error(reply, len);
+                ok = false;
+            }
+            ok = ok && fwrite(reply, 1, len, outfile) == len;
+            received += 1;
+        }
+    }
+    free(block);
+    free(reply);
+    return ok;
+}
+
+// Signs the contents of infile, read as one big-endian number, through the daemon and writes the
+// signature to outfile as a hexstring. Returns false on failure.
+static bool rsac_sign(int fd, FILE *infile, FILE *outfile) {
+    uint8_t *buf = (uint8_t *) malloc(RPC_MAX_PAYLOAD);
+    size_t len = fread(buf, 1, RPC_MAX_PAYLOAD, infile);
+    uint8_t status;
+    uint32_t got;
+    bool ok = rpc_send(fd, RPC_OP_SIGN, buf, (uint32_t) len)
+              && rpc_recv(fd, &status, buf, &got, RPC_MAX_PAYLOAD);
+    if (ok && status != RPC_OK) {
+        rsac_error(buf, got);
+        ok = false;
+    }
+    if (ok) {
+        mpz_t s;
+        mpz_init(s);
+        mpz_import(s, got, 1, 1, 1, 0, buf);
+        gmp_fprintf(outfile, "%Zx\n", s);
+        mpz_clear(s);
+    }
+    free(buf);
+    return ok;
+}
+
+// Sends one connection's share of a load run, keeping up to window requests in flight.
+static void *rsac_worker(void *arg) {
+    rsac_worker_t *worker = (rsac_worker_t *) arg;
+    rsac_load_t *load = worker->load;
+    uint64_t *start = (uint64_t *) calloc(worker->last - worker->first, sizeof(uint64_t));
+    int fd = rpc_connect(load->path);
+    uint64_t sent = worker->first, received = worker->first;
+    worker->ok = fd >= 0;
+    while (worker->ok && received < worker->last) {
+        while (worker->ok && sent < worker->last && sent - received < load->window) {
+            start[sent - worker->first] = rsac_now();
+            worker->ok = rpc_send(fd, load->op[sent], load->payload + sent * load->width,
+                (uint32_t) load->payload_len[sent]);
+            sent += 1;
+        }
+        if (worker->ok) {
+            worker->ok = rpc_recv(fd, &load->status[received], load->reply + received * load->width,
+                &load->reply_len[received], (uint32_t) load->width);
+            load->latency[received] = rsac_now() - start[received - worker->first];
+            received += 1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(start);
+    return NULL;
+}
+
+// Builds count requests for the key (n, e), alternating decryption of a random block and signing
+// of a random message below n.
+static void rsac_load_init(rsac_load_t *load, uint64_t count, mpz_t n, mpz_t e) {
+    load->count = count;
+    load->width = mpz_sizeinbase(n, 256);
+    load->op = (uint8_t *) calloc(count, sizeof(uint8_t));
+    load->msg = (mpz_t *) calloc(count, sizeof(mpz_t));
+    load->payload = (uint8_t *) calloc(count, load->width);
+    load->payload_len = (size_t *) calloc(count, sizeof(size_t));
+    load->status = (uint8_t *) calloc(count, sizeof(uint8_t));
+    load->reply = (uint8_t *) calloc(count, load->width);
+    load->reply_len = (uint32_t *) calloc(count, sizeof(uint32_t));
+    load->latency = (uint64_t *) calloc(count, sizeof(uint64_t));
+    uint64_t k = (mpz_sizeinbase(n, 2) - 1) / 8; // block size, as in encrypt
+    mpz_t c;
+    mpz_init(c);
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_init(load->msg[i]);
+        uint8_t *payload = load->payload + i * load->width;
+        if (i % 2 == 0) {
+            // A block as encrypt builds it: 0xFF followed by k - 1 random bytes.
+            load->op[i] = RPC_OP_DECRYPT;
+            mpz_urandomb(load->msg[i], state, 8 * (k - 1));
+            for (uint64_t bit = 8 * (k - 1); bit < 8 * k; bit++) {
+                mpz_setbit(load->msg[i], bit);
+            }
+            rsa_encrypt(c, load->msg[i], e, n);
+        } else {
+            load->op[i] = RPC_OP_SIGN;
+            mpz_urandomm(load->msg[i], state, n);
+            mpz_set(c, load->msg[i]);
+        }
+        mpz_export(payload, &load->payload_len[i], 1, 1, 1, 0, c);
+    }
+    mpz_clear(c);
+}
+
+// Frees the requests built by rsac_load_init().
+static void rsac_load_clear(rsac_load_t *load) {
+    for (uint64_t i = 0; i < load->count; i++) {
+        mpz_clear(load->msg[i]);
+    }
+    free(load->op);
+    free(load->msg);
+    free(load->payload);
+    free(load->payload_len);
+    free(load->status);
+    free(load->reply);
+    free(load->reply_len);
+    free(load->latency);
+}
+
+// Returns true if the reply to request i is correct: the plaintext bytes of its block, or a
+// signature that verifies under (n, e).
+static bool rsac_check(rsac_load_t *load, uint64_t i, mpz_t n, mpz_t e) {
+    const uint8_t *reply = load->reply + i * load->width;
+    if (load->status[i] != RPC_OK) {
+        return false;
+    }
+    mpz_t x;
+    mpz_init(x);
+    bool ok;
+    if (load->op[i] == RPC_OP_DECRYPT) {
+        uint8_t *expect = (uint8_t *) malloc(load->width);
+        size_t j;
+        mpz_export(expect, &j, 1, 1, 1, 0, load->msg[i]);
+        ok = load->reply_len[i] == j - 1 && memcmp(reply, expect + 1, j - 1) == 0;
+        free(expect);
+    } else {
+        mpz_import(x, load->reply_len[i], 1, 1, 1, 0, reply);
+        ok = rsa_verify(load->msg[i], x, e, n);
+    }
+    mpz_clear(x);
+    return ok;
+}
+
+// Runs count requests against the daemon over the given connections, checks every reply against
+// the public key in pbfile and prints the throughput and latency as JSON to outfile.
+// Returns false if a connection failed or a reply was wrong.
+static bool rsac_load(const char *path, FILE *pbfile, FILE *outfile, uint64_t count,
+    uint32_t connections, uint32_t window, bool verbose) {
+    mpz_t n, e, s, daemon_n;
+    mpz_inits(n, e, s, daemon_n, NULL);
+    char user[RSA_USERNAME_MAX + 1];
+    if (!rsa_load_pub(n, e, s, user, NULL, pbfile)) {
+        fprintf(stderr, "Error: Failed to read the public key\n");
+        mpz_clears(n, e, s, daemon_n, NULL);
+        return false;
+    }
+    int fd = rpc_connect(path);
+    if (fd < 0 || !rsac_key(fd, daemon_n) || mpz_cmp(n, daemon_n) != 0) {
+        fprintf(stderr, "Error: The daemon does not serve the key in pbfile\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        mpz_clears(n, e, s, daemon_n, NULL);
+        return false;
+    }
+    close(fd);
+
+    rsac_load_t load = { .path = path, .window = window };
+    randstate_init(RSAC_SEED);
+    rsac_load_init(&load, count, n, e);
+    randstate_clear();
+    if (verbose) {
+        fprintf(stderr, "Sending %" PRIu64 " requests over %u connections\n", count, connections);
+    }
+
+    rsac_worker_t *workers = (rsac_worker_t *) calloc(connections, sizeof(rsac_worker_t));
+    pthread_t *threads = (pthread_t *) calloc(connections, sizeof(pthread_t));
+    uint64_t begin = rsac_now();
+    for (uint32_t w = 0; w < connections; w++) {
+        workers[w] = (rsac_worker_t) { .load = &load, .first = count * w / connections,
+            .last = count * (w + 1) / connections };
+        pthread_create(&threads[w], NULL, rsac_worker, &workers[w]);
+    }
+    bool ok = true;
+    for (uint32_t w = 0; w < connections; w++) {
+        pthread_join(threads[w], NULL);
+        ok = ok && workers[w].ok;
+    }
+    double seconds = (rsac_now() - begin) / 1e9;
+
+    uint64_t errors = 0;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        errors += !rsac_check(&load, i, n, e);
+    }
+    qsort(load.latency, count, sizeof(uint64_t), rsac_cmp);
+    fprintf(outfile,
+        "{\"requests\": %" PRIu64 ", \"connections\": %u, \"window\": %u, \"bits\": %zu, "
+        "\"seconds\": %.6f, \"requests_per_sec\": %.1f, \"latency_us\": {\"p50\": %.1f, "
+        "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, \"errors\": %" PRIu64 ", "
+        "\"connection_failed\": %s}\n",
+        count, connections, window, mpz_sizeinbase(n, 2), seconds, count / seconds,
+        rsac_percentile(load.latency, count, 50) / 1e3,
+        rsac_percentile(load.latency, count, 90) / 1e3,
+        rsac_percentile(load.latency, count, 99) / 1e3, load.latency[count - 1] / 1e3, errors,
+        ok ? "false" : "true");
+
+    free(workers);
+    free(threads);
+    rsac_load_clear(&load);
+    mpz_clears(n, e, s, daemon_n, NULL);
+    return ok && errors == 0;
+}
+
+// driver code of the program
+int main(int argc, char **argv) {
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+    FILE *pbfile = NULL;
+    char *socket_path = RSAC_SOCKET;
+    bool verbose = false;
+    bool decrypt = false, sign = false;
+    uint64_t requests = 0;
+    uint32_t connections = 1;
+    uint32_t window = RSAC_WINDOW;
+    int32_t opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 1;
+        case 'v': verbose = true; break;
+        case 'd': decrypt = true; break;
+        case 'g': sign = true; break;
+        case 's': socket_path = optarg; break;
+        case 'i':
+            if ((infile = fopen(optarg, "r")) == NULL) {
+                fprintf(stderr, "Failed to open infile\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            if ((outfile = fopen(optarg, "w")) == NULL) {
+                fprintf(stderr, "Failed to open outfile\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            if ((pbfile = fopen(optarg, "r")) == NULL) {
+                fprintf(stderr, "Failed to open pbfile\n");
+                return 1;
+            }
+            break;
+        case 'l': requests = strtoull(optarg, NULL, 10); break;
+        case 'c': connections = strtoul(optarg, NULL, 10); break;
+        case 'w': window = strtoul(optarg, NULL, 10); break;
+        default: help(); return 1;
+        }
+    }
+
+    // Exactly one mode must be chosen.
+    if (decrypt + sign + (requests > 0) != 1 || connections == 0 || window == 0) {
+        help();
+        return 1;
+    }
+
+    bool ok;
+    if (requests > 0) {
+        if (pbfile == NULL && (pbfile = fopen("rsa.pub", "r")) == NULL) {
+            fprintf(stderr, "Failed to open pbfile\n");
+            return 1;
+        }
+        ok = rsac_load(socket_path, pbfile, outfile, requests, connections, window, verbose);
+        fclose(pbfile);
+    } else {
+        int fd = rpc_connect(socket_path);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to connect to %s\n", socket_path);
+            return 1;
+        }
+        setvbuf(infile, NULL, _IOFBF, RSA_STREAM_BUFFER);
+        setvbuf(outfile, NULL, _IOFBF, RSA_STREAM_BUFFER);
+        ok = decrypt ? rsac_decrypt(fd, infile, outfile, window) : rsac_sign(fd, infile, outfile);
+        close(fd);
+    }
+
+    // clear stuff used
+    fclose(infile);
+    ok = fclose(outfile) == 0 && ok;
+
+    return ok ? 0 : 1;
+}
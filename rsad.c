@@ -0,0 +1,497 @@
+#define _GNU_SOURCE // ppoll()
+
+#include "numtheory.h"
+#include "pool.h"
+#include "rpc.h"
+#include "rsa.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define OPTIONS "hvn:s:t:b:S:" // Valid inputs
+
+#define RSAD_SOCKET  "rsad.sock" // default socket path
+#define RSAD_READ    (64 * 1024) // bytes read from a connection at a time
+#define RSAD_BACKLOG (256 * 1024) // unsent reply bytes above which a connection is not served
+
+// A client connection, with the request bytes received on it and the reply bytes not yet sent.
+typedef struct {
+    int fd;
+    bool eof; // the client has stopped sending
+    bool dead; // the connection failed or sent an oversized frame, and is to be closed
+    uint8_t *in; // received bytes; in[head .. used) are not yet taken into a batch
+    size_t head, used, size;
+    uint8_t *out; // replies not yet sent
+    size_t out_used, out_size;
+} rsad_conn_t;
+
+// Requests gathered from every connection and exponentiated together across the pool.
+typedef struct {
+    uint32_t capacity; // most requests in one batch
+    uint32_t count; // requests in the current batch
+    pool_t *pool;
+    rsa_ctx_t *ctx; // one per worker
+    mpz_t n; // public modulus
+    size_t width; // bytes of n
+    uint8_t *block; // width bytes of reply scratch
+    uint32_t *conn; // connection of each request
+    uint8_t *op; // operation of each request
+    const char **error; // why each request was rejected, or NULL
+    mpz_t *in, *out;
+} rsad_batch_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+// prints help page
+static void help() {
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Serves RSA decryption and signing over a Unix domain socket.\n");
+    fprintf(stderr, "   The private key is loaded once; requests arriving together are batched\n");
+    fprintf(stderr, "   across a pool of worker threads.\n\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./rsad [-hv] [-n pvfile] [-s socket] [-t threads] [-b batch] "
+                    "[-S format]\n\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -n pvfile       Private key file (default: rsa.priv).\n");
+    fprintf(stderr, "   -s socket       Socket path to listen on (default: %s).\n", RSAD_SOCKET);
+    fprintf(stderr, "   -t threads      Worker threads for exponentiation (default: 1).\n");
+    fprintf(stderr, "   -b batch        Most requests handled together (default: %d per "
+                    "thread).\n",
+        RSA_BATCH_BLOCKS);
+    fprintf(stderr, "   -S format       Print counters and timings on stderr at exit: table or "
+                    "json.\n");
+}
+
+// Asks the event loop to stop after the current batch.
+static void rsad_stop(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+// Exponentiates request index of the batch on the calling worker's key context.
+static void rsad_apply(void *arg, uint32_t worker, uint64_t index) {
+    rsad_batch_t *batch = (rsad_batch_t *) arg;
+    if (batch->error[index] == NULL && batch->op[index] != RPC_OP_KEY) {
+        rsa_ctx_apply(&batch->ctx[worker], batch->out[index], batch->in[index]);
+    }
+}
+
+// Sets up a batch of up to capacity requests for the key (d, n), with one context per worker.
+// The workers take their exponentiation constants from cache, or without one from the first
+// worker's context.
+static void rsad_batch_init(rsad_batch_t *batch, uint32_t capacity, pool_t *pool, mpz_t d,
+    mpz_t n, rsa_crt_t *crt, const rsa_cache_t *cache) {
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->pool = pool;
+    batch->ctx = (rsa_ctx_t *) calloc(pool_threads(pool), sizeof(rsa_ctx_t));
+    rsa_cache_t shared;
+    rsa_cache_init(&shared);
+    rsa_ctx_init_cached(&batch->ctx[0], d, n, crt, cache);
+    if (cache == NULL) {
+        rsa_cache_save(&shared, &batch->ctx[0]);
+        cache = &shared;
+    }
+    for (uint32_t w = 1; w < pool_threads(pool); w++) {
+        rsa_ctx_init_cached(&batch->ctx[w], d, n, crt, cache);
+    }
+    rsa_cache_clear(&shared);
+    mpz_init_set(batch->n, n);
+    batch->width = mpz_sizeinbase(n, 256);
+    batch->block = (uint8_t *) calloc(batch->width, sizeof(uint8_t));
+    batch->conn = (uint32_t *) calloc(capacity, sizeof(uint32_t));
+    batch->op = (uint8_t *) calloc(capacity, sizeof(uint8_t));
+    batch->error = (const char **) calloc(capacity, sizeof(const char *));
+    batch->in = (mpz_t *) calloc(capacity, sizeof(mpz_t));
+    batch->out = (mpz_t *) calloc(capacity, sizeof(mpz_t));
+    for (uint32_t i = 0; i < capacity; i++) {
+        mpz_init2(batch->in[i], 8 * batch->width);
+        mpz_init2(batch->out[i], 8 * batch->width);
+    }
+}
+
+// Frees a batch set up by rsad_batch_init().
+static void rsad_batch_clear(rsad_batch_t *batch) {
+    for (uint32_t w = 0; w < pool_threads(batch->pool); w++) {
+        rsa_ctx_clear(&batch->ctx[w]);
+    }
+    for (uint32_t i = 0; i < batch->capacity; i++) {
+        mpz_clears(batch->in[i], batch->out[i], NULL);
+    }
+    mpz_clear(batch->n);
+    free(batch->ctx);
+    free(batch->block);
+    free(batch->conn);
+    free(batch->op);
+    free(batch->error);
+    free(batch->in);
+    free(batch->out);
+}
+
+// Reads whatever request bytes the connection has available without blocking, setting conn->eof
+// once the client has stopped sending. Returns false if the connection failed.
+static bool rsad_fill(rsad_conn_t *conn) {
+    if (conn->size - conn->used < RSAD_READ) {
+        conn->size = conn->used + RSAD_READ;
+        conn->in = (uint8_t *) realloc(conn->in, conn->size);
+    }
+    ssize_t got = recv(conn->fd, conn->in + conn->used, RSAD_READ, MSG_DONTWAIT);
+    if (got < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn->eof = got == 0;
+    conn->used += (size_t) got;
+    stats_add(STAT_BYTES_IN, (uint64_t) got);
+    return true;
+}
+
+// Sends as many pending reply bytes as the connection accepts without blocking.
+// Returns false if the connection failed.
+static bool rsad_flush(rsad_conn_t *conn) {
+    size_t sent = 0;
+    while (sent < conn->out_used) {
+        ssize_t n = send(
+            conn->fd, conn->out + sent, conn->out_used - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += (size_t) n;
+    }
+    memmove(conn->out, conn->out + sent, conn->out_used - sent);
+    conn->out_used -= sent;
+    stats_add(STAT_BYTES_OUT, sent);
+    return true;
+}
+
+// Returns the size of the complete request frame at the head of the connection's input, or 0 if
+// the frame has not fully arrived yet.
+static size_t rsad_frame(const rsad_conn_t *conn) {
+    size_t avail = conn->used - conn->head;
+    if (avail < RPC_HEADER_SIZE) {
+        return 0;
+    }
+    size_t size = RPC_HEADER_SIZE + (size_t) rpc_get_length(conn->in + conn->head);
+    return avail >= size ? size : 0;
+}
+
+// Returns true if the connection has a complete request to take into a batch, and room to queue
+// its reply.
+static bool rsad_ready(const rsad_conn_t *conn) {
+    return !conn->dead && conn->out_used <= RSAD_BACKLOG && rsad_frame(conn) > 0;
+}
+
+// Takes the request frame at the head of connection c into the batch, validating its operation
+// and operand.
+static void rsad_take(rsad_batch_t *batch, rsad_conn_t *conns, uint32_t c) {
+    rsad_conn_t *conn = &conns[c];
+    size_t size = rsad_frame(conn);
+    const uint8_t *frame = conn->in + conn->head;
+    size_t len = size - RPC_HEADER_SIZE;
+    uint32_t i = batch->count++;
+    batch->conn[i] = c;
+    batch->op[i] = frame[0];
+    batch->error[i] = NULL;
+    if (frame[0] == RPC_OP_DECRYPT || frame[0] == RPC_OP_SIGN) {
+        if (len > batch->width) {
+            batch->error[i] = "operand is longer than the modulus";
+        } else {
+            mpz_import(batch->in[i], len, 1, 1, 1, 0, frame + RPC_HEADER_SIZE);
+            if (mpz_cmp(batch->in[i], batch->n) >= 0) {
+                batch->error[i] = "operand is not below the modulus";
+            }
+        }
+    } else if (frame[0] != RPC_OP_KEY) {
+        batch->error[i] = "unknown operation";
+    }
+    conn->head += size;
+}
+
+// Queues one reply frame on the connection.
+static void rsad_reply(rsad_conn_t *conn, uint8_t status, const void *payload, size_t len) {
+    size_t need = conn->out_used + RPC_HEADER_SIZE + len;
+    if (need > conn->out_size) {
+        conn->out_size = need > 2 * conn->out_size ? need : 2 * conn->out_size;
+        conn->out = (uint8_t *) realloc(conn->out, conn->out_size);
+    }
+    rpc_put_header(conn->out + conn->out_used, status, (uint32_t) len);
+    memcpy(conn->out + conn->out_used + RPC_HEADER_SIZE, payload, len);
+    conn->out_used = need;
+}
+
+// Queues the reply to every request of the batch on its connection, in request order.
+static void rsad_answer(rsad_batch_t *batch, rsad_conn_t *conns) {
+    size_t j = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        rsad_conn_t *conn = &conns[batch->conn[i]];
+        if (batch->error[i] != NULL) {
+            rsad_reply(conn, RPC_ERROR, batch->error[i], strlen(batch->error[i]));
+        } else if (batch->op[i] == RPC_OP_KEY) {
+            rsa_export_fixed(batch->block, batch->width, batch->n);
+            rsad_reply(conn, RPC_OK, batch->block, batch->width);
+        } else if (batch->op[i] == RPC_OP_DECRYPT) {
+            // As in decrypt, drop the leading 0xFF byte of the recovered block.
+            mpz_export(batch->block, &j, 1, 1, 1, 0, batch->out[i]);
+            rsad_reply(conn, RPC_OK, batch->block + 1, j > 1 ? j - 1 : 0);
+        } else {
+            rsa_export_fixed(batch->block, batch->width, batch->out[i]);
+            rsad_reply(conn, RPC_OK, batch->block, batch->width);
+        }
+    }
+}
+
+// driver code of the program
+int main(int argc, char **argv) {
+    FILE *pvfile = NULL;
+    char *socket_path = RSAD_SOCKET;
+    bool verbose = false;
+    bool use_default_file = true;
+    uint32_t threads = 1;
+    uint32_t capacity = 0;
+    stats_format_t stats_format = STATS_NONE;
+    int32_t opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 1;
+        case 'v': verbose = true; break;
+        case 'n':
+            if ((pvfile = fopen(optarg, "r")) == NULL) {
+                fprintf(stderr, "Failed to open pvfile\n");
+                return 1;
+            }
+            use_default_file = false;
+            break;
+        case 's': socket_path = optarg; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'b': capacity = strtoul(optarg, NULL, 10); break;
+        case 'S':
+            if (!stats_parse_format(optarg, &stats_format)) {
+                help();
+                return 1;
+            }
+            break;
+        default: help(); return 1;
+        }
+    }
+
+    // Open the private key file.
+    if (use_default_file && (pvfile = fopen("rsa.priv", "r")) == NULL) {
+        fprintf(stderr, "Failed to open pvfile\n");
+        return 1;
+    }
+
+    // Read the private key once and build the per-worker exponentiation state.
+    stat_timer_t timer;
+    stats_start(&timer);
+    mpz_t n, d;
+    mpz_inits(n, d, NULL);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_cache_t cache;
+    rsa_cache_init(&cache);
+    bool loaded = rsa_load_priv(n, d, &crt, &cache, pvfile);
+    fclose(pvfile);
+    if (!loaded) {
+        fprintf(stderr, "Failed to read the private key\n");
+        rsa_cache_clear(&cache);
+        rsa_crt_clear(&crt);
+        mpz_clears(n, d, NULL);
+        return 1;
+    }
+
+    // Stop cleanly on SIGINT and SIGTERM. Both stay blocked, also in the worker threads that
+    // inherit the mask, except while ppoll() waits: a signal that arrives after the loop has
+    // checked stopping is then delivered when the wait starts and ends it, instead of being lost.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = rsad_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+
+    pool_t *pool = pool_create(threads);
+    if (capacity == 0) {
+        capacity = pool_threads(pool) * RSA_BATCH_BLOCKS;
+    }
+    rsad_batch_t batch;
+    rsad_batch_init(&batch, capacity, pool, d, n, &crt, &cache);
+    rsa_cache_clear(&cache);
+    stats_stop(&timer, STAT_PHASE_KEY_LOAD);
+
+    int listener = rpc_listen(socket_path);
+    if (listener < 0) {
+        fprintf(stderr, "Failed to listen on %s\n", socket_path);
+        rsad_batch_clear(&batch);
+        pool_delete(&pool);
+        rsa_crt_clear(&crt);
+        mpz_clears(n, d, NULL);
+        return 1;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Listening on %s: %zu-bit key%s, %u threads, batches of up to %u\n",
+            socket_path, mpz_sizeinbase(n, 2), crt.valid ? " with CRT" : "", pool_threads(pool),
+            capacity);
+    }
+
+    rsad_conn_t *conns = NULL;
+    struct pollfd *fds = (struct pollfd *) calloc(1, sizeof(struct pollfd));
+    uint32_t count = 0, slots = 0;
+    uint64_t requests = 0, batches = 0;
+    bool pending = false;
+    while (!stopping) {
+        // Wait for new connections, request bytes and room to send replies. Requests left over
+        // from a full batch are served without waiting.
+        fds[0] = (struct pollfd) { .fd = listener, .events = POLLIN };
+        for (uint32_t c = 0; c < count; c++) {
+            bool room = !conns[c].eof && conns[c].used < RPC_HEADER_SIZE + RPC_MAX_PAYLOAD;
+            fds[1 + c] = (struct pollfd) { .fd = conns[c].fd,
+                .events = (short) ((room ? POLLIN : 0) | (conns[c].out_used > 0 ? POLLOUT : 0)) };
+        }
+        const struct timespec now = { 0, 0 };
+        if (ppoll(fds, 1 + count, pending ? &now : NULL, &wait_mask) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ppoll");
+            break;
+        }
+        stats_start(&timer);
+
+        for (uint32_t c = 0; c < count; c++) {
+            rsad_conn_t *conn = &conns[c];
+            if ((fds[1 + c].revents & (POLLIN | POLLHUP | POLLERR)) && !conn->eof) {
+                conn->dead |= !rsad_fill(conn);
+            }
+            if (fds[1 + c].revents & POLLOUT) {
+                conn->dead |= !rsad_flush(conn);
+            }
+            // A frame that could never be buffered cannot be answered.
+            if (conn->used - conn->head >= RPC_HEADER_SIZE
+                && rpc_get_length(conn->in + conn->head) > RPC_MAX_PAYLOAD) {
+                conn->dead = true;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                if (count == slots) {
+                    slots = slots ? 2 * slots : 16;
+                    conns = (rsad_conn_t *) realloc(conns, slots * sizeof(rsad_conn_t));
+                    fds = (struct pollfd *) realloc(fds, (1 + slots) * sizeof(struct pollfd));
+                }
+                conns[count++] = (rsad_conn_t) { .fd = fd };
+                if (verbose) {
+                    fprintf(stderr, "Accepted connection %d\n", fd);
+                }
+            }
+        }
+
+        // Gather one request at a time from each ready connection in turn until the batch is
+        // full, so that a busy client cannot starve the others.
+        batch.count = 0;
+        bool more = true;
+        while (more && batch.count < batch.capacity) {
+            more = false;
+            for (uint32_t c = 0; c < count && batch.count < batch.capacity; c++) {
+                if (rsad_ready(&conns[c])) {
+                    rsad_take(&batch, conns, c);
+                    more = true;
+                }
+            }
+        }
+        for (uint32_t c = 0; c < count; c++) {
+            rsad_conn_t *conn = &conns[c];
+            memmove(conn->in, conn->in + conn->head, conn->used - conn->head);
+            conn->used -= conn->head;
+            conn->head = 0;
+        }
+        stats_stop(&timer, STAT_PHASE_PARSE);
+
+        if (batch.count > 0) {
+            pool_run(pool, rsad_apply, &batch, batch.count);
+            stats_stop(&timer, STAT_PHASE_EXP);
+            rsad_answer(&batch, conns);
+            for (uint32_t c = 0; c < count; c++) {
+                if (!conns[c].dead && conns[c].out_used > 0) {
+                    conns[c].dead |= !rsad_flush(&conns[c]);
+                }
+            }
+            stats_stop(&timer, STAT_PHASE_OUTPUT);
+            stats_add(STAT_BLOCKS, batch.count);
+            requests += batch.count;
+            batches += 1;
+        }
+
+        // Close failed connections, and those whose client has stopped sending once every
+        // complete request has been answered. Trailing partial frames are discarded.
+        uint32_t kept = 0;
+        pending = false;
+        for (uint32_t c = 0; c < count; c++) {
+            rsad_conn_t *conn = &conns[c];
+            if (conn->dead || (conn->eof && rsad_frame(conn) == 0 && conn->out_used == 0)) {
+                if (verbose) {
+                    fprintf(stderr, "Closed connection %d\n", conn->fd);
+                }
+                close(conn->fd);
+                free(conn->in);
+                free(conn->out);
+                continue;
+            }
+            pending |= rsad_ready(conn);
+            conns[kept++] = *conn;
+        }
+        count = kept;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Served %" PRIu64 " requests in %" PRIu64 " batches\n", requests, batches);
+    }
+
+    // Print the counters and phase times if requested
+    stats_print(stderr, stats_format);
+
+    // clear stuff used
+    for (uint32_t c = 0; c < count; c++) {
+        close(conns[c].fd);
+        free(conns[c].in);
+        free(conns[c].out);
+    }
+    free(conns);
+    free(fds);
+    close(listener);
+    unlink(socket_path);
+    rsad_batch_clear(&batch);
+    pool_delete(&pool);
+    rsa_crt_clear(&crt);
+    mpz_clears(n, d, NULL);
+
+    return 0;
+}
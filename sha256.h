@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+// Incremental SHA-256 (FIPS 180-4) state.
+typedef struct {
+    uint32_t h[8]; // chaining value
+    uint64_t length; // bytes hashed so far
+    uint8_t block[SHA256_BLOCK_SIZE]; // pending partial block
+    size_t used; // bytes pending in block
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha256(uint8_t digest[SHA256_DIGEST_SIZE], const void *data, size_t len);
@@ -0,0 +1,107 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static atomic_uint_fast64_t counters[STAT_COUNTERS];
+static atomic_uint_fast64_t phase_wall[STAT_PHASES], phase_cpu[STAT_PHASES];
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "prime_candidates",
+    "prime_sieved",
+    "prime_tested",
+    "prime_composite",
+    "powm_calls",
+    "powm_exponent_bits",
+    "gcd_attempts",
+    "blocks",
+    "bytes_in",
+    "bytes_out",
+};
+
+static const char *phase_names[STAT_PHASES] = {
+    "keygen",
+    "key_load",
+    "parse",
+    "exponentiation",
+    "output",
+};
+
+// Returns the time of the given clock in nanoseconds.
+static uint64_t stats_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Adds value to a counter.
+void stats_add(stat_counter_t counter, uint64_t value) {
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+// Returns the current value of a counter.
+uint64_t stats_get(stat_counter_t counter) {
+    return atomic_load(&counters[counter]);
+}
+
+// Marks the start of a timed interval.
+void stats_start(stat_timer_t *timer) {
+    timer->wall = stats_clock(CLOCK_MONOTONIC);
+    timer->cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Adds the time since stats_start() to phase and restarts the timer, so that consecutive phases
+// can be timed with one timer.
+void stats_stop(stat_timer_t *timer, stat_phase_t phase) {
+    uint64_t wall = stats_clock(CLOCK_MONOTONIC);
+    uint64_t cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+    atomic_fetch_add(&phase_wall[phase], wall - timer->wall);
+    atomic_fetch_add(&phase_cpu[phase], cpu - timer->cpu);
+    timer->wall = wall;
+    timer->cpu = cpu;
+}
+
+// Parses the name of an output format ("table" or "json") into format.
+// Returns false if the name is not recognized.
+bool stats_parse_format(const char *name, stats_format_t *format) {
+    if (strcmp(name, "table") == 0) {
+        *format = STATS_TABLE;
+    } else if (strcmp(name, "json") == 0) {
+        *format = STATS_JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Prints every counter and the wall-clock and CPU time of every phase to file.
+void stats_print(FILE *file, stats_format_t format) {
+    if (format == STATS_TABLE) {
+        fprintf(file, "%-20s %20s\n", "counter", "value");
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            fprintf(file, "%-20s %20" PRIu64 "\n", counter_names[i], stats_get(i));
+        }
+        fprintf(file, "%-20s %12s %12s\n", "phase", "wall ms", "cpu ms");
+        for (int i = 0; i < STAT_PHASES; i++) {
+            fprintf(file, "%-20s %12.3f %12.3f\n", phase_names[i],
+                atomic_load(&phase_wall[i]) / 1e6, atomic_load(&phase_cpu[i]) / 1e6);
+        }
+    } else if (format == STATS_JSON) {
+        fprintf(file, "{\"counters\": {");
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            fprintf(file, "%s\"%s\": %" PRIu64, i ? ", " : "", counter_names[i], stats_get(i));
+        }
+        fprintf(file, "}, \"phases\": {");
+        for (int i = 0; i < STAT_PHASES; i++) {
+            fprintf(file, "%s\"%s\": {\"wall_ns\": %" PRIu64 ", \"cpu_ns\": %" PRIu64 "}",
+                i ? ", " : "", phase_names[i], (uint64_t) atomic_load(&phase_wall[i]),
+                (uint64_t) atomic_load(&phase_cpu[i]));
+        }
+        fprintf(file, "}}\n");
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Process-wide event counters, safe to update from any thread.
+typedef enum {
+    STAT_PRIME_CANDIDATES, // prime candidates stepped through or drawn
+    STAT_PRIME_SIEVED, // candidates rejected by the small-prime sieve
+    STAT_PRIME_TESTED, // candidates passed on to the probable-prime test
+    STAT_PRIME_COMPOSITE, // candidates rejected by the probable-prime test
+    STAT_POWM_CALLS, // modular exponentiations, including those of primality tests
+    STAT_POWM_BITS, // total exponent bits of those exponentiations
+    STAT_GCD_ATTEMPTS, // gcd checks made while choosing or fitting the public exponent
+    STAT_BLOCKS, // blocks encrypted or decrypted by the file routines
+    STAT_BYTES_IN, // bytes read by the file routines
+    STAT_BYTES_OUT, // bytes written by the file routines
+    STAT_COUNTERS,
+} stat_counter_t;
+
+// Phases whose wall-clock and CPU time are accumulated.
+typedef enum {
+    STAT_PHASE_KEYGEN, // finding primes and deriving a key
+    STAT_PHASE_KEY_LOAD, // reading a key and preparing its exponentiation state
+    STAT_PHASE_PARSE, // reading input and converting it into numbers
+    STAT_PHASE_EXP, // exponentiating blocks (CPU time includes every worker)
+    STAT_PHASE_OUTPUT, // converting results into bytes and writing them
+    STAT_PHASES,
+} stat_phase_t;
+
+// Output formats of stats_print().
+typedef enum {
+    STATS_NONE, // print nothing
+    STATS_TABLE, // human-readable table
+    STATS_JSON, // one JSON object
+} stats_format_t;
+
+// Start of a timed interval, set by stats_start().
+typedef struct {
+    uint64_t wall; // monotonic time in nanoseconds
+    uint64_t cpu; // process CPU time in nanoseconds
+} stat_timer_t;
+
+void stats_add(stat_counter_t counter, uint64_t value);
+
+uint64_t stats_get(stat_counter_t counter);
+
+void stats_start(stat_timer_t *timer);
+
+void stats_stop(stat_timer_t *timer, stat_phase_t phase);
+
+bool stats_parse_format(const char *name, stats_format_t *format);
+
+void stats_print(FILE *file, stats_format_t format);
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE // mremap()
+
+#include "stream.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Opens a source over file. With map set and file a regular file, the file is mapped read-only
+// from its current position with a sequential access hint; otherwise it is read through a
+// window_size byte buffer.
+void source_open(source_t *src, FILE *file, size_t window_size, bool map) {
+    struct stat st;
+    memset(src, 0, sizeof(source_t));
+    src->file = file;
+    long offset = ftell(file);
+    if (map && offset >= 0 && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size > offset) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            src->map = (uint8_t *) addr;
+            src->map_size = st.st_size;
+            src->pos = offset;
+            return;
+        }
+    }
+    src->window_size = window_size;
+    src->window = (uint8_t *) malloc(window_size);
+}
+
+// Opens a source over file that reads ahead STREAM_DEPTH chunks asynchronously, so that reading
+// overlaps with the processing of earlier data. Requests of up to window_size bytes that lie in
+// one chunk are handed out without copying.
+void source_open_pipelined(source_t *src, FILE *file, size_t window_size) {
+    memset(src, 0, sizeof(source_t));
+    src->file = file;
+    src->window_size = window_size;
+    src->window = (uint8_t *) malloc(window_size);
+    src->chunk_size = window_size > STREAM_CHUNK ? window_size : STREAM_CHUNK;
+    src->aio = aio_open(file, false, STREAM_DEPTH);
+    for (uint32_t i = 0; i < STREAM_DEPTH; i++) {
+        src->chunks[i] = (uint8_t *) malloc(src->chunk_size);
+        aio_submit(src->aio, i, src->chunks[i], src->chunk_size);
+    }
+    ssize_t got = aio_wait(src->aio, 0);
+    src->cur_len = got > 0 ? got : 0;
+    src->last = src->cur_len < src->chunk_size;
+}
+
+// Moves a pipelined source on to its next chunk once the current one has been consumed, and
+// requests the following read into the consumed chunk. Returns false at the end of the input;
+// a failed read ends the input like the end of the file.
+static bool source_advance(source_t *src) {
+    if (src->last) {
+        return false;
+    }
+    aio_submit(src->aio, src->cur, src->chunks[src->cur], src->chunk_size);
+    src->cur = (src->cur + 1) % STREAM_DEPTH;
+    ssize_t got = aio_wait(src->aio, src->cur);
+    src->cur_pos = 0;
+    src->cur_len = got > 0 ? got : 0;
+    src->last = src->cur_len < src->chunk_size;
+    return src->cur_len > 0;
+}
+
+// Returns true if the source hands out bytes straight from a mapping.
+bool source_mapped(source_t *src) {
+    return src->map != NULL;
+}
+
+// Returns the number of unread bytes, or -1 if the source is a stream of unknown length.
+int64_t source_remaining(source_t *src) {
+    return src->map ? (int64_t) (src->map_size - src->pos) : -1;
+}
+
+// Points data at the next size bytes (at most the window size for streams) and returns how many
+// are available. A return value below size means the end of the input has been reached.
+size_t source_next(source_t *src, size_t size, const uint8_t **data) {
+    if (src->map) {
+        size_t got = src->map_size - src->pos < size ? src->map_size - src->pos : size;
+        *data = src->map + src->pos;
+        src->pos += got;
+        return got;
+    }
+    size = size < src->window_size ? size : src->window_size;
+    *data = src->window;
+    if (!src->aio) {
+        return fread(src->window, sizeof(uint8_t), size, src->file);
+    }
+    if (src->cur_pos == src->cur_len && !source_advance(src)) {
+        return 0;
+    }
+    if (src->cur_len - src->cur_pos >= size) {
+        *data = src->chunks[src->cur] + src->cur_pos;
+        src->cur_pos += size;
+        return size;
+    }
+    size_t got = 0;
+    while (got < size && (src->cur_pos < src->cur_len || source_advance(src))) {
+        size_t part = src->cur_len - src->cur_pos < size - got ? src->cur_len - src->cur_pos
+                                                                : size - got;
+        memcpy(src->window + got, src->chunks[src->cur] + src->cur_pos, part);
+        src->cur_pos += part;
+        got += part;
+    }
+    return got;
+}
+
+// source_line() for a pipelined source: lines within one chunk are handed out without copying,
+// lines spanning chunks are assembled in the line buffer.
+static size_t source_line_pipelined(source_t *src, const uint8_t **line) {
+    size_t len = 0;
+    while (src->cur_pos < src->cur_len || source_advance(src)) {
+        const uint8_t *start = src->chunks[src->cur] + src->cur_pos;
+        const uint8_t *end
+            = (const uint8_t *) memchr(start, '\n', src->cur_len - src->cur_pos);
+        size_t part = end ? (size_t) (end - start) : src->cur_len - src->cur_pos;
+        src->cur_pos += part + (end != NULL);
+        if (len == 0 && end != NULL) {
+            if (part == 0) {
+                continue;
+            }
+            *line = start;
+            return part;
+        }
+        if (len + part > src->line_size) {
+            src->line_size = 2 * (len + part);
+            src->line = (char *) realloc(src->line, src->line_size);
+        }
+        memcpy(src->line + len, start, part);
+        len += part;
+        if (end != NULL && len > 0) {
+            break;
+        }
+    }
+    *line = (const uint8_t *) src->line;
+    return len;
+}
+
+// Points line at the next line of text, without its newline, and returns its length.
+// Returns 0 at the end of the input; empty lines are skipped.
+size_t source_line(source_t *src, const uint8_t **line) {
+    if (src->aio) {
+        return source_line_pipelined(src, line);
+    }
+    while (true) {
+        size_t len = 0;
+        if (src->map) {
+            if (src->pos >= src->map_size) {
+                return 0;
+            }
+            const uint8_t *start = src->map + src->pos;
+            const uint8_t *end
+                = (const uint8_t *) memchr(start, '\n', src->map_size - src->pos);
+            len = end ? (size_t) (end - start) : src->map_size - src->pos;
+            src->pos += len + (end != NULL);
+            *line = start;
+        } else {
+            ssize_t got = getline(&src->line, &src->line_size, src->file);
+            if (got <= 0) {
+                return 0;
+            }
+            len = got;
+            if (src->line[len - 1] == '\n') {
+                len -= 1;
+            }
+            *line = (const uint8_t *) src->line;
+        }
+        if (len > 0) {
+            return len;
+        }
+    }
+}
+
+// Releases the mapping or buffers of a source. The underlying file stays open.
+void source_close(source_t *src) {
+    if (src->map) {
+        munmap(src->map, src->map_size);
+    }
+    aio_close(&src->aio);
+    for (uint32_t i = 0; i < STREAM_DEPTH; i++) {
+        free(src->chunks[i]);
+    }
+    free(src->window);
+    free(src->line);
+    memset(src, 0, sizeof(source_t));
+}
+
+// Unmaps a mapped sink and truncates its file to the bytes written, leaving the stream
+// positioned after them so that later writes go through it. Returns false on failure.
+static bool sink_unmap(sink_t *sink) {
+    munmap(sink->map, sink->map_size);
+    sink->map = NULL;
+    sink->map_size = 0;
+    return ftruncate(fileno(sink->file), sink->start + sink->pos) == 0
+           && fseek(sink->file, (long) (sink->start + sink->pos), SEEK_SET) == 0;
+}
+
+// Grows the mapping of a mapped sink so that size more bytes fit. The new space is allocated on
+// disk first: a sparse file would turn a full disk into SIGBUS on a store to the mapping. If it
+// cannot be allocated, the sink drops the mapping and writes through the stream instead.
+// Returns false on failure.
+static bool sink_reserve(sink_t *sink, uint64_t size) {
+    if (sink->start + sink->pos + size <= sink->map_size) {
+        return true;
+    }
+    size_t grown = 2 * sink->map_size > sink->start + sink->pos + size
+                       ? 2 * sink->map_size
+                       : sink->start + sink->pos + size;
+    if (posix_fallocate(fileno(sink->file), sink->map_size, grown - sink->map_size) != 0) {
+        return sink_unmap(sink);
+    }
+    void *addr = mremap(sink->map, sink->map_size, grown, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    sink->map = (uint8_t *) addr;
+    sink->map_size = grown;
+    return true;
+}
+
+// Opens a sink over file. If reserve is nonzero and file is a regular file opened for reading
+// and writing, reserve bytes are allocated on disk after the current position and the file is
+// written through a shared mapping; otherwise, or if the space cannot be allocated, writes go
+// through the stream.
+void sink_open(sink_t *sink, FILE *file, uint64_t reserve) {
+    struct stat st;
+    memset(sink, 0, sizeof(sink_t));
+    sink->file = file;
+    fflush(file);
+    long offset = ftell(file);
+    if (reserve == 0 || offset < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (posix_fallocate(fileno(file), offset, reserve) != 0) {
+        ftruncate(fileno(file), offset);
+        return;
+    }
+    void *addr = mmap(NULL, offset + reserve, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    if (addr == MAP_FAILED) {
+        ftruncate(fileno(file), offset);
+        return;
+    }
+    madvise(addr, offset + reserve, MADV_SEQUENTIAL);
+    sink->map = (uint8_t *) addr;
+    sink->map_size = offset + reserve;
+    sink->start = offset;
+}
+
+// Opens a sink over file that writes STREAM_DEPTH chunks behind asynchronously, so that writing
+// overlaps with the production of later data.
+void sink_open_pipelined(sink_t *sink, FILE *file) {
+    memset(sink, 0, sizeof(sink_t));
+    sink->file = file;
+    fflush(file);
+    long offset = ftell(file);
+    sink->start = offset < 0 ? 0 : offset;
+    sink->aio = aio_open(file, true, STREAM_DEPTH);
+    for (uint32_t i = 0; i < STREAM_DEPTH; i++) {
+        sink->chunks[i] = (uint8_t *) malloc(STREAM_CHUNK);
+    }
+}
+
+// Hands the filled part of the current chunk of a pipelined sink to the pipeline, then waits
+// until the next chunk is free to fill.
+static void sink_submit(sink_t *sink) {
+    if (sink->fill == 0) {
+        return;
+    }
+    aio_submit(sink->aio, sink->cur, sink->chunks[sink->cur], sink->fill);
+    sink->cur = (sink->cur + 1) % STREAM_DEPTH;
+    sink->fill = 0;
+    sink->failed |= aio_wait(sink->aio, sink->cur) < 0;
+}
+
+// Submits the current chunk of a pipelined sink and waits until every write has completed.
+static void sink_drain(sink_t *sink) {
+    sink_submit(sink);
+    for (uint32_t i = 0; i < STREAM_DEPTH; i++) {
+        sink->failed |= aio_wait(sink->aio, i) < 0;
+    }
+}
+
+// Returns true if the sink writes through a mapping.
+bool sink_mapped(sink_t *sink) {
+    return sink->map != NULL;
+}
+
+// Appends size bytes of data to the sink.
+void sink_write(sink_t *sink, const void *data, size_t size) {
+    if (sink->aio) {
+        const uint8_t *bytes = (const uint8_t *) data;
+        sink->pos += size;
+        while (size > 0) {
+            size_t part = STREAM_CHUNK - sink->fill < size ? STREAM_CHUNK - sink->fill : size;
+            memcpy(sink->chunks[sink->cur] + sink->fill, bytes, part);
+            sink->fill += part;
+            bytes += part;
+            size -= part;
+            if (sink->fill == STREAM_CHUNK) {
+                sink_submit(sink);
+            }
+        }
+        return;
+    }
+    if (sink->map && !sink_reserve(sink, size)) {
+        sink->failed = true;
+        return;
+    }
+    if (!sink->map) { // not mapped, or the mapping could not grow
+        sink->failed |= fwrite(data, sizeof(uint8_t), size, sink->file) != size;
+        sink->pos += size;
+        return;
+    }
+    memcpy(sink->map + sink->start + sink->pos, data, size);
+    sink->pos += size;
+}
+
+// Overwrites size bytes at offset (relative to where the sink started) with data.
+// Returns false if the output cannot be rewound, e.g. when it is a pipe, or writing failed. A
+// failed write, or failing to seek back after it, also fails the sink.
+bool sink_patch(sink_t *sink, uint64_t offset, const void *data, size_t size) {
+    if (sink->map) {
+        memcpy(sink->map + sink->start + offset, data, size);
+        return true;
+    }
+    if (sink->aio) {
+        sink_drain(sink);
+        if (aio_positional(sink->aio)) {
+            off_t at = (off_t) (sink->start + offset);
+            sink->failed |= pwrite(fileno(sink->file), data, size, at) != (ssize_t) size;
+            return !sink->failed;
+        }
+    }
+    long end = ftell(sink->file);
+    if (end < 0 || fseek(sink->file, end - (long) (sink->pos - offset), SEEK_SET) != 0) {
+        return false;
+    }
+    sink->failed |= fwrite(data, sizeof(uint8_t), size, sink->file) != size;
+    sink->failed |= fseek(sink->file, end, SEEK_SET) != 0;
+    return !sink->failed;
+}
+
+// Flushes the sink, unmapping and truncating a mapped output file to the bytes written, or
+// waiting for the writes of a pipelined one.
+// Returns false if any write failed.
+bool sink_close(sink_t *sink) {
+    if (sink->map) {
+        sink->failed |= !sink_unmap(sink);
+    } else if (sink->aio) {
+        sink_drain(sink);
+        bool positional = aio_positional(sink->aio);
+        aio_close(&sink->aio);
+        for (uint32_t i = 0; i < STREAM_DEPTH; i++) {
+            free(sink->chunks[i]);
+        }
+        if (positional) {
+            fseek(sink->file, (long) (sink->start + sink->pos), SEEK_SET);
+        }
+        sink->failed |= fflush(sink->file) != 0 || ferror(sink->file);
+    } else {
+        sink->failed |= fflush(sink->file) != 0 || ferror(sink->file);
+    }
+    return !sink->failed;
+}
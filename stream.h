@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "aio.h"
+
+// Buffers in flight for pipelined sources and sinks: one being consumed or filled while the
+// others are read ahead or written behind.
+#define STREAM_DEPTH 3
+#define STREAM_CHUNK (256 * 1024)
+
+// Input of the file-level routines: a stdio stream read through one reused window, a read-only
+// mapping of a regular file whose bytes are handed out without copying, or a pipeline of chunks
+// read ahead asynchronously.
+typedef struct {
+    FILE *file;
+    uint8_t *map; // mapping of the whole file, or NULL when reading through the window
+    size_t map_size;
+    size_t pos; // next unread byte of the mapping
+    uint8_t *window; // reused read buffer for streams
+    size_t window_size;
+    char *line; // reused line buffer for streams
+    size_t line_size;
+    aio_t *aio; // reads in flight, or NULL when not pipelined
+    uint8_t *chunks[STREAM_DEPTH];
+    size_t chunk_size;
+    uint32_t cur; // chunk being consumed
+    size_t cur_pos, cur_len; // next unread byte and bytes read of the current chunk
+    bool last; // a read came up short: no further chunks are requested
+} source_t;
+
+// Output of the file-level routines: a stdio stream, a shared mapping of a regular file that is
+// preallocated to an expected size and truncated to the bytes actually written, or a pipeline of
+// chunks written behind asynchronously.
+typedef struct {
+    FILE *file;
+    uint8_t *map; // mapping of the output file, or NULL when writing to the stream
+    size_t map_size;
+    uint64_t start; // file offset the mapping or pipeline starts writing at
+    uint64_t pos; // bytes written after start
+    bool failed;
+    aio_t *aio; // writes in flight, or NULL when not pipelined
+    uint8_t *chunks[STREAM_DEPTH];
+    uint32_t cur; // chunk being filled
+    size_t fill; // bytes in the current chunk
+} sink_t;
+
+void source_open(source_t *src, FILE *file, size_t window_size, bool map);
+
+void source_open_pipelined(source_t *src, FILE *file, size_t window_size);
+
+bool source_mapped(source_t *src);
+
+int64_t source_remaining(source_t *src);
+
+size_t source_next(source_t *src, size_t size, const uint8_t **data);
+
+size_t source_line(source_t *src, const uint8_t **line);
+
+void source_close(source_t *src);
+
+void sink_open(sink_t *sink, FILE *file, uint64_t reserve);
+
+void sink_open_pipelined(sink_t *sink, FILE *file);
+
+bool sink_mapped(sink_t *sink);
+
+void sink_write(sink_t *sink, const void *data, size_t size);
+
+bool sink_patch(sink_t *sink, uint64_t offset, const void *data, size_t size);
+
+bool sink_close(sink_t *sink);
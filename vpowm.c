@@ -0,0 +1,414 @@
+#include "vpowm.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VPOWM_X86 1
+#else
+#define VPOWM_X86 0
+#endif
+
+#define VPOWM_ALIGN 64 // bytes, the width of the widest vector
+
+// Digits a lane of the AVX2 kernel adds up between carry propagations: each iteration adds two
+// products below 2^58 to a digit, so 8 of them stay well below 2^64.
+#define VPOWM_AVX2_SPAN 8
+
+// Montgomery multiplication of every lane, storing a * b * R^-1 mod n in out, where a, b < 2n give
+// out < 2n. out may alias a or b.
+typedef void (*vpowm_mul_fn)(vpowm_t *vp, uint64_t *out, const uint64_t *a, const uint64_t *b);
+
+#if VPOWM_X86
+// Operand scanning with radix-2^52 digits: vpmadd52luq and vpmadd52huq add the low and high 52
+// bits of digit products to 64-bit accumulators, so carries are only propagated once at the end.
+// Each accumulator takes at most 4 * digits terms below 2^52, which fits for any modulus of up to
+// VPOWM_BITS_MAX bits.
+__attribute__((target("avx512f,avx512ifma"))) static void vpowm_mul_ifma(
+    vpowm_t *vp, uint64_t *out, const uint64_t *a, const uint64_t *b) {
+    size_t digits = vp->digits;
+    __m512i *t = (__m512i *) vp->scratch;
+    const __m512i *va = (const __m512i *) a, *vb = (const __m512i *) b;
+    const __m512i *vn = (const __m512i *) vp->n;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ninv = _mm512_set1_epi64((long long) vp->ninv);
+    const __m512i mask = _mm512_set1_epi64((1LL << 52) - 1);
+    for (size_t j = 0; j < 2 * digits + 1; j++) {
+        t[j] = zero;
+    }
+    for (size_t i = 0; i < digits; i++) {
+        __m512i *ti = t + i;
+        __m512i bi = vb[i];
+        // q <- (t[i] + a[0] * b[i]) * -n^-1 mod 2^52, so that adding q * n clears digit i
+        ti[0] = _mm512_madd52lo_epu64(ti[0], va[0], bi);
+        __m512i q = _mm512_madd52lo_epu64(zero, ti[0], ninv);
+        ti[0] = _mm512_madd52lo_epu64(ti[0], vn[0], q);
+        ti[1] = _mm512_madd52hi_epu64(ti[1], va[0], bi);
+        ti[1] = _mm512_madd52hi_epu64(ti[1], vn[0], q);
+        ti[1] = _mm512_add_epi64(ti[1], _mm512_srli_epi64(ti[0], 52));
+        for (size_t j = 1; j < digits; j++) {
+            __m512i aj = va[j], nj = vn[j];
+            __m512i lo = _mm512_madd52lo_epu64(ti[j], aj, bi);
+            ti[j] = _mm512_madd52lo_epu64(lo, nj, q);
+            __m512i hi = _mm512_madd52hi_epu64(ti[j + 1], aj, bi);
+            ti[j + 1] = _mm512_madd52hi_epu64(hi, nj, q);
+        }
+    }
+    // the product divided by R is left in the high digits; bring them back below 2^52
+    __m512i *vout = (__m512i *) out;
+    __m512i carry = zero;
+    for (size_t j = 0; j < digits; j++) {
+        __m512i v = _mm512_add_epi64(t[digits + j], carry);
+        vout[j] = _mm512_and_si512(v, mask);
+        carry = _mm512_srli_epi64(v, 52);
+    }
+}
+
+// Operand scanning with radix-2^29 digits: vpmuludq multiplies the low 32 bits of each 64-bit
+// lane, so whole digit products are accumulated, and carries are propagated through the
+// accumulators every VPOWM_AVX2_SPAN digits before they could overflow.
+__attribute__((target("avx2"))) static void vpowm_mul_avx2(
+    vpowm_t *vp, uint64_t *out, const uint64_t *a, const uint64_t *b) {
+    size_t digits = vp->digits;
+    __m256i *t = (__m256i *) vp->scratch;
+    const __m256i *va = (const __m256i *) a, *vb = (const __m256i *) b;
+    const __m256i *vn = (const __m256i *) vp->n;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ninv = _mm256_set1_epi64x((long long) vp->ninv);
+    const __m256i mask = _mm256_set1_epi64x((1LL << 29) - 1);
+    for (size_t j = 0; j < 2 * digits + 1; j++) {
+        t[j] = zero;
+    }
+    for (size_t i = 0; i < digits; i++) {
+        __m256i *ti = t + i;
+        __m256i bi = vb[i];
+        // q <- (t[i] + a[0] * b[i]) * -n^-1 mod 2^29, so that adding q * n clears digit i
+        ti[0] = _mm256_add_epi64(ti[0], _mm256_mul_epu32(va[0], bi));
+        __m256i q = _mm256_and_si256(_mm256_mul_epu32(ti[0], ninv), mask);
+        ti[0] = _mm256_add_epi64(ti[0], _mm256_mul_epu32(vn[0], q));
+        ti[1] = _mm256_add_epi64(ti[1], _mm256_srli_epi64(ti[0], 29));
+        for (size_t j = 1; j < digits; j++) {
+            __m256i ab = _mm256_mul_epu32(va[j], bi), qn = _mm256_mul_epu32(vn[j], q);
+            ti[j] = _mm256_add_epi64(ti[j], _mm256_add_epi64(ab, qn));
+        }
+        if ((i + 1) % VPOWM_AVX2_SPAN == 0 && digits > 1) {
+            // one carry step over the live digits i + 1 .. i + digits, from the top down
+            ti[digits] = _mm256_add_epi64(ti[digits], _mm256_srli_epi64(ti[digits - 1], 29));
+            for (size_t j = digits - 1; j > 1; j--) {
+                __m256i low = _mm256_and_si256(ti[j], mask);
+                ti[j] = _mm256_add_epi64(low, _mm256_srli_epi64(ti[j - 1], 29));
+            }
+            ti[1] = _mm256_and_si256(ti[1], mask);
+        }
+    }
+    __m256i *vout = (__m256i *) out;
+    __m256i carry = zero;
+    for (size_t j = 0; j < digits; j++) {
+        __m256i v = _mm256_add_epi64(t[digits + j], carry);
+        vout[j] = _mm256_and_si256(v, mask);
+        carry = _mm256_srli_epi64(v, 29);
+    }
+}
+#endif
+
+// Returns the multiplication of a kernel.
+static vpowm_mul_fn vpowm_mul_of(vpowm_kernel_t kernel) {
+#if VPOWM_X86
+    switch (kernel) {
+    case VPOWM_IFMA: return vpowm_mul_ifma;
+    case VPOWM_AVX2: return vpowm_mul_avx2;
+    case VPOWM_SCALAR: return NULL;
+    }
+#else
+    (void) kernel;
+#endif
+    return NULL;
+}
+
+// Returns true if the CPU runs the kernel.
+bool vpowm_supported(vpowm_kernel_t kernel) {
+#if VPOWM_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+    case VPOWM_IFMA:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+    case VPOWM_AVX2: return __builtin_cpu_supports("avx2");
+    case VPOWM_SCALAR: return true;
+    }
+    return false;
+#else
+    return kernel == VPOWM_SCALAR;
+#endif
+}
+
+static vpowm_kernel_t vpowm_selected = VPOWM_SCALAR;
+static pthread_once_t vpowm_once = PTHREAD_ONCE_INIT;
+
+// Picks the widest kernel the CPU supports, or the one named by the environment variable
+// RSA_VPOWM (scalar, avx2 or ifma) if the CPU supports that, and keeps it only if it passes the
+// quick self test. make check compares the kernels with mpz_powm() thoroughly.
+static void vpowm_pick(void) {
+    vpowm_kernel_t kernel = VPOWM_SCALAR;
+    const char *name = getenv("RSA_VPOWM");
+    if (name != NULL && strcmp(name, vpowm_kernel_name(VPOWM_AVX2)) == 0) {
+        kernel = VPOWM_AVX2;
+    } else if (name != NULL && strcmp(name, vpowm_kernel_name(VPOWM_IFMA)) == 0) {
+        kernel = VPOWM_IFMA;
+    } else if (name == NULL) {
+        kernel = vpowm_supported(VPOWM_IFMA) ? VPOWM_IFMA
+                 : vpowm_supported(VPOWM_AVX2) ? VPOWM_AVX2
+                                               : VPOWM_SCALAR;
+    }
+    if (!vpowm_supported(kernel) || !vpowm_self_test(kernel)) {
+        kernel = VPOWM_SCALAR;
+    }
+    vpowm_selected = kernel;
+}
+
+// Returns the kernel to exponentiate batches of blocks with, chosen once per process.
+vpowm_kernel_t vpowm_select(void) {
+    pthread_once(&vpowm_once, vpowm_pick);
+    return vpowm_selected;
+}
+
+// Returns the name of a kernel.
+const char *vpowm_kernel_name(vpowm_kernel_t kernel) {
+    switch (kernel) {
+    case VPOWM_SCALAR: return "scalar";
+    case VPOWM_AVX2: return "avx2";
+    case VPOWM_IFMA: return "ifma";
+    }
+    return "unknown";
+}
+
+// Returns the number of bases a kernel exponentiates at once.
+uint32_t vpowm_kernel_lanes(vpowm_kernel_t kernel) {
+    switch (kernel) {
+    case VPOWM_IFMA: return 8;
+    case VPOWM_AVX2: return 4;
+    case VPOWM_SCALAR: return 1;
+    }
+    return 1;
+}
+
+// Stores the digits of a (0 <= a < R) in lane of the vector number v.
+static void vpowm_load(const vpowm_t *vp, uint64_t *v, uint32_t lane, mpz_t a) {
+    const mp_limb_t *limbs = mpz_limbs_read(a);
+    size_t size = mpz_size(a);
+    uint64_t mask = ((uint64_t) 1 << vp->digit_bits) - 1;
+    for (size_t i = 0; i < vp->digits; i++) {
+        size_t bit = i * vp->digit_bits, limb = bit / 64, shift = bit % 64;
+        uint64_t digit = limb < size ? limbs[limb] >> shift : 0;
+        if (shift + vp->digit_bits > 64 && limb + 1 < size) {
+            digit |= limbs[limb + 1] << (64 - shift);
+        }
+        v[i * vp->lanes + lane] = digit & mask;
+    }
+}
+
+// Stores the number in lane of the vector number v, which is at most n, reduced mod n in out.
+static void vpowm_store(vpowm_t *vp, mpz_t out, const uint64_t *v, uint32_t lane) {
+    size_t size = (vp->digits * vp->digit_bits + 63) / 64 + 1;
+    mp_limb_t *limbs = mpz_limbs_write(out, size);
+    memset(limbs, 0, size * sizeof(mp_limb_t));
+    for (size_t i = 0; i < vp->digits; i++) {
+        size_t bit = i * vp->digit_bits, limb = bit / 64, shift = bit % 64;
+        uint64_t digit = v[i * vp->lanes + lane];
+        limbs[limb] |= digit << shift;
+        if (shift > 0) {
+            limbs[limb + 1] |= digit >> (64 - shift);
+        }
+    }
+    mpz_limbs_finish(out, size);
+    if (mpz_cmp(out, vp->modulus) >= 0) {
+        mpz_sub(out, out, vp->modulus);
+    }
+}
+
+// Stores a (0 <= a < R) in every lane of v.
+static void vpowm_broadcast(const vpowm_t *vp, uint64_t *v, mpz_t a) {
+    vpowm_load(vp, v, 0, a);
+    for (size_t i = 0; i < vp->digits; i++) {
+        for (uint32_t lane = 1; lane < vp->lanes; lane++) {
+            v[i * vp->lanes + lane] = v[i * vp->lanes];
+        }
+    }
+}
+
+// Initializes a vector context for the exponent and modulus of the set-up scalar context pm.
+// Returns false, leaving vp cleared, if kernel is VPOWM_SCALAR, pm does not use Montgomery form or
+// its modulus is larger than VPOWM_BITS_MAX bits.
+bool vpowm_init(vpowm_t *vp, const powm_t *pm, vpowm_kernel_t kernel) {
+    memset(vp, 0, sizeof(vpowm_t));
+    mpz_inits(vp->modulus, vp->t, NULL);
+    if (kernel == VPOWM_SCALAR || vpowm_mul_of(kernel) == NULL || !pm->mont) {
+        return false;
+    }
+    mpz_t modulus;
+    mpz_roinit_n(modulus, pm->mt.n, pm->mt.size);
+    size_t bits = mpz_sizeinbase(modulus, 2);
+    if (bits > VPOWM_BITS_MAX) {
+        return false;
+    }
+    mpz_set(vp->modulus, modulus);
+    vp->kernel = kernel;
+    vp->lanes = vpowm_kernel_lanes(kernel);
+    vp->digit_bits = kernel == VPOWM_IFMA ? 52 : 29;
+    vp->digits = (bits + 2 + vp->digit_bits - 1) / vp->digit_bits; // R >= 4n
+    vp->ninv = pm->mt.ninv & (((uint64_t) 1 << vp->digit_bits) - 1);
+    vp->window = pm->window;
+    vp->bits = pm->bits;
+    vp->nsteps = pm->nsteps;
+    vp->steps = (powm_step_t *) malloc((pm->nsteps + 1) * sizeof(powm_step_t));
+    memcpy(vp->steps, pm->steps, pm->nsteps * sizeof(powm_step_t));
+
+    // n, r2, one, unit, the table, acc and square, then the product scratch
+    size_t entries = (size_t) 1 << (vp->window - 1);
+    size_t number = vp->digits * vp->lanes;
+    size_t words = (4 + entries + 2) * number + (2 * vp->digits + 1) * vp->lanes;
+    size_t bytes = (words * sizeof(uint64_t) + VPOWM_ALIGN - 1) / VPOWM_ALIGN * VPOWM_ALIGN;
+    uint64_t *mem = (uint64_t *) aligned_alloc(VPOWM_ALIGN, bytes);
+    memset(mem, 0, bytes);
+    vp->mem = mem;
+    vp->n = mem;
+    vp->r2 = vp->n + number;
+    vp->one = vp->r2 + number;
+    vp->unit = vp->one + number;
+    vp->table = vp->unit + number;
+    vp->acc = vp->table + entries * number;
+    vp->square = vp->acc + number;
+    vp->scratch = vp->square + number;
+
+    // R mod n and R^2 mod n for R = 2^(digits * digit_bits)
+    mpz_t r;
+    mpz_init(r);
+    vpowm_broadcast(vp, vp->n, vp->modulus);
+    mpz_setbit(r, vp->digits * vp->digit_bits);
+    mpz_mod(vp->t, r, vp->modulus);
+    vpowm_broadcast(vp, vp->one, vp->t);
+    mpz_mul(r, vp->t, vp->t);
+    mpz_mod(vp->t, r, vp->modulus);
+    vpowm_broadcast(vp, vp->r2, vp->t);
+    mpz_set_ui(r, 1);
+    vpowm_broadcast(vp, vp->unit, r);
+    mpz_clear(r);
+    return true;
+}
+
+// Clears and frees all memory used by a vector context.
+void vpowm_clear(vpowm_t *vp) {
+    mpz_clears(vp->modulus, vp->t, NULL);
+    free(vp->steps);
+    free(vp->mem);
+    vp->steps = NULL;
+    vp->mem = NULL;
+}
+
+// Exponentiates the count bases like vpowm(), without counting them in the stats.
+static void vpowm_run(vpowm_t *vp, mpz_t out[], mpz_t base[], uint32_t count) {
+    vpowm_mul_fn mul = vpowm_mul_of(vp->kernel);
+    size_t number = vp->digits * vp->lanes;
+    size_t entries = (size_t) 1 << (vp->window - 1);
+    // table[0] <- every base in Montgomery form; idle lanes exponentiate 0
+    memset(vp->table, 0, number * sizeof(uint64_t));
+    for (uint32_t lane = 0; lane < count; lane++) {
+        if (mpz_sgn(base[lane]) < 0 || mpz_cmp(base[lane], vp->modulus) >= 0) {
+            mpz_mod(vp->t, base[lane], vp->modulus);
+            vpowm_load(vp, vp->table, lane, vp->t);
+        } else {
+            vpowm_load(vp, vp->table, lane, base[lane]);
+        }
+    }
+    mul(vp, vp->table, vp->table, vp->r2);
+    if (entries > 1) {
+        mul(vp, vp->square, vp->table, vp->table); // square <- base^2
+        for (size_t k = 1; k < entries; k++) { // table[k] <- base^(2k + 1)
+            mul(vp, vp->table + k * number, vp->table + (k - 1) * number, vp->square);
+        }
+    }
+    // the same steps as powm(), applied to every lane
+    memcpy(vp->acc, vp->one, number * sizeof(uint64_t)); // acc <- 1 in Montgomery form
+    for (size_t i = 0; i < vp->nsteps; i++) {
+        powm_step_t step = vp->steps[i];
+        for (uint32_t j = 0; j < step.squares; j++) {
+            mul(vp, vp->acc, vp->acc, vp->acc);
+        }
+        if (step.digit != 0) {
+            const uint64_t *power = vp->table + (step.digit >> 1) * number;
+            if (i == 0) {
+                memcpy(vp->acc, power, number * sizeof(uint64_t));
+            } else {
+                mul(vp, vp->acc, vp->acc, power);
+            }
+        }
+    }
+    mul(vp, vp->acc, vp->acc, vp->unit); // out of Montgomery form, leaving at most n
+    for (uint32_t lane = 0; lane < count; lane++) {
+        vpowm_store(vp, out[lane], vp->acc, lane);
+    }
+}
+
+// Raises base[i] to the context's exponent modulo its modulus and stores it in out[i], for the
+// count (at most lanes) bases at once. out may alias base.
+void vpowm(vpowm_t *vp, mpz_t out[], mpz_t base[], uint32_t count) {
+    stats_add(STAT_POWM_CALLS, count);
+    stats_add(STAT_POWM_BITS, vp->bits * count);
+    vpowm_run(vp, out, base, count);
+}
+
+// Checks the kernel against mpz_powm() on one small modulus with e = 65537, for a full set of
+// lanes holding the largest base, 0 and random residues. Cheap enough to run once per process;
+// returns false if any result differs or the kernel cannot run here.
+bool vpowm_self_test(vpowm_kernel_t kernel) {
+    if (kernel == VPOWM_SCALAR) {
+        return true;
+    }
+    if (!vpowm_supported(kernel)) {
+        return false;
+    }
+    gmp_randstate_t rs;
+    gmp_randinit_mt(rs);
+    gmp_randseed_ui(rs, 2021);
+    mpz_t n, e, base[VPOWM_LANES_MAX], out[VPOWM_LANES_MAX], expected;
+    mpz_inits(n, e, expected, NULL);
+    for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+        mpz_inits(base[i], out[i], NULL);
+    }
+    // 255 bits take several digits in either radix, and their top digit is partly filled
+    mpz_urandomb(n, rs, 255);
+    mpz_setbit(n, 254);
+    mpz_setbit(n, 0);
+    mpz_set_ui(e, 65537);
+    powm_t pm;
+    vpowm_t vp;
+    powm_init(&pm, e, n);
+    bool ok = vpowm_init(&vp, &pm, kernel);
+    for (uint32_t i = 0; i < vp.lanes && ok; i++) {
+        mpz_urandomm(base[i], rs, n);
+    }
+    if (ok) {
+        mpz_sub_ui(base[0], n, 1); // the largest base, and base[1] the smallest
+        mpz_set_ui(base[1], 0);
+        vpowm_run(&vp, out, base, vp.lanes);
+    }
+    for (uint32_t i = 0; i < vp.lanes && ok; i++) {
+        mpz_powm(expected, base[i], e, n);
+        ok = mpz_cmp(expected, out[i]) == 0;
+    }
+    vpowm_clear(&vp);
+    powm_clear(&pm);
+    for (uint32_t i = 0; i < VPOWM_LANES_MAX; i++) {
+        mpz_clears(base[i], out[i], NULL);
+    }
+    mpz_clears(n, e, expected, NULL);
+    gmp_randclear(rs);
+    return ok;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+
+// Lane-parallel modular exponentiation: one exponent and modulus, several bases at once, one per
+// SIMD lane. Numbers are held in Montgomery form as digits of digit_bits bits in 64-bit words,
+// stored digit-major so that digit i of every lane makes one vector.
+#define VPOWM_LANES_MAX 8
+#define VPOWM_BITS_MAX  16384 // largest modulus the kernels take
+
+// Vector kernels, chosen at runtime from what the CPU supports.
+typedef enum {
+    VPOWM_SCALAR, // no vector kernel: exponentiate one base at a time with powm()
+    VPOWM_AVX2, // 4 lanes of radix-2^29 digits multiplied with vpmuludq
+    VPOWM_IFMA, // 8 lanes of radix-2^52 digits multiplied with AVX-512 IFMA
+} vpowm_kernel_t;
+
+// Exponentiation context for a fixed (exponent, modulus) pair and kernel, set up from a scalar
+// powm_t whose recoded exponent it shares the steps of.
+typedef struct {
+    vpowm_kernel_t kernel;
+    uint32_t lanes;
+    uint32_t digit_bits;
+    size_t digits; // digits per number, with R = 2^(digits * digit_bits) >= 4n
+    uint64_t ninv; // -n^-1 mod 2^digit_bits
+    uint32_t window;
+    powm_step_t *steps;
+    size_t nsteps;
+    size_t bits; // exponent bits, counted by the stats
+    mpz_t modulus, t; // the modulus, and scratch for reducing bases
+    // digits * lanes words each, every value broadcast to all lanes: n, R^2 mod n, R mod n and 1
+    uint64_t *n, *r2, *one, *unit;
+    uint64_t *table; // odd powers base^1, base^3, ..., base^(2^window - 1) of every lane
+    uint64_t *acc, *square;
+    uint64_t *scratch; // 2 * digits + 1 vectors of unreduced product
+    void *mem; // 64-byte aligned block holding all of the above
+} vpowm_t;
+
+bool vpowm_supported(vpowm_kernel_t kernel);
+
+vpowm_kernel_t vpowm_select(void);
+
+const char *vpowm_kernel_name(vpowm_kernel_t kernel);
+
+uint32_t vpowm_kernel_lanes(vpowm_kernel_t kernel);
+
+bool vpowm_init(vpowm_t *vp, const powm_t *pm, vpowm_kernel_t kernel);
+
+void vpowm_clear(vpowm_t *vp);
+
+void vpowm(vpowm_t *vp, mpz_t out[], mpz_t base[], uint32_t count);
+
+bool vpowm_self_test(vpowm_kernel_t kernel);